@@ -0,0 +1,64 @@
+import os
+import shutil
+import subprocess
+import sys
+
+from build_wasm import src_files as wasm_src_files
+from build_wasm import sync_version_files, generate_keylib_files
+
+# Same sources as the WASM build, with the headless POSIX mdep layer
+src_files = [f for f in wasm_src_files if f != "src/mdep_wasm.c"] + ["src/mdep_posix.c"]
+
+# The executable is put next to the sources, so that KEYROOT (the parent
+# of its directory) defaults to the top of the repo.
+output = os.path.join("src", "key")
+
+def find_cc():
+    """Find a C compiler, honoring CC."""
+    for name in (os.environ.get("CC"), "cc", "gcc", "clang"):
+        if name and shutil.which(name):
+            return name
+    print("Unable to find a C compiler. Set CC or add cc to PATH.")
+    return None
+
+def compile_posix():
+    print("Compiling native headless build...")
+
+    cc = find_cc()
+    if cc is None:
+        sys.exit(1)
+
+    flags = [
+        cc,
+        "-Isrc",
+        "-o", output,
+        "-DMDEP_POSIX",
+        "-DMFTHREADS",  # decode MIDI file tracks on threads
+        "-pthread",
+        "-O2",
+    ]
+    # Extra flags (e.g. -g, -fsanitize=address) can be given in CFLAGS
+    flags += os.environ.get("CFLAGS", "").split()
+
+    cmd = flags + src_files + ["-lm"]
+
+    print(" ".join(cmd))
+    print("\nCompiling...")
+    result = subprocess.run(cmd, check=False, capture_output=True, text=True)
+    print(result.stdout)
+    print(result.stderr)
+
+    if result.returncode == 0:
+        print(f"\nSuccessfully built {output}")
+    else:
+        print(f"\nCompilation failed with return code {result.returncode}")
+        sys.exit(1)
+
+if __name__ == "__main__":
+    # Keep version-bearing source files in sync with VERSION before compiling.
+    sync_version_files()
+
+    # Generate keylib.k files before compiling
+    generate_keylib_files()
+
+    compile_posix()
@@ -42,6 +42,15 @@ bi_debug(int argc)
 	else if ( strcmp(t,"str") == 0 ) {
 		strstatsprint();
 	}
+	else if ( strcmp(t,"notes") == 0 ) {
+		ntstatsprint();
+	}
+	else if ( strcmp(t,"reclaim") == 0 ) {
+		reclaimstatsprint();
+	}
+	else if ( strcmp(t,"obj") == 0 ) {
+		objstatsprint();
+	}
 	else if ( strcmp(t,"strcheck") == 0 ) {
 		if ( strtabcheck() )
 			eprint("string table check: ok\n");
@@ -358,6 +367,15 @@ bi_taskinfo(int argc)
 	else if ( strcmp(type,"priority")==0 ) {
 		retval = numdatum(t->priority);
 	}
+	else if ( strcmp(type,"locks")==0 ) {
+		retval = numdatum(t->nlocks);
+	}
+	else if ( strcmp(type,"lockwaits")==0 ) {
+		retval = numdatum(t->lockwaits);
+	}
+	else if ( strcmp(type,"lockwaittime")==0 ) {
+		retval = numdatum(t->lockwaitms);
+	}
 	else {
 		execerror("taskinfo: Unrecognized argument (%s)",type);
 	}
@@ -551,7 +569,9 @@ bi_readphr(int argc)
 	fname = needstr("readphr",ARG(0));
 	if ( (pf=mpathsearch(fname)) != NULL )
 		fname = pf;
-	if ( (f=fopen(fname,"r")) == NULL )
+	/* binary, since it may hold a binary phrase */
+	OPENBINFILE(f,fname,"r");
+	if ( f == NULL )
 		ph = newph(0);
 	else {
 		ph = filetoph(f,fname);
@@ -560,6 +580,25 @@ bi_readphr(int argc)
 	ret(phrdatum(ph));
 }
 
+void
+bi_savephr(int argc)
+{
+	Phrasep ph;
+	char *fname;
+	FILE *f;
+
+	if ( argc != 2 )
+		execerror("usage: savephr(phrase,fname)");
+	ph = needphr("savephr",ARG(0));
+	fname = needstr("savephr",ARG(1));
+	OPENBINFILE(f,fname,"w");
+	if ( f == NULL )
+		execerror("savephr: can't open '%s' (%s)",fname,strerror(errno));
+	phtobinfile(f,ph);
+	myfclose(f);
+	ret(Nullval);
+}
+
 void
 bi_pathsearch(int argc)
 {
@@ -671,7 +710,11 @@ bi_midifile(int argc)
 	Datum d;
 	char *s, *pf;
 
-	if ( argc == 1 ) {
+	if ( argc == 1 && ARG(0).type == D_ARR ) {
+		/* encode it in memory, the result is an array of bytes */
+		d = arrtomfbytes(ARG(0).u.arr);
+	}
+	else if ( argc == 1 ) {
 		s = needstr("midifile",ARG(0));
 		if ( (pf=mpathsearch(s)) != NULL )
 			s = pf;
@@ -687,12 +730,77 @@ bi_midifile(int argc)
 		d = Nullval;
 	}
 	else {
-		execerror("usage: midifile(filename) or midifile(array,filename)");
+		execerror("usage: midifile(filename), midifile(array,filename), or midifile(array)");
 	}
 
 	ret(d);
 }
 
+void
+bi_midiopen(int argc)
+{
+	char *s, *pf;
+	long cachemax = -1;
+	int h;
+
+	if ( argc < 1 || argc > 2 )
+		execerror("usage: midiopen(filename [,cachesize])");
+	s = needstr("midiopen",ARG(0));
+	if ( argc > 1 )
+		cachemax = neednum("midiopen",ARG(1));
+	if ( (pf=mpathsearch(s)) != NULL )
+		s = pf;
+	h = mfopen(s,cachemax);
+	*Mfformat = mfformat(h);
+	ret(numdatum((long)h));
+}
+
+void
+bi_midiread(int argc)
+{
+	int h, track;
+	long start = -MAXCLICKS;
+	long end = MAXCLICKS;
+
+	if ( argc < 1 || argc > 4 )
+		execerror("usage: midiread(handle [,track [,start [,end]]])");
+	h = (int) neednum("midiread",ARG(0));
+	if ( argc == 1 )
+		ret(numdatum((long)mfntracks(h)));
+	else {
+		track = (int) neednum("midiread",ARG(1));
+		if ( argc > 2 )
+			start = neednum("midiread",ARG(2));
+		if ( argc > 3 )
+			end = neednum("midiread",ARG(3));
+		ret(phrdatum(mfquery(h,track,start,end)));
+	}
+}
+
+void
+bi_midiclose(int argc)
+{
+	if ( argc != 1 )
+		execerror("usage: midiclose(handle)");
+	mfclose((int)neednum("midiclose",ARG(0)));
+	ret(Nullval);
+}
+
+void
+bi_recfile(int argc)
+{
+	char *s = NULL;
+
+	if ( argc > 1 )
+		execerror("usage: recfile([filename])");
+	if ( argc > 0 )
+		s = needstr("recfile",ARG(0));
+	recfinish();
+	if ( s != NULL )
+		mfrecopen(s);
+	ret(Nullval);
+}
+
 void
 bi_split(int argc)
 {
@@ -1050,15 +1158,15 @@ void
 bi_lock(int argc)
 {
 	Symstr nm;
-	Lknode *lkhead, *lk;
-	Lknode *last = NULL;
+	Lknode *lkhead;
 	int rv = 0;
 	int tstonly = 0;
 
 	if ( argc < 1 || argc > 2 )
 		execerror("usage: lock(name [,test] )");
 
-	nm = datumstr(ARG(0));
+	/* locks are found by the (interned) name */
+	nm = strintern(datumstr(ARG(0)));
 	if ( argc > 1 )
 		tstonly = neednum("lock",ARG(1));
 
@@ -1066,40 +1174,44 @@ bi_lock(int argc)
 
 	/* value (number of tasks that had it locked already) */
 	/* is returned immediately, but the task may get 'unrun' below. */
-	if ( lkhead->owner != NULL ) {
-		rv++;
-		for ( lk=lkhead->notify; lk!=NULL; last=lk,lk=lk->notify )
-			rv++;
-	}
+	if ( lkhead->owner != NULL )
+		rv = 1 + lkhead->nnotify;
 	ret(numdatum(rv));
 
 	if ( tstonly )
 		return;
 
+	T->nlocks++;
 	if ( lkhead->owner == NULL ) {
 		/* Lock isn't owned by anyone, so the task become owner */
 		/* and continues normally. */
-		lkhead->owner = T;
+		lksetowner(lkhead,T);
 		lkhead->notify = NULL;
+		lkhead->lastnotify = NULL;
+		lkhead->nnotify = 0;
 		T->lock = lkhead;
-		if ( lkhead == lkhead->notify )
-			execerror("Internal error: lkhead==lkhead->notify!?\n");
 	}
 	else {
 		Lknode *nlk;
 		nlk = newlk(nm);
 		if ( nlk == lkhead )
 			execerror("Internal error: newlk==lkhead!?\n");
-		nlk->owner = T;
-		/* lkhead->notify points to list of pending locks.  Note that */
-		/* new locks are added to the end of this list. */
-		if ( last == NULL )
+		lksetowner(nlk,T);
+		/* lkhead->notify points to the queue of pending locks.  */
+		/* New locks are added to the end of it. */
+		nlk->lkhead = lkhead;
+		nlk->prevnotify = lkhead->lastnotify;
+		if ( lkhead->lastnotify == NULL )
 			lkhead->notify = nlk;
 		else
-			last->notify = nlk;
+			lkhead->lastnotify->notify = nlk;
+		lkhead->lastnotify = nlk;
+		lkhead->nnotify++;
 		if ( lkhead == lkhead->notify )
 			execerror("lkhead==lkhead->notify!????\n");
 		T->lock = nlk;
+		T->lockwaits++;
+		T->lockwaitstart = mdep_milliclock();
 		taskunrun(T,T_LOCKWAIT);
 	}
 }
@@ -1114,7 +1226,7 @@ bi_unlock(int argc)
 	if ( argc != 1 )
 		execerror("usage: unlock(name)");
 
-	nm = datumstr(ARG(0));
+	nm = strintern(datumstr(ARG(0)));
 
 	lk = findtoplk(nm);
 	t = lk->owner;
@@ -1227,9 +1339,12 @@ bi_priority(int argc)
 			if ( v > Currpriority ) {
 				/* check to make sure there's at least one */
 				/* task at that priority, so we don't hang. */
+				/* Runnable ones are checked first, */
+				/* without looking at every task. */
 				Cprio = v;
-				Anyrun = 0;
-				hashvisit(Tasktable,chkprio);
+				Anyrun = anyrunning(v);
+				if ( Anyrun == 0 )
+					hashvisit(Tasktable,chkprio);
 				if ( Anyrun == 0 )
 					execerror("Unable to do priority(%d) - no tasks could run!?",v);
 			}
@@ -1242,7 +1357,7 @@ bi_priority(int argc)
 			execerror("bad task id (%ld) given to priority",tid);
 		retval = t->priority;
 		if ( argc == 2 )
-			t->priority = v;
+			settaskpriority(t,v);
 	}
 	ret(numdatum(retval));
 }
@@ -1308,28 +1423,24 @@ bi_tempo(int argc)
 void
 bi_substr(int argc)
 {
-	Datum d;
 	int num, slen, len;
 	char *str;
-	char *free_this = NULL;
 	char *s = "substr";
 
 	if ( argc != 2 && argc != 3 )
 		execerror("usage: substr(string,start,length)");
 
 	(*SubstrCount)++;
-	str = needstr(s,ARG(0));
+	/* The result is copied, so the string isn't interned */
+	str = needtmpstr(s,ARG(0));
 
 	if ( *str == '\0' ) {
 		ret(strdatum(Nullstr));
 		return;
 	}
 
-	str = strsave(str);	/* we need to overwrite it */
-	free_this = str;
-
 	num = neednum(s,ARG(1));
-	slen = (long)strlen(str);
+	slen = (int)strlength(str);
 	if ( num > slen ) {
 		str = "";
 		slen = 0;
@@ -1339,18 +1450,14 @@ bi_substr(int argc)
 		str += num;
 		slen -= num;
 	} else {
-		free(free_this);
 		execerror("Invalid start value (%d) given to substr()",num);
 	}
 	if ( argc == 3 ) {
 		len = neednum(s,ARG(2));
-		if ( len < slen && len >= 0 ) {
-			str[len] = '\0';
-		}
+		if ( len < slen && len >= 0 )
+			slen = len;
 	}
-	d = strdatum(uniqstr(str));	/* do not merge with return(d)! */
-	free(free_this);
-	ret(d);
+	ret(strdatum(strresult(str,(long)slen)));
 }
 
 void
@@ -1514,7 +1621,16 @@ bi_coreleft(int argc)
 {
 	Datum d;
 
-	dummyusage(argc);
+	if ( argc > 0 ) {
+		char *t = needstr("coreleft",ARG(0));
+		if ( strcmp(t,"notes") == 0 )
+			ret(ntstatsarr());
+		else if ( strcmp(t,"reclaim") == 0 )
+			ret(reclaimstatsarr());
+		else
+			execerror("coreleft: unrecognized argument - %s",t);
+		return;
+	}
 #ifdef CORELEFT
 	d = numdatum(CORELEFT);
 #else
@@ -2034,6 +2150,50 @@ bi_put(int argc)
 	ret(numdatum(v));
 }
 
+void
+bi_getn(int argc)
+{
+	Fifo *f;
+	long max;
+
+	if ( argc != 2 )
+		execerror("usage: getn(fifo,max)");
+	f = needfifo("getn",ARG(0));
+	max = neednum("getn",ARG(1));
+	if ( max <= 0 )
+		execerror("getn: max must be > 0");
+	if ( max > INT_MAX )
+		max = INT_MAX;
+	if ( f == NULL )
+		ret(numdatum(*Eofval));
+	else {
+		getnfifo(f,(int)max);
+		/* Don't return a value, task blocks until read succeeds */
+	}
+}
+
+void
+bi_putn(int argc)
+{
+	int v;
+	Fifo *f;
+	Htablep arr;
+
+	if ( argc != 2 )
+		execerror("usage: putn(fifo,array)");
+	f = fifoptr(neednum("putn",ARG(0)));
+	arr = needarr("putn",ARG(1));
+	if ( f == NULL )
+		v = -1;
+	else {
+		if ( (f->flags & FIFO_READ) != 0 )
+			execerror("Attempt to putn() on a fifo (%ld) that is opened for reading!",fifonum(f));
+		putnfifo(f,arr);
+		v = fifosize(f);
+	}
+	ret(numdatum(v));
+}
+
 void
 bi_flush(int argc)
 {
@@ -2092,6 +2252,14 @@ bi_fifoctl(int argc)
 			}
 		}
 	}
+	else if ( strcmp(cmd,"intern") == 0 ) {
+		if ( f == NULL )
+			execerror("fifoctl(\"default\",\"intern\") isn't supported");
+		if ( strcmp(arg,"0") == 0 || strcmp(arg,"off") == 0 )
+			f->flags |= FIFO_NOINTERN;
+		else
+			f->flags &= (~FIFO_NOINTERN);
+	}
 	else {
 		execerror("Unrecognized cmd (%s) given to fifoctl()!?\n",cmd);
 	}
@@ -2695,10 +2863,7 @@ bi_object(int argc)
 	 */
 	d = ARG(0);
 	oid = d2oid(d);
-	for ( o = Topobj; o!=NULL; o=o->onext ) {
-		if ( o->id == oid )
-			break;
-	}
+	o = findobjnum(oid);
 	if ( o == NULL ) {
 		/* Create a new object with that id */
 		o = defaultobject(oid,COMPLAIN);
@@ -2766,11 +2931,11 @@ bi_objectinfo(int argc)
 	t = needstr("objectinfo",ARG(1));
 	if ( strcmp(t,"methods") == 0 ) {
 		Listarr = newarrdatum(0,32);
-		hashvisit(o->symbols, add_method_tolist);
+		objvisit(o, add_method_tolist);
 		retval = Listarr;
 	} else if ( strcmp(t,"data") == 0 ) {
 		Listarr = newarrdatum(0,32);
-		hashvisit(o->symbols, add_data_tolist);
+		objvisit(o, add_data_tolist);
 		retval = Listarr;
 	} else {
 		execerror("usage: objectinfo(object,type)");
@@ -2866,6 +3031,13 @@ struct bltinfo builtins[] = {
 /* FIFO-RELATED FUNCTIONS */
 	{ "get",		bi_get,		BI_GET },
 	{ "put",		bi_put,		BI_PUT },
+	{ "getn",		bi_getn,	BI_GETN },
+	{ "putn",		bi_putn,	BI_PUTN },
+	{ "midiopen",	bi_midiopen,	BI_MIDIOPEN },
+	{ "midiread",	bi_midiread,	BI_MIDIREAD },
+	{ "midiclose",	bi_midiclose,	BI_MIDICLOSE },
+	{ "recfile",	bi_recfile,	BI_RECFILE },
+	{ "savephr",	bi_savephr,	BI_SAVEPHR },
 	{ "open",		bi_open,	BI_OPEN },
 	{ "fifosize",	bi_fifosize,	BI_FIFOSIZE },
 	{ "flush",	bi_flush,	BI_FLUSH },
@@ -3047,5 +3219,12 @@ BLTINFUNC Bltinfuncs[] = {
 	bi_midi,
 	bi_bitmap,
 	bi_objectinfo,
-	o_fillpolygon
+	o_fillpolygon,
+	bi_getn,
+	bi_putn,
+	bi_midiopen,
+	bi_midiread,
+	bi_midiclose,
+	bi_recfile,
+	bi_savephr
 };
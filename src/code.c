@@ -789,7 +789,8 @@ callfuncd(Symbolp s)
 	}
 	if ( methdp->type != D_STR )
 		execerror("callfuncd got non-string method!?\n");
-	meth = methdp->u.str;
+	/* T->method outlives the stack value, so it's interned */
+	meth = strintern(methdp->u.str);
 
 	if ( funcd.type != D_CODEP ) {	/* quicker, 1 test in normal case */
 		/* If the value on the stack isn't a defined, then we look at */
@@ -925,7 +926,7 @@ callfuncd(Symbolp s)
 	}
 
 	if ( bi != 0 ) {
-		if (bi > 127) {
+		if (bi > BI_MAXCODE) {
 			eprint("Internal error: bi=%d\n", bi);
 		}
 		/* it's a built-in function - execute it right away */
@@ -277,22 +277,24 @@ Symstr
 addstr(Symstr s1,Symstr s2)
 {
 	char s[64];
-	int need;
+	long len1, len2;
 	Symstr p;
 
-	need = (long)strlen(s1)+(long)strlen(s2)+1;
-	/* avoid expensive kmalloc if we can use small buffer */
-	if ( need > (int)sizeof(s) ) {
-		Symstr snew;
-		snew = (Symstr) kmalloc((unsigned)need,"addstr");
-		strcpy(snew,(char*)s1);
-		strcat(snew,(char*)s2);
-		p = uniqstr((char*)snew);
-		kfree(snew);
+	len1 = strlength(s1);
+	len2 = strlength(s2);
+	if ( len2 == 0 )
+		return s1;
+	if ( len1 == 0 )
+		return s2;
+	/* Long results are transient, see strresult() */
+	if ( len1+len2+1 > (long)sizeof(s) ) {
+		p = strtransalloc(len1+len2);
+		memcpy(p,s1,(size_t)len1);
+		memcpy(p+len1,s2,(size_t)len2);
 	}
 	else {
-		strcpy(s,s1);
-		strcat(s,s2);
+		memcpy(s,s1,(size_t)len1);
+		memcpy(s+len1,s2,(size_t)len2+1);
 		p = uniqstr(s);
 	}
 	return p;
@@ -590,7 +592,7 @@ setval(Noteptr n,int field,Datum nv)
 
 #ifdef NTATTRIB
 	if ( field == ATTRIB ) {
-		attribof(n) = dtostr(nv);
+		attribof(n) = strintern(dtostr(nv));
 		return;
 	}
 #endif
@@ -831,6 +833,7 @@ assign(int type, int dottype)
 		}
 		s->stype = VAR;
 		*sdp = result;
+		strgcbarrier(result);
 		break;
 	case DOTASSIGN:
 		decruse(sd);
@@ -56,6 +56,8 @@ void bi_pow(int argc)
 ;
 void bi_readphr(int argc)
 ;
+void bi_savephr(int argc)
+;
 void bi_pathsearch(int argc)
 ;
 void bi_ascii(int argc)
@@ -70,6 +72,14 @@ void bi_rekeylib(int argc)
 ;
 void bi_midifile(int argc)
 ;
+void bi_midiopen(int argc)
+;
+void bi_midiread(int argc)
+;
+void bi_midiclose(int argc)
+;
+void bi_recfile(int argc)
+;
 void bi_split(int argc)
 ;
 void bi_cut(int argc)
@@ -195,6 +205,10 @@ void bi_get(int argc)
 ;
 void bi_put(int argc)
 ;
+void bi_getn(int argc)
+;
+void bi_putn(int argc)
+;
 void bi_flush(int argc)
 ;
 void bi_fifoctl(int argc)
@@ -1,14 +1,8 @@
 void initfifos(void)
 ;
-Fifodata * newfd(Datum d)
-;
-#ifdef THIS_CAUSES_PROBLEM_ON_MAC_AND_DOESNT_REALLY_DO_ANYTHING_ANYWAY
-#endif
-void freefd(Fifodata *fd)
-;
 Fifo * fifoptr(long n)
 ;
-int findport(Hnodep h)
+void setfifoport(Fifo *f,PORTHANDLE port)
 ;
 Fifo * port2fifo(PORTHANDLE port)
 ;
@@ -17,16 +11,12 @@ void closefifo(Fifo *f)
 #ifdef PIPES
 #else
 #endif
-#ifdef lint
-#endif
 void deletefifo(Fifo *f)
 ;
 void freeff(Fifo *f)
 ;
 void flushfifo(Fifo *f)
 ;
-#ifdef lint
-#endif
 void flushlinebuff(Fifo* f)
 ;
 void closeallfifos(void)
@@ -64,6 +54,8 @@ int newfifo(char *fname,char *mode,char *porttype,Fifo **pf1,Fifo **pf2)
 #endif
 int fifosize(Fifo *f)
 ;
+Datum bytesdatum(char *p,int n)
+;
 void getfromfifo(Fifo *f)
 ;
 Datum removedatafromfifo(Fifo *f)
@@ -74,7 +66,11 @@ void unblocktask(Ktaskp t)
 ;
 void getfifo(Fifo *f)
 ;
+void getnfifo(Fifo *f,int max)
+;
 void fputit(char *s)
 ;
 void putfifo(Fifo *f,Datum d)
 ;
+void putnfifo(Fifo *f,Htablep arr)
+;
@@ -1,2 +1,12 @@
 void arrtomf(Htablep arr,char *fname)
 ;
+Datum arrtomfbytes(Htablep arr)
+;
+int mfrecording(void)
+;
+void mfrecopen(char *fname)
+;
+void mfrecwrite(Noteptr n,Noteptr limit)
+;
+void mfrecclose(long leng)
+;
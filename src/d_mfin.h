@@ -1,54 +1,12 @@
-int mgetc(void)
-;
-void k_header(int f,int n,int d)
-;
-#ifdef WARNEVEN
-#endif
-void k_starttrack(void)
-;
-void putnfree(void)
-;
-void putallnotes(void)
-;
-void k_endtrack(void)
-;
-void k_noteon(int chan,int pitch,int vol)
-;
-Noteptr queuenote(int chan,int pitch,int vol,int type)
-;
-void k_noteoff(int chan,int pitch,int vol)
-;
-void k_pressure(int chan,int pitch,int press)
-;
-void k_controller(int chan,int control,int value)
-;
-void k_pitchbend(int chan,int msb,int lsb)
-;
-void k_program(int chan,int program)
-;
-void k_chanpressure(int chan,int press)
-;
-void threebytes(int c1,int c2,int c3)
-;
-void twobytes(int c1,int c2)
-;
-void queuemess(Unchar *mess,int leng)
-;
-void k_arbitrary(int leng,Unchar *mess)
-;
-void k_tempo(long tempo)
-;
-void k_timesig(unsigned nn,unsigned dd,unsigned cc,unsigned bb)
-;
-void k_keysig(unsigned sf,unsigned mi)
+int mftoarr(char *mfname,Htablep arr)
 ;
-void k_chanprefix(unsigned c)
+int mfopen(char *mfname,long cachemax)
 ;
-void k_seqnum(int n)
+int mfntracks(int id)
 ;
-void k_smpte(unsigned hr,unsigned mn,unsigned se,unsigned fr,unsigned ff)
+int mfformat(int id)
 ;
-void k_metatext(int type,int leng,Unchar *mess)
+Phrasep mfquery(int id,int track,long start,long end)
 ;
-int mftoarr(char *mfname,Htablep arr)
+void mfclose(int id)
 ;
@@ -20,6 +20,12 @@ Noteptr  ntcopy(register Noteptr n)
 #endif
 void freents(Noteptr n)
 ;
+void ntrelease(Noteptr n)
+;
+Datum ntstatsarr(void)
+;
+void ntstatsprint(void)
+;
 int bytescmp(Noteptr n1,Noteptr n2)
 ;
 int utypeof(Noteptr nt)
@@ -86,6 +86,10 @@ void notemess(Noteptr q)
 #endif
 void ntrecord(Noteptr n)
 ;
+void recflush(int all)
+;
+void recfinish(void)
+;
 #ifdef OLDSTUFF
 #endif
 void clrsched(Sched **as)
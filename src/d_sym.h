@@ -8,8 +8,22 @@ void freesy(register Symbolp sy)
 ;
 Symbolp findsym(register char *p,Htablep symbols)
 ;
+void objslotsinit(Kobjectp o)
+;
+Symbolp objfindsym(Kobjectp o,Symstr p)
+;
+Symbolp objinstall(Kobjectp o,Symstr p)
+;
+void objvisit(Kobjectp o,HNODEFUNC f)
+;
+void objclear(Kobjectp o)
+;
 Symbolp findobjsym(char *p,Kobjectp o,Kobjectp *foundobj)
 ;
+Symbolp findobjsymcache(Unchar *site,char *p,Kobjectp o,Kobjectp *foundobj)
+;
+void objstatsprint(void)
+;
 Symbolp uniqvar(char* pre)
 ;
 Symbolp lookup(char *p)
@@ -40,6 +54,8 @@ Fifo * needvalidfifo(char *s,Datum d)
 ;
 char * needstr(char *s,Datum d)
 ;
+char * needtmpstr(char *s,Datum d)
+;
 Htablep needarr(char *s,Datum d)
 ;
 Phrasep needphr(char *s,Datum d)
@@ -82,6 +98,24 @@ void initstrs(void)
 #endif
 void pfprint(char *s)
 ;
+#ifdef NTATTRIB
+#endif
+#ifdef NTATTRIB
+#else
+#endif
+#ifdef NTATTRIB
+#endif
+#ifdef NTATTRIB
+#else
+#endif
+void phtobinfile(FILE *f,Phrasep p)
+;
+#ifdef NTATTRIB
+#endif
+Phrasep binfiletoph(FILE *f,char *fname)
+;
+int isbinphrase(FILE *f)
+;
 void phtofile(FILE *f,Phrasep p)
 ;
 void vartofile(Symbolp s, char *fname)
@@ -106,6 +140,8 @@ void freehn(Hnodep hn)
 #endif
 Htablep newht(int size)
 ;
+void htchanged(Htablep ht)
+;
 void clearht(Htablep ht)
 ;
 #ifdef lint
@@ -116,16 +152,34 @@ void htlists(void)
 ;
 Symstr uniqstr(char *s)
 ;
+Symstr strtransalloc(long len)
+;
+Symstr strresult(char *s,long len)
+;
+Symstr strintern(Symstr s)
+;
+long strlength(Symstr s)
+;
 void strstatsprint(void)
 ;
 int strtabcheck(void)
 ;
 int strgcdryrun(int verbose)
 ;
+void strgcslice(void)
+;
+void strgcshade(Datum d)
+;
+void strgcnewht(Htablep ht)
+;
 int isundefd(Symbolp s)
 ;
+void htfinishrehash(Htablep ht)
+;
 Hnodep hashtable(Htablep ht,Datum key,int action)
 ;
+int htpopdense(Htablep ht)
+;
 Symbolp arraysym(Htablep arr,Datum subs,int action)
 ;
 int arrsize(Htablep arr)
@@ -136,3 +190,5 @@ Datum * arrlist(Htablep arr,int *asize,int sortit)
 ;
 void hashvisit(Htablep arr,HNODEFUNC f)
 ;
+void hashvisitreset(void)
+;
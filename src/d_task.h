@@ -145,7 +145,9 @@ void initstack(Ktaskp t)
 ;
 Ktaskp newtask(Codep cp)
 ;
-void setrunning(Ktaskp t)
+void clearrunning(void)
+;
+Ktaskp nextrunning(Ktaskp t)
 ;
 void restarttask(Ktaskp t)
 ;
@@ -179,6 +181,10 @@ void deletetask(Ktaskp t)
 ;
 void unlinktask(Ktaskp p)
 ;
+void settaskpriority(Ktaskp t,int prio)
+;
+int anyrunning(int prio)
+;
 void expandstack(Ktaskp p)
 ;
 void expandstackatleast(Ktaskp p, int needed)
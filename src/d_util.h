@@ -12,6 +12,12 @@ void phcheck(void)
 ;
 void htcheck(void)
 ;
+int reclaimslice(void)
+;
+Datum reclaimstatsarr(void)
+;
+void reclaimstatsprint(void)
+;
 #ifdef lint
 #endif
 char * strend(register char *s)
@@ -99,6 +105,8 @@ void freeinode(Instnodep in)
 ;
 Lknode * newlk(Symstr nm)
 ;
+void lksetowner(Lknode *lk,Ktaskp t)
+;
 void unlinklk(Lknode *lk)
 ;
 void freelk(Lknode *lk)
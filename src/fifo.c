@@ -33,46 +33,47 @@ initfifos(void)
 	}
 }
 
-static Fifodata *Freefd = NULL;
-
-Fifodata *
-newfd(Datum d)
+/*
+ * The data in a fifo is kept in a ring buffer, which grows (doubling)
+ * as needed, so putting and getting don't allocate anything.
+ */
+static void
+fiforoom(Fifo *f,int n)
 {
-	static int used = ALLOCFD;
-	static Fifodata *lastfd;
-	Fifodata *fd;
+	Datum *newring;
+	int newsize, i;
 
-	if ( Freefd != NULL ) {
-		fd = Freefd;
-		Freefd = Freefd->next;
-	}
-	else {
-		if ( used == ALLOCFD ) {
-			used = 0;
-			lastfd = (Fifodata *) kmalloc(ALLOCFD*sizeof(Fifodata),"newfd");
-		}
-		used++;
-		fd = lastfd++;
-	}
-#ifdef THIS_CAUSES_PROBLEM_ON_MAC_AND_DOESNT_REALLY_DO_ANYTHING_ANYWAY
-	if ( lastfd == NULL ) {
-		eprint("Internal error, lastfd==NULL!?  forced abort()\n");
-		abort();
-	}
-#endif
-	fd->d = d;
-	incruse(d);
-	fd->next = NULL;
-	return fd;
+	if ( f->size + n <= f->ringsize )
+		return;
+	newsize = f->ringsize ? f->ringsize : FIFORING_INIT;
+	while ( newsize < f->size + n )
+		newsize *= 2;
+	newring = (Datum *) kmalloc(newsize*sizeof(Datum),"fiforoom");
+	for ( i=0; i<f->size; i++ )
+		newring[i] = f->ring[(f->first+i)%f->ringsize];
+	if ( f->ring != NULL )
+		kfree(f->ring);
+	f->ring = newring;
+	f->ringsize = newsize;
+	f->first = 0;
 }
 
-void
-freefd(Fifodata *fd)
+/* Throw away everything in a fifo */
+static void
+fifoclear(Fifo *f)
 {
-	decruse(fd->d);
-	/* Add to free list */
-	fd->next = Freefd;
-	Freefd = fd;
+	int n;
+
+	for ( n=0; n<f->size; n++ )
+		decruse(f->ring[(f->first+n)%f->ringsize]);
+	f->size = 0;
+	f->first = 0;
+	/* Don't hang on to a big ring after a burst */
+	if ( f->ringsize > FIFORING_KEEP ) {
+		kfree(f->ring);
+		f->ring = NULL;
+		f->ringsize = 0;
+	}
 }
 
 Fifo *
@@ -85,39 +86,68 @@ fifoptr(long n)
 		return(NULL);
 }
 
-PORTHANDLE porttofind;
-Fifo *foundfifo;
+/*
+ * Fifos attached to ports are also hashed by their PORTHANDLE, so
+ * checkports() can find the fifo for data from mdep_getportdata()
+ * without visiting every fifo in Fifotable.
+ */
+#define PORTFIFOHASH 64
+static Fifo *Portfifos[PORTFIFOHASH];
+
+static int
+portfifobucket(PORTHANDLE port)
+{
+	unsigned long h = (unsigned long)(intptr_t)port;
+
+	return (int)((h ^ (h>>4) ^ (h>>10)) % PORTFIFOHASH);
+}
+
+void
+setfifoport(Fifo *f,PORTHANDLE port)
+{
+	int b = portfifobucket(port);
 
-int
-findport(Hnodep h)
+	f->port = port;
+	f->portnext = Portfifos[b];
+	Portfifos[b] = f;
+}
+
+static void
+unsetfifoport(Fifo *f)
 {
-	Fifo *f;
+	Fifo **pf;
 
-	f = h->val.u.fifo;
-	if ( (f->flags & FIFO_ISPORT) != 0 && f->port == porttofind )
-		foundfifo = f;
-	return 0;
+	for ( pf=&Portfifos[portfifobucket(f->port)]; *pf!=NULL; pf=&((*pf)->portnext) ) {
+		if ( *pf == f ) {
+			*pf = f->portnext;
+			break;
+		}
+	}
+	f->portnext = NULL;
 }
 
 Fifo *
 port2fifo(PORTHANDLE port)
 {
-	foundfifo = NULL;
-	porttofind = port;
-	hashvisit(Fifotable,findport);
-	return foundfifo;
+	Fifo *f;
+
+	for ( f=Portfifos[portfifobucket(port)]; f!=NULL; f=f->portnext ) {
+		if ( (f->flags & FIFO_ISPORT) != 0 && f->port == port )
+			return f;
+	}
+	return NULL;
 }
 
 void
 closefifo(Fifo *f)
 {
-	Fifodata *fd, *nextfd;
 #ifdef __EMSCRIPTEN__
 	int was_write = (f->flags & (FIFO_WRITE | FIFO_APPEND)) != 0;
 #endif
 
 	flushlinebuff(f);
 	if ( f->flags & FIFO_ISPORT ) {
+		unsetfifoport(f);
 		if ( mdep_closeport(f->port) )
 			mdep_popup("Unexpected event, mdep_closeport failed!?");
 	}
@@ -133,6 +163,12 @@ closefifo(Fifo *f)
 		else
 			myfclose(f->fp);
 		f->fp = NULL;
+		if ( f->rbuff != NULL ) {
+			kfree(f->rbuff);
+			f->rbuff = NULL;
+		}
+		f->rpos = 0;
+		f->rlen = 0;
 #ifdef __EMSCRIPTEN__
 		// Trigger filesystem sync only after writing files
 		if ( was_write ) {
@@ -158,15 +194,8 @@ closefifo(Fifo *f)
 	}
 	f->t = NULL;
 	f->flags = 0;
-	f->size = 0;
-
-#ifdef lint
-	nextfd = NULL;
-#endif
-	for ( fd=f->tail; fd!=NULL; fd=nextfd ) {
-		nextfd = fd->next;
-		freefd(fd);
-	}
+	f->getnmax = 0;
+	fifoclear(f);
 }
 
 void
@@ -187,26 +216,15 @@ freeff(Fifo *f)
 void
 flushfifo(Fifo *f)
 {
-	Fifodata *fd, *nextfd;
-
 	flushlinebuff(f);
 	if ( f->fp ) {
 		if ( (f->flags & (FIFO_WRITE|FIFO_APPEND)) != 0 )
 			if ( fflush(f->fp) )
 				mdep_popup("Unexpected error from fflush()?");
 	}
-	else if ( f->tail ) {
+	else if ( f->size > 0 ) {
 		/* there's data in the fifo, clear it */
-#ifdef lint
-		nextfd = NULL;
-#endif
-		for ( fd=f->tail; fd!=NULL; fd=nextfd ) {
-			nextfd = fd->next;
-			freefd(fd);
-		}
-		f->head = NULL;
-		f->tail = NULL;
-		f->size = 0;
+		fifoclear(f);
 		f->t = NULL;
 	}
 }
@@ -657,13 +675,19 @@ getafifo()
 		f = (Fifo*)kmalloc(sizeof(Fifo),"newfifo");
 		f->next = Topfifo;
 		Topfifo = f;
+		f->ring = NULL;
+		f->ringsize = 0;
+		f->rbuff = NULL;
 	}
+	f->rpos = 0;
+	f->rlen = 0;
 	f->flags = 0;
-	f->head = NULL;
-	f->tail = NULL;
+	f->first = 0;
 	f->size = 0;
+	f->getnmax = 0;
 	f->t = NULL;
 	f->fp = NULL;
+	f->portnext = NULL;
 	f->fifoctl_type = FIFOTYPE_UNTYPED;
 	f->linebuff = NULL;
 	f->linesize = 0;
@@ -689,6 +713,8 @@ fifoctl2type(char *mode, int def)
 		return FIFOTYPE_BINARY;
 	if ( strchr(mode,'A') != NULL )
 		return FIFOTYPE_ARRAY;
+	if ( strchr(mode,'B') != NULL )
+		return FIFOTYPE_BLOCK;
 	return def;	/* default */
 }
 
@@ -795,7 +821,7 @@ newfifo(char *fname,char *mode,char *porttype,Fifo **pf1,Fifo **pf2)
 		if ( rflag && ports[0] ) {
 			f1 = getafifo();
 			f1->flags = FIFO_OPEN | FIFO_ISPORT | FIFO_READ;
-			f1->port = ports[0];
+			setfifoport(f1,ports[0]);
 			f1->fifoctl_type = fifoctl2type(mode,Default_fifotype);
 			*pf1 = f1;
 			r |= 1;
@@ -803,7 +829,7 @@ newfifo(char *fname,char *mode,char *porttype,Fifo **pf1,Fifo **pf2)
 		if ( wflag && ports[1] ) {
 			f2 = getafifo();
 			f2->flags = FIFO_OPEN | FIFO_ISPORT | FIFO_WRITE;
-			f2->port = ports[1];
+			setfifoport(f2,ports[1]);
 			f2->fifoctl_type = fifoctl2type(mode,Default_fifotype);
 			*pf2 = f2;
 			r |= 2;
@@ -819,46 +845,169 @@ fifosize(Fifo *f)
 	return f->size;
 }
 
+/* An array of byte values, indexed from 0 */
+Datum
+bytesdatum(char *p,int n)
+{
+	Datum d, v;
+	int i;
+
+	d = newarrdatum(0,n);
+	for ( i=0; i<n; i++ ) {
+		v = numdatum((Unchar)p[i]);
+		setarraydata(d.u.arr,numdatum(i),v);
+	}
+	return d;
+}
+
+/*
+ * File fifos are read a block at a time into f->rbuff, and lines are
+ * split out of it with memchr(), rather than a getc() per byte.
+ * Returns 0 at Eof.
+ */
+static int
+fifofill(Fifo *f)
+{
+	long n;
+
+	if ( f->rbuff == NULL )
+		f->rbuff = (char *) kmalloc(FIFOREADSIZE,"fifofill");
+	f->rpos = 0;
+	if ( (f->flags & FIFO_PIPE) != 0 ) {
+		/* Don't wait for a whole block from a pipe */
+		if ( f->fifoctl_type == FIFOTYPE_BINARY
+			|| f->fifoctl_type == FIFOTYPE_BLOCK ) {
+			int c = getc(f->fp);
+			n = 0;
+			if ( c >= 0 )
+				f->rbuff[n++] = c;
+		}
+		else if ( fgets(f->rbuff,FIFOREADSIZE,f->fp) != NULL )
+			n = (long)strlen(f->rbuff);
+		else
+			n = 0;
+	}
+	else
+		n = (long)fread(f->rbuff,1,FIFOREADSIZE,f->fp);
+	f->rlen = (int)n;
+	return n > 0;
+}
+
+static Symstr
+fifostr(Fifo *f,char *s,long len)
+{
+	Symstr p;
+
+	if ( (f->flags & FIFO_NOINTERN) == 0 )
+		return strresult(s,len);
+	p = strtransalloc(len);
+	memcpy(p,s,(size_t)len);
+	return p;
+}
+
+/* Read one item (a byte, a block, or a line) from a file fifo. */
+/* Returns 0 at Eof. */
+static int
+fifofileget(Fifo *f,Datum *dp)
+{
+	char *p, *nl;
+	long n, sofar;
+
+	if ( f->rpos >= f->rlen && ! fifofill(f) )
+		return 0;
+	/* the get() call returns a single byte, a block of bytes, */
+	/* or an entire line, depending on flags */
+	if ( f->fifoctl_type == FIFOTYPE_BINARY ) {
+		*dp = numdatum((Unchar)(f->rbuff[f->rpos++]));
+		return 1;
+	}
+	if ( f->fifoctl_type == FIFOTYPE_BLOCK ) {
+		n = f->rlen - f->rpos;
+		if ( n > FIFOBLOCKSIZE )
+			n = FIFOBLOCKSIZE;
+		*dp = bytesdatum(f->rbuff+f->rpos,(int)n);
+		f->rpos += n;
+		return 1;
+	}
+	sofar = 0;
+	for ( ;; ) {
+		p = f->rbuff + f->rpos;
+		n = f->rlen - f->rpos;
+		nl = (char *) memchr(p,'\n',(size_t)n);
+		if ( nl != NULL )
+			n = (long)(nl - p);
+		if ( nl != NULL && sofar == 0 ) {
+			/* the usual case, the whole line is in the buffer */
+			*dp = strdatum(fifostr(f,p,n));
+			f->rpos += n + 1;
+			return 1;
+		}
+		makeroom(sofar+n+2,&Msg1,&Msg1size);
+		memcpy(Msg1+sofar,p,(size_t)n);
+		sofar += n;
+		f->rpos += n;
+		if ( nl != NULL ) {
+			f->rpos++;
+			break;
+		}
+		if ( ! fifofill(f) )
+			break;
+	}
+	/* Ensure buffer is allocated even for empty lines */
+	makeroom(sofar+2,&Msg1,&Msg1size);
+	*dp = strdatum(fifostr(f,Msg1,sofar));
+	return 1;
+}
+
+/* A getn() on a file fifo reads until it's done, so the size of */
+/* its array can't be known ahead of time, this is just a start. */
+#define GETN_FILESIZE 64
+
+/* If f->getnmax is set, this is a getn(), and the value is an */
+/* array of up to that many items.  The array is sized by what's */
+/* there, not by getnmax, which can be huge. */
 void
 getfromfifo(Fifo *f)
 {
-	Fifodata *fd;
 	Datum d;
-
-	fd = f->tail;
+	int n;
 
 	if ( f->fp ) {
-		int c = getc(f->fp);
-		if ( c < 0 ) {
-			f->size = 0;
-			ret(numdatum(*Eofval));
-		} else {
-			int i = 0;
-			/* the get() call returns a single byte or an */
-			/* entire line, depending on flags */
-			if ( f->fifoctl_type == FIFOTYPE_BINARY ) {
-				ret(numdatum(c));
-			}
+		if ( f->getnmax <= 0 ) {
+			if ( fifofileget(f,&d) )
+				ret(d);
 			else {
-				while ( c >= 0 && c != '\n' ) {
-					makeroom((long)i+2,&Msg1,&Msg1size);
-					Msg1[i++] = c;
-					c = getc(f->fp);
-				}
-				/* Ensure buffer is allocated even for empty lines */
-				makeroom((long)i+2,&Msg1,&Msg1size);
-				Msg1[i] = '\0';
-				ret(strdatum(uniqstr(Msg1)));
+				f->size = 0;
+				ret(numdatum(*Eofval));
+			}
+		}
+		else {
+			Datum v;
+			/* Files never block, so this is whatever's left */
+			d = newarrdatum(0,(f->getnmax<GETN_FILESIZE)?f->getnmax:GETN_FILESIZE);
+			for ( n=0; n<f->getnmax && fifofileget(f,&v); n++ )
+				setarraydata(d.u.arr,numdatum(n),v);
+			f->getnmax = 0;
+			if ( n == 0 ) {
+				f->size = 0;
+				ret(numdatum(*Eofval));
 			}
+			else
+				ret(d);
 		}
 	}
-	else if ( fd ) {	/* i.e. there's something in the fifo */
-		if ( f->size <= 0 )
-			execerror("Hey, f->tail is non-NULL, but f->size is <=0\n");
-
+	else if ( f->size > 0 ) {	/* i.e. there's something in the fifo */
 		if ( ((f->flags) & FIFO_NORETURN) != 0 ) {
 			f->flags &= (~FIFO_NORETURN); /* only lasts 1 time */
 		}
+		else if ( f->getnmax > 0 ) {
+			/* return value for the bi_getn call */
+			d = newarrdatum(0,(f->getnmax<f->size)?f->getnmax:f->size);
+			for ( n=0; n<f->getnmax && f->size>0; n++ )
+				setarraydata(d.u.arr,numdatum(n),removedatafromfifo(f));
+			f->getnmax = 0;
+			ret(d);
+		}
 		else {
 			/* return value for the bi_get call */
 			d = removedatafromfifo(f);
@@ -866,14 +1015,11 @@ getfromfifo(Fifo *f)
 		}
 	}
 	else {
-		if ( f->t ) {
-			execerror("Multiple tasks (%ld and %ld) are blocking on the same fifo (%ld)\n",
-				f->t->tid,T->tid,fifonum(f));
-		}
 		/* Hack for handling multiple get()s on the Console fifo */
 		/* after Eof has been received. */
 		if ( f == Consinf && Consolefd == -1 ) {
 			f->size = 0;
+			f->getnmax = 0;
 			ret(numdatum(*Eofval));
 		} else {
 			blockfifo(f,0);	/* normal blocking on a get() */
@@ -884,15 +1030,14 @@ getfromfifo(Fifo *f)
 Datum
 removedatafromfifo(Fifo *f)
 {
-	Fifodata *fd = f->tail;
 	Datum d;
 
-	d = fd->d;
+	d = f->ring[f->first];
 	/* remove if from the fifo */
-	f->tail = fd->next;
+	f->first = (f->first+1) % f->ringsize;
 	if ( --(f->size) == 0 )
-		f->head = NULL;
-	freefd(fd);
+		f->first = 0;
+	decruse(d);
 	return(d);
 }
 
@@ -918,11 +1063,34 @@ unblocktask(Ktaskp t)
 	t->fifo = NULL;
 }
 
+/* Only one task can block on a fifo.  This is checked before */
+/* getnmax is set, since the blocked task's getnmax is still needed. */
+static void
+fifochkblock(Fifo *f)
+{
+	if ( f->t ) {
+		execerror("Multiple tasks (%ld and %ld) are blocking on the same fifo (%ld)\n",
+			f->t->tid,T->tid,fifonum(f));
+	}
+}
+
 void
 getfifo(Fifo *f)
 {
 	if ( (f->flags & (FIFO_WRITE|FIFO_APPEND)) != 0 )
 		execerror("Attempt to get() on a fifo (%ld) that is opened for writing!",fifonum(f));
+	fifochkblock(f);
+	f->getnmax = 0;
+	getfromfifo(f);
+}
+
+void
+getnfifo(Fifo *f,int max)
+{
+	if ( (f->flags & (FIFO_WRITE|FIFO_APPEND)) != 0 )
+		execerror("Attempt to getn() on a fifo (%ld) that is opened for writing!",fifonum(f));
+	fifochkblock(f);
+	f->getnmax = max;
 	getfromfifo(f);
 }
 
@@ -934,19 +1102,13 @@ fputit(char *s)
 	fputs(s,Fputfp);
 }
 
-void
-putfifo(Fifo *f,Datum d)
+/* Returns 1 if d was queued on the fifo (rather than written out). */
+static int
+addtofifo(Fifo *f,Datum d)
 {
-	Fifodata *fd;
 	char bytes[4];
 	Symstr s;
 
-	/* This routine is used both by the bi_put() routine when a */
-	/* user is putting something on a fifo, as well as by the */
-	/* handlewaitfor() when something arrives on a port, and it needs */
-	/* to be put on a fifo for future reading by the user */
-	/* (i.e. bi_get()).  Probably needs to be split up in the future. */
-
 	if ( (f->flags & FIFO_ISPORT) != 0 && (f->flags & FIFO_WRITE) != 0 ) {
 		switch(d.type) {
 		case D_NUM:
@@ -958,7 +1120,7 @@ putfifo(Fifo *f,Datum d)
 			mdep_putportdata(f->port,s,(int)strlen(s));
 			break;
 		}
-		return;
+		return 0;
 	}
 
 	if ( f->fp ) {
@@ -970,26 +1132,23 @@ putfifo(Fifo *f,Datum d)
 			Fputfp = f->fp;
 			prdatum(d,fputit,0);
 		}
-		return;
+		return 0;
 	}
 
-	fd = newfd(d);
-
-	if ( f->head ) {
-		/* The list of fd's goes from f->tail to f->head.  f->tail is */
-		/* where they're gotten from, and f->head is where they're put on. */
-		f->head->next = fd;
-	}
-	else {
-		/* nothing in fifo yet */
-		f->tail = fd;
-	}
-	f->head = fd;
+	fiforoom(f,1);
+	f->ring[(f->first+f->size)%f->ringsize] = d;
+	incruse(d);
+	strgcbarrier(d);
 	f->size++;
 	// keyerrfile("putfifo, size=%d\n",f->size);
+	return 1;
+}
 
-	/* If there is a task that blocked on a get() */
-	/* of this fifo, resurrect it. */
+/* If there is a task that blocked on a get() */
+/* of this fifo, resurrect it. */
+static void
+fifowakeup(Fifo *f)
+{
 	if ( f->t ) {
 		Ktaskp saveT;
 		int tstate = f->t->state;
@@ -1008,3 +1167,37 @@ putfifo(Fifo *f,Datum d)
 		// keyerrfile("No task blocked.\n");
 	}
 }
+
+void
+putfifo(Fifo *f,Datum d)
+{
+	/* This routine is used both by the bi_put() routine when a */
+	/* user is putting something on a fifo, as well as by the */
+	/* handlewaitfor() when something arrives on a port, and it needs */
+	/* to be put on a fifo for future reading by the user */
+	/* (i.e. bi_get()).  Probably needs to be split up in the future. */
+
+	if ( addtofifo(f,d) )
+		fifowakeup(f);
+}
+
+/* Put the elements of an array, in order, and only then */
+/* wake up a task that's waiting (so a getn() gets them all). */
+void
+putnfifo(Fifo *f,Htablep arr)
+{
+	Datum *alist;
+	Symbolp as;
+	int n, asize, queued = 0;
+
+	alist = arrlist(arr,&asize,1);
+	for ( n=0; n<asize; n++ ) {
+		as = arraysym(arr,alist[n],H_LOOK);
+		if ( as != NULL && addtofifo(f,*symdataptr(as)) )
+			queued = 1;
+	}
+	if ( alist != NULL )
+		kfree(alist);
+	if ( queued )
+		fifowakeup(f);
+}
@@ -66,7 +66,7 @@ static char* Methtemp;
 %left	INC DEC
 %%
 list	: 			{
-				code2(funcinst(I_STRINGPUSH), strinst(Infile));
+				code2(funcinst(I_STRINGPUSH), strinst(Infile?uniqstr(Infile):Nullstr));
 				code2(funcinst(I_CONSTANT),numinst(Lineno));
 				code(funcinst(I_PUSHINFO));
 				}
@@ -15,6 +15,8 @@
 
 #ifdef __EMSCRIPTEN__
 #include "mdep_wasm.h"
+#elif defined(MDEP_POSIX)
+#include "mdep_posix.h"
 #else
 #include "mdep.h"
 #endif
@@ -60,6 +62,8 @@ typedef struct Hnode *Hnodep;
 typedef struct Hnode **Hnodepp;
 typedef struct Htable *Htablep;
 typedef struct Kobject *Kobjectp;
+typedef struct Kshape *Kshapep;
+typedef struct Kslots *Kslotsp;
 typedef struct Strhdr *Strhdrp;
 typedef struct Strnode *Strnodep;
 typedef struct Strtable *Strtablep;
@@ -397,6 +401,14 @@ typedef void (*PATHFUNC)();
 #define BI_BITMAP	125
 #define BI_OBJECTINFO	126
 #define O_FILLPOLYGON	127
+#define BI_GETN		128
+#define BI_PUTN		129
+#define BI_MIDIOPEN	130
+#define BI_MIDIREAD	131
+#define BI_MIDICLOSE	132
+#define BI_RECFILE	133
+#define BI_SAVEPHR	134
+#define BI_MAXCODE	BI_SAVEPHR	/* BLTINCODE is an Unchar, so this must be <= 255 */
 
 #define IO_STD 1
 #define IO_REDIR 2
@@ -467,9 +479,9 @@ typedef void (*PATHFUNC)();
 #define ALLOCTF 32
 #define ALLOCINT 32
 #define ALLOCDN 32
-#define ALLOCFD 32
 #define ALLOCLK 32
 #define ALLOCOBJ 64
+#define ALLOCSLOTS 32
 
 #define H_INSERT 0
 #define H_LOOK 1
@@ -584,6 +596,8 @@ typedef struct Hnode {
 
 #define HT_TOBECHECKED 1
 #define HT_STRGC_MARKED 2
+#define HT_DRAINING 4
+#define HT_FREE 8
 
 typedef struct Htable {
 	int size;	/* size of nodetable */
@@ -593,7 +607,17 @@ typedef struct Htable {
 	Hnodepp nodetable;
 	Htablep h_next;
 	Htablep h_prev;
-	short h_state;	/* HT_TOBECHECKED or 0 */
+	short h_state;	/* HT_TOBECHECKED, HT_DRAINING, HT_FREE, or 0 */
+	short h_visiting;	/* hashvisit() in progress, don't grow */
+	int initsize;	/* size when created, restored by clearht() */
+	Hnodepp oldtable;	/* while growing, chains not yet rehashed */
+	int oldsize;
+	int rehashpos;	/* next bucket of oldtable to rehash */
+	Symbolp *dense;	/* array elements 0..densen-1, see arraysym() */
+	int densen;
+	int densesize;
+	int denseholes;	/* number of NULL (deleted) entries in dense */
+	Datum *sorted;	/* cached sorted index list, see arrlist() */
 } Htable;
 
 typedef Htablep *Htablepp;
@@ -606,9 +630,12 @@ typedef struct Strnode {
 } Strnode;
 
 typedef struct Strtable {
-	int size;		/* number of buckets */
+	int size;		/* number of buckets, a power of 2 */
 	int count;		/* number of strings stored */
 	Strnodep *buckets;	/* array of Strnode chains */
+	Strnodep *oldbuckets;	/* while growing, chains not yet rehashed */
+	int oldsize;
+	int rehashpos;		/* next bucket of oldbuckets to rehash */
 } Strtable;
 
 #define STRCODE_STREAM 0
@@ -668,7 +695,8 @@ typedef enum {
 	FIFOTYPE_BINARY,
 	FIFOTYPE_LINE,
 	FIFOTYPE_FIFO,
-	FIFOTYPE_ARRAY
+	FIFOTYPE_ARRAY,
+	FIFOTYPE_BLOCK
 } Fifotype;
 
 typedef struct schednode {
@@ -690,7 +718,9 @@ typedef struct Tofree {
 
 typedef struct Ktask {
 	Unchar* pc;	/* current instruction */
-	Ktaskp nextrun;	/* Used for the Running list */
+	Ktaskp nextrun;	/* Used for the run queues */
+	Ktaskp prevrun;
+	struct Runq *runq;	/* queue it was put on, see linktask() */
 	Datum *stack;	/* the stack (duh) */
 	int stacksize;	/* allocated size of stack */
 	Datum *stackp;	/* next free spot on stack */
@@ -723,6 +753,11 @@ typedef struct Ktask {
 	long linenum;
 	Symstr filename;
 	struct Lknode *lock;
+	struct Lknode *locks;	/* lock nodes it owns, see lksetowner() */
+	int nlocks;	/* locks held or waited for */
+	long lockwaits;	/* number of times lock() had to wait */
+	long lockwaitms;	/* total time spent waiting for locks */
+	long lockwaitstart;
 	Kobjectp obj;	/* object we're running method of */
 	Kobjectp realobj;/* object we're running method on behalf of */
 	Symstr method;
@@ -730,43 +765,86 @@ typedef struct Ktask {
 	short pend_npassed;	/* for pending function */
 } Task;
 
-typedef struct Fifodata {
-	struct Fifodata *next;
-	Datum d;
-} Fifodata;
+#define FIFORING_INIT 16	/* initial size of a fifo's ring buffer */
+#define FIFORING_KEEP 1024	/* an empty ring bigger than this is freed */
 
 typedef struct Fifo {
-	Fifodata *head;		/* Points to last "put" */
-	Fifodata *tail;		/* Points to next "get" */
+	Datum *ring;		/* Data is ring[(first+i)%ringsize], i<size */
+	int ringsize;
+	int first;		/* next "get" */
 	int size;
+	int getnmax;		/* >0 if the blocked task is in getn() */
 	int flags;		/* For FIFO_* bitflags, see above */
 	FILE *fp;		/* If non-NULL, this is a file fifo */
 	Ktaskp t;		/* This task is blocked on this fifo */
 	PORTHANDLE port;	/* If FIFO_ISPORT is set, this is used. */
+	struct Fifo *portnext;	/* chain in the port-to-fifo hash */
 	long num;
 	struct Fifo *next;
 	Fifotype fifoctl_type;	/* type of data read from fifo */
 	char *linebuff;		/* Saved data for FIFO_LINE */
 	long linesize;		/* Total size of linebuff (for makeroom) */
 	long linesofar;		/* How much actually used */
+	char *rbuff;		/* Read buffer for file fifos */
+	int rpos;		/* Next unread byte in rbuff */
+	int rlen;		/* Number of valid bytes in rbuff */
 } Fifo;
 
 typedef struct Lknode {
-	Symstr name;		/* Only used in Toplk list. */
+	Symstr name;		/* Only used in Lktable. */
 	Task *owner;
-	struct Lknode *next;	/* Only used in Toplk list. */
-	struct Lknode *notify;	/* List of pending locks with same name */
+	struct Lknode *next;	/* Only used in Lktable. */
+	struct Lknode *notify;	/* Queue of pending locks with same name */
+	struct Lknode *prevnotify;	/* Back link in that queue */
+	struct Lknode *lkhead;	/* Head of the lock (queued nodes only) */
+	struct Lknode *lastnotify;	/* End of that queue (head only) */
+	int nnotify;		/* Length of that queue (head only) */
+	struct Lknode *tnext;	/* List of the nodes owned by owner */
+	struct Lknode *tprev;
 } Lknode;
-extern Lknode *Toplk;
+extern Lknode **Lktable;
+extern int Lktablesize;
+
+/*
+ * Object elements are normally kept in slots (see objinstall()).
+ * Objects that had the same elements added in the same order share a
+ * Kshape, which has the element names; the object has the values, in
+ * Symbols allocated OBJSLOTCHUNK at a time so that they never move.
+ */
+#define OBJSLOTCHUNK 8
+#define OBJSLOTMAX 32	/* past this, elements go in o->symbols */
+#define OBJSHAPEMAX 4096
+
+typedef struct Kshape {
+	Symstr name;		/* the element this shape added */
+	Symstr *names;		/* all of them, names[0..nslots-1] */
+	int nslots;
+	struct Kshape *kids;	/* shapes with one more element */
+	struct Kshape *nextkid;
+	struct Kshape *next;	/* list of all shapes */
+} Kshape;
+
+typedef struct Kslots {
+	Symbol s[OBJSLOTCHUNK];
+	struct Kslots *next;
+} Kslots;
+
+#define KOBJ_INHERIT 1	/* inherits or is inherited from */
 
 typedef struct Kobject {
 	long id;
-	Htablep symbols;
+	Kshapep shape;
+	Kslotsp slots;
+	Htablep symbols;	/* elements that aren't in slots, or NULL */
+	char oflags;
+	unsigned short strmark;	/* see strmark_object() */
+	long gen;	/* changes when freed or reused, see findobjsymcache() */
 	Kobjectp inheritfrom;	/* list of objects we inherit from */
 	Kobjectp nextinherit;	/* next in that list */
 	Kobjectp children;
 	Kobjectp nextsibling;
 	Kobjectp onext;
+	Kobjectp oprev;
 } Kobject;
 
 /*
@@ -827,11 +905,15 @@ extern Midiport Midioutputs[MIDI_OUT_DEVICES];
 #define FIFO_NORETURN (1<<5)	/* tells whether to use ret() */
 #define FIFO_APPEND (1<<6)	/* fifo is writing */
 #define FIFO_ISPORT (1<<7)	/* fifo is attached to a mdep_openport() */
+#define FIFO_NOINTERN (1<<8)	/* lines read aren't interned */
 
 #define fifonum(f) ((f)->num)
 
 #define FIFOINC 64
 
+#define FIFOREADSIZE 32768	/* size of the read buffer for file fifos */
+#define FIFOBLOCKSIZE 4096	/* max bytes in each FIFOTYPE_BLOCK value */
+
 #define SCH_NOTEOFF 0
 #define SCH_PHRASE 1
 #define SCH_WAKE 2
@@ -856,6 +938,14 @@ extern int Nsleeptill;
 extern Ktaskp T;
 extern Ktaskp Tboot;
 extern Ktaskp Running;
+
+typedef struct Runq {
+	int priority;
+	Ktaskp head;		/* runnable tasks at this priority */
+	struct Runq *next;	/* next lower priority with any tasks */
+	struct Runq *prev;
+} Runq;
+extern Runq *Toprunq;
 extern int Currpriority;
 extern Codep Ipop, Ireboot;
 extern Fifo *Midi_in_f, *Midi_out_f;
@@ -863,6 +953,7 @@ extern Fifo *Consinf, *Consoutf, *Mousef;
 extern int Consolefd, Midifd, Displayfd;
 extern int Default_fifotype;
 extern Kobjectp Topobj;
+extern long Objversion;
 extern long Nextobjid;
 extern Codep Idosweep;
 #ifdef OLDSTUFF
@@ -1059,7 +1150,9 @@ extern Phrasep _Icphr;
 extern Codep _Icin;
 extern Phrasep Tobechecked;
 extern Htablep Htobechecked;
+extern Htablep Htdraining;
 extern int Chkstuff;
+extern int Strgcmarking, Strgcpending;
 extern int Keycnt;
 extern int Argc;
 extern char **Argv;
@@ -1078,6 +1171,7 @@ extern int Portmap[PORTMAP_SIZE][16];
 extern Context *Topct, *Currct;
 extern Htablep Topht;
 extern Htablep Tasktable;
+extern Htablep Fifotable;
 extern char *Scachars[];
 extern Datum *Errorfuncd, *Rebootfuncd, *Printfuncd;
 extern Datum *Intrfuncd;
@@ -1105,6 +1199,7 @@ extern Symlongp Filter, Record, Recsched, Debugdraw, Recfilter, Recinput;
 extern Symlongp Loadverbose, Throttle2, Warnnegative, Midifilenoteoff;
 extern Symlongp Drawcount, Mousedisable, Forceinputport, Mfsysextype;
 extern Symlongp Lowcorelim, Arraysort, Tempotrack, Debugoff, Fakewrap;
+extern Symlongp Phrasebinary;
 extern Symlongp Defrelease, Onoffmerge, Grablimit, Mfformat, Defoutport;
 extern Symlongp Taskaddr, Debuginst, Prepoll, Debugmalloc, Linetrace;
 extern Symlongp Debugkill, Debugkill1, Consecho, Abortonint, Abortonerr;
@@ -1117,7 +1212,7 @@ extern Symlongp Consinfnum, Consoutfnum, Midi_in_fnum, Midi_out_fnum;
 extern Symlongp Redrawignoretime, Resizeignoretime, Mousefnum, Warningsleep;
 extern Symlongp Millires, Milliwarn, Mousefifolimit, Minbardx, Midithrottle;
 extern Symlongp Numinst1, Numinst2, Kobjectoffset, Mousemoveevents;
-extern Symlongp Deftimeout;
+extern Symlongp Deftimeout, Reclaimlimit, Reclaimtime, Strgcslice;
 extern Symlongp Debuggesture;
 extern Symlongp Chancolors;
 extern Phrasepp Currphr, Recphr;
@@ -1133,6 +1228,10 @@ void strunregistercode(Codep cp);
 void markstr(Symstr s);
 int strgcdryrun(int verbose);
 
+/* Write barrier for the incremental string collector - use it */
+/* when a value is stored somewhere the collector may have scanned. */
+#define strgcbarrier(d) do{if(Strgcmarking)strgcshade(d);}while(0)
+
 int yyparse(NOARG);
 
 #ifndef _MAX_PATH
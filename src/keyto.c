@@ -20,19 +20,34 @@
 #define MYMETASMPTE	-5
 #define MYCHANPREFIX	-6
 
+/*
+ * The whole file is built in memory, in Mfbuff, and each track's
+ * length is patched in when the track is finished.  So there are
+ * no temporary files, and the file is written in one go.
+ */
+#define MFBUFFKEEP 65536	/* a bigger Mfbuff isn't kept around */
+
 static Noteptr Pend = NULL;		/* list of pending note-offs */
-static FILE *Trktmp;
-static char Tmpfname[16];	/* enough space for "#xxxxx.tmp" */
+static char *Mfbuff = NULL;
+static long Mfbuffsize = 0;
+static long Mfsize;		/* bytes used in Mfbuff */
+static long Trkstart;		/* offset of the current track's length */
 static long Trksize;
-static FILE *Outf;
 static double Clickfactor = 1.0;
 static int Laststat = 0;	/* NOTEON, NOTEOFF, PRESSURE, etc. */
 
+static void
+mfbyte(int c)
+{
+	if ( Mfsize >= Mfbuffsize )
+		makeroom(Mfsize+1,&Mfbuff,&Mfbuffsize);
+	Mfbuff[Mfsize++] = (char)(c & 0xff);
+}
+
 static void
 trackbyte(int c)	/* must be used by everything that writes track data */
 {
-	c = c & 0xff;
-	putc(c,Trktmp);
+	mfbyte(c);
 	Trksize++;
 }
 
@@ -65,17 +80,17 @@ putdelta(long clicks)
 static void
 write16bit(int val)
 {
-	putc( (val>>8) & 0xff, Outf );
-	putc( val & 0xff, Outf );
+	mfbyte( (val>>8) & 0xff );
+	mfbyte( val & 0xff );
 }
 
 static void
 write32bit(long val)
 {
-	putc( (int)((val>>24) & 0xff), Outf );
-	putc( (int)((val>>16) & 0xff), Outf );
-	putc( (int)((val>>8) & 0xff), Outf );
-	putc( (int)(val & 0xff), Outf );
+	mfbyte( (int)((val>>24) & 0xff) );
+	mfbyte( (int)((val>>16) & 0xff) );
+	mfbyte( (int)((val>>8) & 0xff) );
+	mfbyte( (int)(val & 0xff) );
 }
 
 static void
@@ -379,7 +394,7 @@ putbytes(Noteptr nt)
 static void
 header(int format,int ntrks, int division)
 {
-	fputs("MThd",Outf);
+	mfbyte('M'); mfbyte('T'); mfbyte('h'); mfbyte('d');
 	write32bit(6L);
 	write16bit(format);
 	write16bit(ntrks);
@@ -389,12 +404,9 @@ header(int format,int ntrks, int division)
 static int
 inittrack(void)
 {
-	OPENBINFILE(Trktmp,Tmpfname,"w");
-	if ( Trktmp == NULL ) {
-		tprint("Can't open midifile for writing - '%s' (%s)",
-			Tmpfname,strerror(errno));
-		return 1;
-	}
+	mfbyte('M'); mfbyte('T'); mfbyte('r'); mfbyte('k');
+	Trkstart = Mfsize;
+	write32bit(0L);		/* filled in by dumptrack() */
 	Trksize = 0;
 	Pend = NULL;
 	return 0;
@@ -403,20 +415,11 @@ inittrack(void)
 static int
 dumptrack(void)
 {
-	int c;
+	long sz = Mfsize;
 
-	myfclose(Trktmp);
-	OPENBINFILE(Trktmp,Tmpfname,"r");
-	if ( Trktmp == NULL ) {
-		tprint("Can't re-open midifile for dumping - '%s' (%s)",
-			Tmpfname,strerror(errno));
-		return 1;
-	}
-	fputs("MTrk",Outf);
+	Mfsize = Trkstart;
 	write32bit(Trksize);
-	while ( (c=getc(Trktmp)) != EOF )
-		putc(c,Outf);
-	myfclose(Trktmp);
+	Mfsize = sz;
 	return 0;
 }
 
@@ -456,22 +459,6 @@ setfactor(int div)
 	}
 }
 
-static void
-maketemp()	/* find a temporary file name (inefficient but portable) */
-{
-	int n = 0;
-
-	do {
-		sprintf(Tmpfname,"#%05d.tmp",++n);
-	} while ( exists(Tmpfname) );
-}
-
-static void
-rmtemp(void)
-{
-	(void) unlink(Tmpfname);
-}
-
 static void
 addpend(Noteptr n)
 {
@@ -497,28 +484,27 @@ addpend(Noteptr n)
 		nextnote(lastp) = newp;
 }
 
+/* Put out the notes from n up to (but not including) limit, along */
+/* with the pending note-offs that come before them.  Note-offs at or */
+/* before upto are also put out, after the last note. */
 static void
-phtrack(Phrasep p)
+trackto(Noteptr n,Noteptr limit,long upto,long *lasttime)
 {
-	Noteptr n = firstnote(p);
-	long lasttime = 0;
-	long toend;
-
-	while ( n != NULL || Pend != NULL ) {
+	while ( n != limit || (Pend != NULL && timeof(Pend) <= upto) ) {
 
 		/* Put out whichever is earlier - the top pending note-off or */
 		/* the start of the next note.  If they're both at the same */
 		/* time, the Pending note-off's get preference. */
 
-		if ( n==NULL || (Pend!=NULL && timeof(Pend) <= timeof(n) ) ) {
+		if ( n==limit || (Pend!=NULL && timeof(Pend) <= timeof(n) ) ) {
 
 			/* put out the top pending note-off */
 
 			Noteptr nextp = nextnote(Pend);
 
-			putdelta(timeof(Pend)-lasttime);
+			putdelta(timeof(Pend)-*lasttime);
 
-			lasttime = timeof(Pend);
+			*lasttime = timeof(Pend);
 
 			/* To distinguish this kind of note-off from a */
 			/* note-off with a release velocity, we use the */
@@ -535,8 +521,8 @@ phtrack(Phrasep p)
 		else {
 			/* put out the next note in the phrase */
 
-			putdelta(timeof(n)-lasttime);
-			lasttime = timeof(n);
+			putdelta(timeof(n)-*lasttime);
+			*lasttime = timeof(n);
 			if ( typeof(n) == NT_BYTES || typeof(n) == NT_LE3BYTES) {
 				putbytes(n);
 			}
@@ -558,6 +544,15 @@ phtrack(Phrasep p)
 			n = nextnote(n);
 		}
 	}
+}
+
+static void
+phtrack(Phrasep p)
+{
+	long lasttime = 0;
+	long toend;
+
+	trackto(firstnote(p),NULL,MAXLONG,&lasttime);
 	toend = p->p_leng - lasttime;
 	if ( toend < 0 )
 		toend = 0;
@@ -578,30 +573,20 @@ dophrase(Phrasep p)
 	return 0;
 }
 
-void
-arrtomf(Htablep arr,char *fname)
+/* Build the Standard MIDI File for arr in Mfbuff.  Returns non-zero */
+/* if there's an error. */
+static int
+mfencode(Htablep arr)
 {
 	Datum *alist;
 	int type, ntracks, n;
+	int err = 0;
 	Phrasep ph;
 	int div = (int)(*Clicks);
-	int err = 0;
-
-	if ( stdioname(fname) )
-		Outf = stdout;
-	else {
-		if ( *fname == '\0' )
-			execerror("Invalid (null) filename given to midifile");
-		OPENBINFILE(Outf,fname,"w");
-		if ( Outf == NULL ) {
-			execerror("Can't open midifile for writing - '%s' (%s)",
-				fname,strerror(errno));
-		}
-	}
 
+	Mfsize = 0;
 	alist = arrlist(arr,&ntracks,1);
 
-	maketemp();
 	setfactor(div);
 
 	type = ntracks>1 ? 1 : 0;
@@ -611,30 +596,240 @@ arrtomf(Htablep arr,char *fname)
 	else {
 		/* force it to be type 1, and add tempo track */
 		header( 1, ntracks+1, div );
-		err = tempotrack();
-		if ( err != 0 )
-			goto getout;
+		if ( tempotrack() != 0 )
+			err = 1;
 	}
-	for ( n=0; n<ntracks; n++ ) {
+	for ( n=0; err==0 && n<ntracks; n++ ) {
 		Symbol *as = arraysym(arr,alist[n],H_LOOK);
 		Datum *dp = symdataptr(as);
 
 		if ( dp->type != D_PHR ) {
-			err = 1;
 			tprint("midifile: non-phrase found in array!");
-			goto getout;
+			err = 1;
+			break;
 		}
 		ph = dp->u.phr;
 		Laststat = -1;
-		err = dophrase(ph);
-		if ( err != 0 )
-			goto getout;
+		if ( dophrase(ph) != 0 )
+			err = 1;
 	}
-    getout:
+	kfree(alist);
+	return err;
+}
+
+static void
+mfrelease(void)
+{
+	if ( Mfbuffsize > MFBUFFKEEP ) {
+		kfree(Mfbuff);
+		Mfbuff = NULL;
+		Mfbuffsize = 0;
+	}
+}
+
+void
+arrtomf(Htablep arr,char *fname)
+{
+	FILE *outf;
+	int err;
 
-	rmtemp();
-	if ( Outf != stdout )
-		myfclose(Outf);
+	if ( stdioname(fname) )
+		outf = stdout;
+	else {
+		if ( *fname == '\0' )
+			execerror("Invalid (null) filename given to midifile");
+		OPENBINFILE(outf,fname,"w");
+		if ( outf == NULL ) {
+			execerror("Can't open midifile for writing - '%s' (%s)",
+				fname,strerror(errno));
+		}
+	}
+
+	err = mfencode(arr);
+	if ( err == 0 && fwrite(Mfbuff,1,(size_t)Mfsize,outf) != (size_t)Mfsize ) {
+		tprint("midifile: error writing '%s' (%s)",fname,strerror(errno));
+		err = 1;
+	}
+	mfrelease();
+
+	if ( outf != stdout )
+		myfclose(outf);
 	if ( err != 0 )
 		execerror("midifile: error while generating file=%s",fname);
 }
+
+/* Like arrtomf, but the result is an array of byte values. */
+Datum
+arrtomfbytes(Htablep arr)
+{
+	Datum d;
+
+	if ( mfencode(arr) != 0 ) {
+		mfrelease();
+		execerror("midifile: error while generating bytes");
+	}
+	d = bytesdatum(Mfbuff,(int)Mfsize);
+	mfrelease();
+	return d;
+}
+
+/*
+ * Streaming of the Recorded phrase.  The file is written as it goes,
+ * one track of events appended as notes are finished, and the track's
+ * length is patched after each write.  So the file is a readable MIDI
+ * file at any point (though without an end-of-track until it's closed),
+ * and closing it only needs to write what's left.
+ */
+
+static FILE *Recf = NULL;	/* the file being streamed to */
+static char *Recfname = NULL;
+static long Rectrkstart;	/* file offset of the track's length */
+static long Rectrksize;
+static long Reclast;		/* time of the last event written */
+static int Recstat;		/* Laststat for the recorded track */
+static Noteptr Recpend = NULL;	/* Pend for the recorded track */
+static double Recfactor;
+
+int
+mfrecording(void)
+{
+	return Recf != NULL;
+}
+
+/* Write what's been put in Mfbuff to Recf, and patch the track length */
+static int
+recput(void)
+{
+	Unchar b[4];
+	long sz = Rectrksize + Trksize;
+
+	if ( fwrite(Mfbuff,1,(size_t)Mfsize,Recf) != (size_t)Mfsize )
+		return 1;
+	b[0] = (Unchar)((sz>>24) & 0xff);
+	b[1] = (Unchar)((sz>>16) & 0xff);
+	b[2] = (Unchar)((sz>>8) & 0xff);
+	b[3] = (Unchar)(sz & 0xff);
+	if ( fseek(Recf,Rectrkstart,SEEK_SET) != 0
+		|| fwrite(b,1,4,Recf) != 4
+		|| fseek(Recf,0L,SEEK_END) != 0
+		|| fflush(Recf) != 0 )
+		return 1;
+	Rectrksize = sz;
+	return 0;
+}
+
+/* The track-building routines use globals, which are switched */
+/* to the recorded track's around each use of them. */
+static void
+recbegin(void)
+{
+	Mfsize = 0;
+	Trksize = 0;
+	Laststat = Recstat;
+	Pend = Recpend;
+	Clickfactor = Recfactor;
+}
+
+static void
+recend(void)
+{
+	Recstat = Laststat;
+	Recpend = Pend;
+	Pend = NULL;
+	mfrelease();
+}
+
+static void
+recfailed(void)
+{
+	eprint("Error writing recording to '%s' (%s), it's been closed!\n",
+		Recfname,strerror(errno));
+	myfclose(Recf);
+	Recf = NULL;
+	freents(Recpend);
+	Recpend = NULL;
+}
+
+void
+mfrecopen(char *fname)
+{
+	int div = (int)(*Clicks);
+	int err;
+
+	if ( Recf != NULL )
+		execerror("Already recording to '%s'",Recfname);
+	if ( *fname == '\0' || stdioname(fname) )
+		execerror("Invalid filename given to recfile");
+	OPENBINFILE(Recf,fname,"w");
+	if ( Recf == NULL ) {
+		execerror("Can't open recfile for writing - '%s' (%s)",
+			fname,strerror(errno));
+	}
+	kfree(Recfname);
+	Recfname = strsave(fname);
+
+	Mfsize = 0;
+	setfactor(div);
+	Recfactor = Clickfactor;
+	if ( *Tempotrack == 0 )
+		header(0,1,div);
+	else {
+		header(1,2,div);
+		(void) tempotrack();
+	}
+	(void) inittrack();
+	Rectrkstart = Trkstart;
+	Rectrksize = 0;
+	Reclast = 0;
+	Recstat = -1;
+	Recpend = NULL;
+	err = recput();
+	mfrelease();
+	if ( err ) {
+		myfclose(Recf);
+		Recf = NULL;
+		execerror("Error writing recfile '%s' (%s)",fname,strerror(errno));
+	}
+}
+
+/* Write the notes from n up to (but not including) limit.  If limit is */
+/* NULL, all the pending note-offs are written too. */
+void
+mfrecwrite(Noteptr n,Noteptr limit)
+{
+	if ( Recf == NULL )
+		return;
+	recbegin();
+	trackto(n,limit,(limit==NULL)?MAXLONG:timeof(limit),&Reclast);
+	if ( Mfsize > 0 && recput() != 0 ) {
+		recend();
+		recfailed();
+		return;
+	}
+	recend();
+}
+
+/* Finish the file, with leng being the length of the recording */
+void
+mfrecclose(long leng)
+{
+	long toend;
+
+	if ( Recf == NULL )
+		return;
+	recbegin();
+	trackto(NULL,NULL,MAXLONG,&Reclast);
+	toend = leng - Reclast;
+	if ( toend < 0 )
+		toend = 0;
+	putdelta(toend);
+	endoftrack();
+	if ( recput() != 0 ) {
+		recend();
+		recfailed();
+		return;
+	}
+	recend();
+	myfclose(Recf);
+	Recf = NULL;
+}
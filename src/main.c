@@ -640,6 +640,7 @@ void
 finalexit(int r)
 NO_RETURN_ATTRIBUTE
 {
+	recfinish();
 	mdep_endmidi();
 	mdep_bye();
 	exit(r);
@@ -1551,6 +1552,8 @@ filetoph(FILE *f,char *fname)
 {
 	Phrasep p;
 
+	if ( isbinphrase(f) )
+		return binfiletoph(f,fname);
 	pushfin(f,fname,0);
 	p = yyphrase(yyinput);
 	popfin();
@@ -1601,11 +1604,16 @@ pathsearch(char *fname,long *apathsize,char ***apathparts,Symstrp alastkeypath,c
 	long needed;
 	int pn = 0;
 
-	if ( *apathparts == NULL || *alastkeypath != *pathvar ) {
+	/* The path value may be a transient string whose address is */
+	/* reused later, so a copy of it is kept and compared. */
+	if ( *apathparts == NULL || *alastkeypath == NULL
+			|| strcmp(*alastkeypath,*pathvar) != 0 ) {
 		if ( *apathparts != NULL )
 			kfree(*apathparts);
+		if ( *alastkeypath != NULL )
+			kfree(*alastkeypath);
 		*apathparts = makeparts(*pathvar);
-		*alastkeypath = *pathvar;
+		*alastkeypath = strsave(*pathvar);
 	}
 
 	needed = Maxpathleng + (long)strlen(fname) + 8;
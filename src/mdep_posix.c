@@ -0,0 +1,780 @@
+#include "key.h"
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
+
+// A native, headless machine-dependent layer, for running KeyKit
+// scripts as batch jobs (e.g. tests/ and the benchmarks) without a
+// browser.  The console is stdin/stdout, there's no window (drawing is
+// a no-op on a fixed-size screen), and MIDI output goes either nowhere
+// or to a file.  The environment variables it looks at are:
+//
+//     KEYROOT     the directory holding libcore etc.  The default is
+//                 the parent of the directory holding the executable.
+//     KEYPATH     overrides the Keypath built from KEYROOT
+//     KEYMIDIOUT  a file that the raw bytes sent to MIDI output 1
+//                 are appended to
+
+// Fixed screen size and font metrics, since nothing is displayed
+#define SCREEN_WIDTH 1024
+#define SCREEN_HEIGHT 768
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 16
+
+static int current_color_index = 0;
+
+static char keyroot[PATH_MAX];
+static char keypath_buffer[5*PATH_MAX];
+static char musicpath_buffer[PATH_MAX+16];
+
+static long start_time_ms = 0;
+
+// Set when stdin has hit EOF, so mdep_waitfor() stops polling it
+static int console_eof = 0;
+
+// MIDI output 1, when it's backed by a file
+static char *midi_out_name = NULL;
+static FILE *midi_out_file = NULL;
+static long midi_out_bytes = 0;
+
+void
+mdep_hello(int argc, char **argv)
+{
+    char buff[PATH_MAX];
+    char *p;
+
+    // Find KEYROOT, by default the parent of the executable's directory
+    p = getenv("KEYROOT");
+    if (p != NULL && *p != '\0') {
+        snprintf(keyroot, sizeof(keyroot), "%s", p);
+    } else if (argc > 0 && strchr(argv[0], '/') != NULL
+            && realpath(argv[0], buff) != NULL) {
+        // strip the executable name, then its directory
+        if ((p = strrchr(buff, '/')) != NULL)
+            *p = '\0';
+        if ((p = strrchr(buff, '/')) != NULL && p != buff)
+            *p = '\0';
+        snprintf(keyroot, sizeof(keyroot), "%s", buff);
+    } else {
+        strcpy(keyroot, "..");
+    }
+}
+
+void
+mdep_bye(void)
+{
+    if (midi_out_file != NULL) {
+        fclose(midi_out_file);
+        midi_out_file = NULL;
+    }
+}
+
+int
+mdep_changedir(char *d)
+{
+    return chdir(d);
+}
+
+char *
+mdep_currentdir(char *buff, int leng)
+{
+    return getcwd(buff, leng);
+}
+
+int
+mdep_lsdir(char *dir, char *exp, void (*callback)(char *, int))
+{
+    DIR *d;
+    struct dirent *dirEntry;
+    struct stat s;
+    char path[PATH_MAX];
+    int isdir;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return 0;  // okay, there's just nothing that matches
+    while ((dirEntry = readdir(d)) != NULL) {
+        if (exp != NULL && *exp != '\0' && fnmatch(exp, dirEntry->d_name, 0) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, dirEntry->d_name);
+        isdir = (stat(path, &s) == 0 && S_ISDIR(s.st_mode));
+        callback(dirEntry->d_name, isdir);
+    }
+    closedir(d);
+    return 0;
+}
+
+long
+mdep_filetime(char *fn)
+{
+    struct stat s;
+    if (stat(fn, &s) == -1)
+        return -1;
+    return (long)s.st_mtime;
+}
+
+int
+mdep_fisatty(FILE *f)
+{
+    return isatty(fileno(f));
+}
+
+long
+mdep_currtime(void)
+{
+    time_t t;
+    time(&t);
+    return (long)t;
+}
+
+long
+mdep_coreleft(void)
+{
+    return 1024 * 1024 * 1024; // Fake 1GB free
+}
+
+int
+mdep_full_or_relative_path(char *path)
+{
+    if (*path == '/' || *path == '.')
+        return 1;
+    return 0;
+}
+
+int
+mdep_makepath(char *dirname, char *filename, char *result, int resultsize)
+{
+    if (resultsize < (int)(strlen(dirname) + strlen(filename) + 2))
+        return 1;
+
+    if (strcmp(dirname, ".") == 0) {
+        strcpy(result, filename);
+        return 0;
+    }
+
+    strcpy(result, dirname);
+    if (*dirname != '\0' && dirname[strlen(dirname)-1] != '/')
+        strcat(result, "/");
+    strcat(result, filename);
+    return 0;
+}
+
+// There's no window, so everything that would pop up (including the
+// output of print() and printf()) goes to stdout.
+void
+mdep_popup(char *s)
+{
+    // keyfile() announces each file it reads, which would get mixed
+    // into the output of batch runs, so that's only shown (on a line
+    // of its own) when Loadverbose is set.
+    if (strncmp(s, "keyfile: ", 9) == 0) {
+        if (*Loadverbose)
+            printf("%s\n", s);
+        return;
+    }
+    fputs(s, stdout);
+    fflush(stdout);
+}
+
+void
+mdep_setcursor(int c)
+{
+    (void)c;
+    // No cursor
+}
+
+void
+mdep_prerc(void)
+{
+    // No-op
+}
+
+void
+mdep_postrc(void)
+{
+    installstr("Host", mdep_hostos());
+}
+
+void
+mdep_abortexit(char *msg)
+{
+    fprintf(stderr, "ABORT: %s\n", msg);
+    abort();
+}
+
+void
+mdep_setinterrupt(SIGFUNCTYPE func)
+{
+    signal(SIGINT, func);
+}
+
+void
+mdep_ignoreinterrupt(void)
+{
+    signal(SIGINT, SIG_IGN);
+}
+
+void
+mdep_sync(void)
+{
+    fflush(stdout);
+}
+
+long
+mdep_milliclock(void)
+{
+    struct timeval tv;
+    long ms;
+
+    gettimeofday(&tv, NULL);
+    ms = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+    if (start_time_ms == 0)
+        start_time_ms = ms;
+    return ms - start_time_ms;
+}
+
+void
+mdep_resetclock(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    start_time_ms = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+// MIDI.  There are no inputs.  Output 1 is either a null device, or
+// (if KEYMIDIOUT is set) a file that gets the raw bytes.
+
+int
+mdep_getnmidi(char *buff, int buffsize, int *port)
+{
+    (void)buff; (void)buffsize;
+    if (port)
+        *port = 0;
+    return 0;
+}
+
+void
+mdep_putnmidi(int n, char *cp, Midiport *pport)
+{
+    if (pport == NULL || !pport->opened || pport->private1 != 0)
+        return;
+    if (midi_out_file != NULL) {
+        if (fwrite(cp, 1, n, midi_out_file) != (size_t)n)
+            eprint("Error writing MIDI output to %s\n", midi_out_name);
+    }
+    midi_out_bytes += n;
+}
+
+int
+mdep_initmidi(Midiport *inputs, Midiport *outputs)
+{
+    int i;
+
+    for (i = 0; i < MIDI_IN_DEVICES; i++) {
+        inputs[i].name = NULL;
+        inputs[i].opened = 0;
+        inputs[i].private1 = -1;
+    }
+    for (i = 0; i < MIDI_OUT_DEVICES; i++) {
+        outputs[i].name = NULL;
+        outputs[i].opened = 0;
+        outputs[i].private1 = -1;
+    }
+
+    midi_out_name = getenv("KEYMIDIOUT");
+    if (midi_out_name != NULL && *midi_out_name == '\0')
+        midi_out_name = NULL;
+    outputs[0].name = uniqstr(midi_out_name ? midi_out_name : "null");
+    outputs[0].private1 = 0;
+    return 0;
+}
+
+void
+mdep_endmidi(void)
+{
+    if (midi_out_file != NULL)
+        fflush(midi_out_file);
+}
+
+int
+mdep_midi(int openclose, Midiport *p)
+{
+    if (p == NULL || p->private1 < 0)
+        return -1;
+
+    switch (openclose) {
+    case MIDI_OPEN_INPUT:
+    case MIDI_CLOSE_INPUT:
+        return -1;
+
+    case MIDI_OPEN_OUTPUT:
+        if (midi_out_name != NULL && midi_out_file == NULL) {
+            midi_out_file = fopen(midi_out_name, "ab");
+            if (midi_out_file == NULL) {
+                eprint("Unable to open MIDI output file %s (%s)\n",
+                    midi_out_name, strerror(errno));
+                return -1;
+            }
+        }
+        p->opened = 1;
+        return 0;
+
+    case MIDI_CLOSE_OUTPUT:
+        if (midi_out_file != NULL) {
+            fclose(midi_out_file);
+            midi_out_file = NULL;
+        }
+        p->opened = 0;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+// Generic mdep entry point
+Datum
+mdep_mdep(int argc)
+{
+	char *args[3];
+	int n;
+	Datum d;
+
+	d = Nullval;
+	for ( n=0; n<3 && n<argc; n++ ) {
+		Datum dd = ARG(n);
+		if ( dd.type == D_STR ) {
+			args[n] = needstr("mdep",dd);
+		} else {
+			args[n] = "";
+		}
+	}
+	for ( ; n<3; n++ )
+		args[n] = "";
+
+	/*
+	 * recognized commands are:
+	 *     env get {name}
+	 *     midi stats    (bytes sent to MIDI output 1)
+	 */
+
+	if ( strcmp(args[0],"env") == 0 ) {
+	    if ( strcmp(args[1],"get")==0 ) {
+			char *s = getenv(args[2]);
+			if ( s != NULL ) {
+				d = strdatum(uniqstr(s));
+			} else {
+				d = strdatum(Nullstr);
+			}
+	    } else {
+		execerror("mdep(\"env\",... ) doesn't recognize %s\n",args[1]);
+	    }
+	}
+	else if ( strcmp(args[0],"midi")==0 && strcmp(args[1],"stats")==0 ) {
+		d = numdatum(midi_out_bytes);
+	}
+	else {
+		/* unrecognized command */
+		eprint("Error: mdep(%s,...) not implemented in POSIX build.\n",args[0]);
+	}
+	return d;
+}
+
+// Wait for console input, or until the timeout.  Since there's no
+// window, MIDI input, or ports, stdin is all there is to poll.
+int
+mdep_waitfor(int millimsecs)
+{
+    struct pollfd pfd;
+    int r;
+
+    if (millimsecs < 0)
+        millimsecs = 0;
+
+    if (Consolefd < 0 || console_eof) {
+        if (millimsecs > 0)
+            poll(NULL, 0, millimsecs);
+        return K_TIMEOUT;
+    }
+
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    r = poll(&pfd, 1, millimsecs);
+    if (r < 0)
+        return (errno == EINTR) ? K_TIMEOUT : K_ERROR;
+    if (r > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+        return K_CONSOLE;
+    return K_TIMEOUT;
+}
+
+int
+mdep_getportdata(PORTHANDLE *port, char *buff, int max, Datum *data)
+{
+    (void)port; (void)buff; (void)max; (void)data;
+    return -1;  // No ports
+}
+
+int
+mdep_getconsole(void)
+{
+    unsigned char c;
+    int r;
+
+    do {
+        r = (int)read(0, &c, 1);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) {
+        console_eof = 1;
+        return -1;
+    }
+    return c;
+}
+
+int
+mdep_statconsole(void)
+{
+    struct pollfd pfd;
+
+    if (console_eof)
+        return 0;
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLIN | POLLHUP)) != 0)
+        return 1;
+    return 0;
+}
+
+// Ports (tcpip, udp, osc, nats) aren't supported
+
+PORTHANDLE *
+mdep_openport(char *name, char *mode, char *type)
+{
+    (void)name; (void)mode;
+    eprint("Ports (%s) are not supported in the POSIX build\n", type);
+    return NULL;
+}
+
+int
+mdep_putportdata(PORTHANDLE m, char *buff, int size)
+{
+    (void)m; (void)buff; (void)size;
+    return -1;
+}
+
+int
+mdep_closeport(PORTHANDLE m)
+{
+    (void)m;
+    return 0;
+}
+
+Datum
+mdep_ctlport(PORTHANDLE m, char *cmd, char *arg)
+{
+    (void)m; (void)cmd; (void)arg;
+    return Noval;  // let fifoctl() handle it
+}
+
+// Graphics.  Everything is drawn on a screen that nobody sees.
+
+int
+mdep_maxx(void)
+{
+    return SCREEN_WIDTH;
+}
+
+int
+mdep_maxy(void)
+{
+    return SCREEN_HEIGHT;
+}
+
+int
+mdep_fontwidth(void)
+{
+    return FONT_WIDTH;
+}
+
+int
+mdep_fontheight(void)
+{
+    return FONT_HEIGHT;
+}
+
+void
+mdep_line(int x0, int y0, int x1, int y1)
+{
+    (void)x0; (void)y0; (void)x1; (void)y1;
+}
+
+void
+mdep_string(int x, int y, char *s)
+{
+    (void)x; (void)y; (void)s;
+}
+
+void
+mdep_color(int c)
+{
+    current_color_index = c % KEYNCOLORS;
+}
+
+int
+mdep_getcolor(void)
+{
+    return current_color_index;
+}
+
+void
+mdep_box(int x0, int y0, int x1, int y1)
+{
+    (void)x0; (void)y0; (void)x1; (void)y1;
+}
+
+void
+mdep_boxfill(int x0, int y0, int x1, int y1)
+{
+    (void)x0; (void)y0; (void)x1; (void)y1;
+}
+
+void
+mdep_ellipse(int x0, int y0, int x1, int y1)
+{
+    (void)x0; (void)y0; (void)x1; (void)y1;
+}
+
+void
+mdep_fillellipse(int x0, int y0, int x1, int y1)
+{
+    (void)x0; (void)y0; (void)x1; (void)y1;
+}
+
+void
+mdep_fillpolygon(int *x, int *y, int n)
+{
+    (void)x; (void)y; (void)n;
+}
+
+void
+mdep_freebitmap(Pbitmap b)
+{
+    if (b) {
+        if (b->ptr)
+            free(b->ptr);
+        free(b);
+    }
+}
+
+int
+mdep_startgraphics(int argc, char **argv)
+{
+    (void)argc; (void)argv;
+    *Colors = KEYNCOLORS;
+    mdep_initcolors();
+    mdep_color(1);
+    return 0;
+}
+
+void
+mdep_startrealtime(void)
+{
+}
+
+void
+mdep_startreboot(void)
+{
+}
+
+void
+mdep_endgraphics(void)
+{
+}
+
+void
+mdep_plotmode(int mode)
+{
+    if (mode == 2)
+        execerror("mdep_plotmode: mode == 2 is obsolete!");
+}
+
+int
+mdep_screensize(int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = 0;
+    *y0 = 0;
+    *x1 = mdep_maxx();
+    *y1 = mdep_maxy();
+    return 0;
+}
+
+int
+mdep_screenresize(int x0, int y0, int x1, int y1)
+{
+    (void)x0; (void)y0; (void)x1; (void)y1;
+    return 0;
+}
+
+void
+mdep_destroywindow(void)
+{
+}
+
+char *
+mdep_fontinit(char *fnt)
+{
+    (void)fnt;
+    return NULL;
+}
+
+int
+mdep_get_mouse_event(int *x, int *y, int *buttons, int *event_type, int *modifiers)
+{
+    (void)x; (void)y; (void)buttons; (void)event_type; (void)modifiers;
+    return 0;  // No mouse
+}
+
+int
+mdep_mousewarp(int x, int y)
+{
+    (void)x; (void)y;
+    return -1;
+}
+
+void
+mdep_colormix(int c, int r, int g, int b)
+{
+    (void)r; (void)g; (void)b;
+    if ( c < 0 || c >= KEYNCOLORS ) {
+        execerror("mdep_colormix: color index %d out of range\n", c);
+    }
+}
+
+void
+mdep_initcolors(void)
+{
+    current_color_index = 1;
+}
+
+// Bitmaps are allocated (the window code keeps track of their sizes),
+// but never drawn into.
+Pbitmap
+mdep_allocbitmap(int xsize, int ysize)
+{
+    Pbitmap pb = (Pbitmap)malloc(sizeof(struct Pbitmap_struct));
+    if (pb) {
+        pb->xsize = xsize;
+        pb->ysize = ysize;
+        pb->origx = xsize;
+        pb->origy = ysize;
+        pb->ptr = NULL;
+    }
+    return pb;
+}
+
+Pbitmap
+mdep_reallocbitmap(int xsize, int ysize, Pbitmap pb)
+{
+    if (pb) {
+        pb->xsize = xsize;
+        pb->ysize = ysize;
+        if (xsize > pb->origx)
+            pb->origx = xsize;
+        if (ysize > pb->origy)
+            pb->origy = ysize;
+    }
+    return pb;
+}
+
+void
+mdep_movebitmap(int fromx0, int fromy0, int width, int height, int tox0, int toy0)
+{
+    (void)fromx0; (void)fromy0; (void)width; (void)height; (void)tox0; (void)toy0;
+}
+
+void
+mdep_pullbitmap(int x0, int y0, Pbitmap pb)
+{
+    (void)x0; (void)y0; (void)pb;
+}
+
+void
+mdep_putbitmap(int x0, int y0, Pbitmap pb)
+{
+    (void)x0; (void)y0; (void)pb;
+}
+
+// File/path functions
+char *
+mdep_keypath(void)
+{
+    char *p = getenv("KEYPATH");
+
+    if (p != NULL && *p != '\0')
+        return p;
+    snprintf(keypath_buffer, sizeof(keypath_buffer),
+        "%s/libcore;%s/libtools;%s/libextra;%s/local/lib",
+        keyroot, keyroot, keyroot, keyroot);
+    return keypath_buffer;
+}
+
+char *
+mdep_musicpath(void)
+{
+    snprintf(musicpath_buffer, sizeof(musicpath_buffer), "%s/music", keyroot);
+    return musicpath_buffer;
+}
+
+// Get host operating system name, e.g. "linux" or "macos"
+char *
+mdep_hostos(void)
+{
+    static char host_os_buffer[sizeof(((struct utsname *)0)->sysname)] = "";
+    struct utsname u;
+    char *p;
+
+    if (host_os_buffer[0] == '\0') {
+        if (uname(&u) != 0)
+            strcpy(host_os_buffer, "unknown");
+        else if (strcmp(u.sysname, "Darwin") == 0)
+            strcpy(host_os_buffer, "macos");
+        else {
+            snprintf(host_os_buffer, sizeof(host_os_buffer), "%s", u.sysname);
+            for (p = host_os_buffer; *p != '\0'; p++)
+                *p = tolower((unsigned char)*p);
+        }
+    }
+    return host_os_buffer;
+}
+
+int
+mdep_shellexec(char *s)
+{
+    fflush(stdout);
+    return system(s);
+}
+
+char *
+mdep_browse(char *desc, char *types, int mustexist)
+{
+    (void)desc; (void)types; (void)mustexist;
+    return NULL;  // No file dialog
+}
+
+int
+mdep_help(char *fname, char *keyword)
+{
+    (void)fname; (void)keyword;
+    return -1;
+}
+
+char *
+mdep_localaddresses(Datum d)
+{
+    (void)d;
+    return "127.0.0.1";
+}
@@ -110,6 +110,10 @@ static char color_list[KEYNCOLORS][RGB_BUFFER_SIZE];
 #define TYPE_WRITE 2
 #define TYPE_LISTEN 3
 
+// Most data that can be waiting to be sent on a port (by default)
+#define SOCKAWAY_MAX (1024*1024)
+#define SOCKAWAY_INIT 1024
+
 // Port info structure
 struct myportinfo {
     char *name;
@@ -121,9 +125,16 @@ struct myportinfo {
     int isopen;
     int closeme;
     int hasreturnedfinaldata;
-    char *buff;  // buffered data
-    int buffsize;
+    char *buff;  // data waiting to be sent, see sockaway()
+    int buffsize;  // bytes used in buff
+    int buffalloc;  // bytes allocated for buff
+    int maxpending;  // limit on buffsize
     char *nats_subject;  // NATS subject for NATS ports
+    int nats_sid;  // id of nats_subject, for NATS listen ports
+    struct myportinfo *natsnext;  // next listener on the same subject
+    int isready;  // on the Readyport queue
+    struct myportinfo *readynext;  // next on the Readyport queue
+    struct myportinfo *idnext;  // chain in Portids
     struct myportinfo *next;
 };
 
@@ -132,22 +143,64 @@ typedef struct myportinfo Myport;
 static Myport *Topport = NULL;
 static int next_port_id = 1;
 
-// NATS message buffer structure (forward declarations)
-#define NATS_MESSAGE_BUFFER_SIZE 20
-struct nats_msg_buffer {
-    char *subject;
-    char *data;
+// Ports that may have something for mdep_getportdata() are queued
+// here by the JavaScript callbacks, so it doesn't have to scan Topport.
+static Myport *Readyport = NULL;
+static Myport *Lastreadyport = NULL;
+
+// Ports hashed by portId, for the WebSocket callbacks.
+#define PORTIDHASH 64
+static Myport *Portids[PORTIDHASH];
+
+// NATS messages are queued per subject.  Each subject is given a small
+// id, and each queue is a list of messages taken from a shared pool of
+// fixed-size slots, so enqueue and dequeue are O(1) and don't malloc
+// unless a message is bigger than a slot.  Only subjects with a
+// listener are kept; messages for other subjects are dropped, and a
+// subject goes away when its last listener closes.
+#define NATS_SLOTSIZE 240  // bytes of message data that fit in a slot
+#define NATS_SLOTCHUNK 64  // slots allocated at a time
+#define NATS_MAXPENDING 4096  // messages held (over all subjects) before dropping
+#define NATS_MAXPERSUBJ 1024  // messages held for one subject before dropping
+#define NATS_SUBJHASH 64
+
+struct natsmsg {
+    struct natsmsg *next;
+    int len;
+    char *data;  // either slot, or malloc'd if it didn't fit
+    char slot[NATS_SLOTSIZE];
+};
+
+struct natssubj {
+    char *name;
+    int id;
+    struct natsmsg *head;
+    struct natsmsg *tail;
+    int count;
+    Myport *listeners;  // NATS listen ports on this subject
+    struct natssubj *hnext;  // chain in Natshash
 };
-static struct nats_msg_buffer nats_message_buffer[NATS_MESSAGE_BUFFER_SIZE];
-static int nats_message_read_pos = 0;
-static int nats_message_write_pos = 0;
-static int nats_message_count = 0;
+
+static struct natssubj **Natssubjs = NULL;  // indexed by id
+static int Nnatssubjs = 0;
+static int Natssubjsize = 0;
+static struct natssubj *Natshash[NATS_SUBJHASH];
+static struct natssubj *Natsfreesubjs = NULL;  // removed subjects, ids reusable
+static struct natsmsg *Natsfree = NULL;
+static int Natspending = 0;
+static long Natsdropped = 0;
 
 // Forward declarations of helper functions
-static int nats_has_message_for_subject(const char *subject);
-static int nats_get_message_for_subject(const char *subject, char *buffer, int buffer_size);
+static int natssubject(const char *subject);
+static int nats_has_message_for_subject(int sid);
+static int nats_get_message_for_subject(int sid, char *buffer, int buffer_size);
+static void natsunlisten(Myport *m);
 static Myport *newmyport(char *name);
-static void sockaway(Myport *m, char *buff, int size);
+static void portready(Myport *m);
+static void portunready(Myport *m);
+static void hashportid(Myport *m);
+static void unhashportid(Myport *m);
+static int sockaway(Myport *m, char *buff, int size);
 static void sendsockedaway(Myport *mp);
 
 void
@@ -1103,6 +1156,10 @@ mdep_mdep(int argc)
 int
 mdep_waitfor(int millimsecs)
 {
+    // Don't sleep if a port already has something waiting
+    if (Readyport != NULL)
+        return K_PORT;
+
     // Use emscripten_sleep() to properly yield to browser event loop
     // This allows mouse/keyboard callbacks to be processed during the sleep
     if (millimsecs > 0) {
@@ -1123,6 +1180,10 @@ mdep_waitfor(int millimsecs)
 	if ( mdep_statconsole() ) {
 		return K_CONSOLE;
 	}
+
+    // Ports queued by the callbacks during the sleep
+    if (Readyport != NULL)
+        return K_PORT;
     return K_TIMEOUT;
 }
 
@@ -1132,8 +1193,14 @@ mdep_getportdata(PORTHANDLE *port, char *buff, int max, Datum *data)
     Myport *m;
     int r;
 
-    // Check all open ports for data
-    for (m = Topport; m != NULL; m = m->next) {
+    // Only the ports that the callbacks have queued are looked at
+    while ((m = Readyport) != NULL) {
+        Readyport = m->readynext;
+        if (Readyport == NULL)
+            Lastreadyport = NULL;
+        m->readynext = NULL;
+        m->isready = 0;
+
         if (!m->isopen)
             continue;
 
@@ -1150,32 +1217,30 @@ mdep_getportdata(PORTHANDLE *port, char *buff, int max, Datum *data)
             return -2;  // Connection refused
         }
 
-        // Check for readable ports
-        if (m->portstate == PORT_CANREAD || m->rw == TYPE_LISTEN) {
-            // NATS listen ports
-            if (m->myport_type == MYPORT_NATS_LISTEN) {
-                // Check for messages on this subject
-                if (nats_has_message_for_subject(m->nats_subject)) {
-                    r = nats_get_message_for_subject(m->nats_subject, buff, max);
-                    if (r > 0) {
-                        *port = m;
-                        printf("[PORT] mdep_getportdata: NATS port got %d bytes\n", r);
-                        return r;
-                    }
-                }
-                continue;
+        // NATS listen ports
+        if (m->myport_type == MYPORT_NATS_LISTEN) {
+            r = nats_get_message_for_subject(m->nats_sid, buff, max);
+            // Come back for any more messages on this subject
+            if (nats_has_message_for_subject(m->nats_sid))
+                portready(m);
+            if (r > 0) {
+                *port = m;
+                return r;
             }
+            continue;
+        }
 
-            // WebSocket ports
-            if (m->portId > 0) {
-                r = js_websocket_receive(m->portId, buff, max);
-                if (r > 0) {
-                    *port = m;
-                    m->portstate = PORT_NORMAL;  // Clear can-read flag
-                    printf("[PORT] mdep_getportdata: WebSocket port %d got %d bytes\n",
-                           m->portId, r);
-                    return r;
-                }
+        // WebSocket ports
+        if (m->portId > 0 && m->rw != TYPE_WRITE) {
+            r = js_websocket_receive(m->portId, buff, max);
+            if (r > 0) {
+                // There may be more than one message waiting
+                portready(m);
+                *port = m;
+                m->portstate = PORT_NORMAL;
+                printf("[PORT] mdep_getportdata: WebSocket port %d got %d bytes\n",
+                       m->portId, r);
+                return r;
             }
         }
     }
@@ -1778,7 +1843,9 @@ mdep_openport(char *name, char *mode, char *type)
         m1->rw = TYPE_WRITE;
         m1->myport_type = MYPORT_TCPIP_WRITE;
         m1->isopen = 1;
+        unhashportid(m1);
         m1->portId = m0->portId;  // Share same WebSocket
+        hashportid(m1);
 
         // Initiate connection
         if (js_websocket_connect(url, m0->portId) != 0) {
@@ -1949,6 +2016,11 @@ mdep_openport(char *name, char *mode, char *type)
         m0->closeme = 1;
         m0->nats_subject = uniqstr(buff);  // Store subject
         m0->sockstate = SOCK_LISTENING;
+        m0->nats_sid = natssubject(m0->nats_subject);
+        m0->natsnext = Natssubjs[m0->nats_sid]->listeners;
+        Natssubjs[m0->nats_sid]->listeners = m0;
+        if (nats_has_message_for_subject(m0->nats_sid))
+            portready(m0);
 
         handle[0] = m0;
         handle[1] = NULL;
@@ -2003,8 +2075,7 @@ mdep_putportdata(PORTHANDLE m, char *buff, int size)
         switch (mp->sockstate) {
         case SOCK_UNCONNECTED:
             // Buffer for delivery when it connects
-            sockaway(mp, buff, size);
-            r = size;
+            r = (sockaway(mp, buff, size) == 0) ? size : -1;
             break;
 
         case SOCK_CLOSED:
@@ -2013,12 +2084,17 @@ mdep_putportdata(PORTHANDLE m, char *buff, int size)
             break;
 
         default:
-            // Connected - send directly
+            // Connected - send directly, unless earlier data
+            // is still waiting (it has to go first)
+            sendsockedaway(mp);
+            if (mp->buffsize > 0) {
+                r = (sockaway(mp, buff, size) == 0) ? 0 : -1;
+                break;
+            }
             r = js_websocket_send(mp->portId, buff, size);
             if (r < 0) {
                 // Send failed, buffer it
-                sockaway(mp, buff, size);
-                r = 0;
+                r = (sockaway(mp, buff, size) == 0) ? 0 : -1;
             }
             break;
         }
@@ -2041,8 +2117,10 @@ mdep_closeport(PORTHANDLE m)
 
     // Close connection based on type
     switch (mp->myport_type) {
-    case MYPORT_NATS_WRITE:
     case MYPORT_NATS_LISTEN:
+        natsunlisten(mp);
+        // FALLTHROUGH
+    case MYPORT_NATS_WRITE:
         // NATS ports share connection - don't close unless no other NATS ports
         // For now, just mark as closed (NATS connection managed globally)
         printf("[PORT] NATS port closed (connection remains active)\n");
@@ -2063,6 +2141,9 @@ mdep_closeport(PORTHANDLE m)
         break;
     }
 
+    portunready(mp);
+    unhashportid(mp);
+
     // Remove from Topport list
     for (prevmp = NULL, currmp = Topport; currmp != NULL; prevmp = currmp, currmp = currmp->next) {
         if (currmp == mp)
@@ -2087,14 +2168,18 @@ mdep_closeport(PORTHANDLE m)
 Datum
 mdep_ctlport(PORTHANDLE m, char *cmd, char *arg)
 {
-    Datum d;
-    d.type = D_NUM;
-    d.u.val = 0;
-
-    // No special control commands for WebSocket ports yet
-    // Could add things like setting binary mode, buffering options, etc.
+    Myport *mp = (Myport *)m;
 
-    return d;
+    // Bytes waiting to be sent (e.g. before the socket connects)
+    if (strcmp(cmd, "pending") == 0)
+        return numdatum(mp->buffsize);
+    // Limit on that; once it's reached, put()s are dropped
+    if (strcmp(cmd, "maxpending") == 0) {
+        if (*arg != '\0')
+            mp->maxpending = atoi(arg);
+        return numdatum(mp->maxpending);
+    }
+    return Noval;  // let fifoctl() handle it
 }
 
 int
@@ -2111,119 +2196,207 @@ mdep_localaddresses(Datum d)
 
 // ========== NATS Messaging Implementation ==========
 
-// NATS callback - called from JavaScript when message arrives
-// Keep this minimal to avoid ASYNCIFY issues
-EMSCRIPTEN_KEEPALIVE
-void mdep_on_nats_message(const char *subject, const char *data)
+static unsigned int natssubjhash(const char *subject)
 {
-    // Simply buffer the message for later processing
-    if (nats_message_count < NATS_MESSAGE_BUFFER_SIZE) {
-        // Allocate and copy subject
-        int subject_len = strlen(subject);
-        nats_message_buffer[nats_message_write_pos].subject = (char *)malloc(subject_len + 1);
-        if (nats_message_buffer[nats_message_write_pos].subject) {
-            strcpy(nats_message_buffer[nats_message_write_pos].subject, subject);
-        }
+    unsigned int h = 0;
+    const char *p;
 
-        // Allocate and copy data
-        int data_len = strlen(data);
-        nats_message_buffer[nats_message_write_pos].data = (char *)malloc(data_len + 1);
-        if (nats_message_buffer[nats_message_write_pos].data) {
-            strcpy(nats_message_buffer[nats_message_write_pos].data, data);
-        }
+    for (p = subject; *p; p++)
+        h = h * 31 + (unsigned char)*p;
+    return h % NATS_SUBJHASH;
+}
 
-        nats_message_write_pos = (nats_message_write_pos + 1) % NATS_MESSAGE_BUFFER_SIZE;
-        nats_message_count++;
+// Return the entry for a subject, or NULL if it has none
+static struct natssubj *natsfindsubject(const char *subject)
+{
+    struct natssubj *ns;
 
-        printf("[NATS C] Buffered message: subject='%s' data='%s' (buffer count=%d)\n",
-               subject, data, nats_message_count);
-    } else {
-        printf("[NATS C] WARNING: Message buffer full, dropping message on '%s'\n", subject);
+    for (ns = Natshash[natssubjhash(subject)]; ns != NULL; ns = ns->hnext) {
+        if (strcmp(ns->name, subject) == 0)
+            return ns;
     }
+    return NULL;
 }
 
-// Check if NATS messages are available for a specific subject
-static int nats_has_message_for_subject(const char *subject)
+// Return the id of a subject, adding it if it's new
+static int natssubject(const char *subject)
 {
-    if (nats_message_count == 0) {
-        return 0;
-    }
+    struct natssubj *ns;
+    unsigned int h;
 
-    // Check if any buffered message matches the subject
-    int pos = nats_message_read_pos;
-    int checked = 0;
-    while (checked < nats_message_count) {
-        struct nats_msg_buffer *msg = &nats_message_buffer[pos];
-        if (msg->subject && strcmp(msg->subject, subject) == 0) {
-            return 1;
+    if ((ns = natsfindsubject(subject)) != NULL)
+        return ns->id;
+    if (Natsfreesubjs != NULL) {
+        // reuse a removed entry, along with its id
+        ns = Natsfreesubjs;
+        Natsfreesubjs = ns->hnext;
+    } else {
+        if (Nnatssubjs >= Natssubjsize) {
+            Natssubjsize = Natssubjsize ? Natssubjsize * 2 : 16;
+            Natssubjs = (struct natssubj **)realloc(Natssubjs,
+                Natssubjsize * sizeof(struct natssubj *));
         }
-        pos = (pos + 1) % NATS_MESSAGE_BUFFER_SIZE;
-        checked++;
+        ns = (struct natssubj *)malloc(sizeof(struct natssubj));
+        ns->id = Nnatssubjs;
+        Natssubjs[Nnatssubjs++] = ns;
     }
-
-    return 0;
+    ns->name = (char *)malloc(strlen(subject) + 1);
+    strcpy(ns->name, subject);
+    ns->head = NULL;
+    ns->tail = NULL;
+    ns->count = 0;
+    ns->listeners = NULL;
+    h = natssubjhash(subject);
+    ns->hnext = Natshash[h];
+    Natshash[h] = ns;
+    return ns->id;
+}
+
+// Take a subject with no listeners and no messages out of the hash.
+// Its entry (and id) is kept for the next new subject.
+static void natsrmsubject(struct natssubj *ns)
+{
+    struct natssubj **pns;
+
+    for (pns = &Natshash[natssubjhash(ns->name)]; *pns != NULL; pns = &((*pns)->hnext)) {
+        if (*pns == ns) {
+            *pns = ns->hnext;
+            break;
+        }
+    }
+    free(ns->name);
+    ns->name = NULL;
+    ns->hnext = Natsfreesubjs;
+    Natsfreesubjs = ns;
 }
 
-// Get next NATS message for a specific subject
-static int nats_get_message_for_subject(const char *subject, char *buffer, int buffer_size)
+static struct natsmsg *newnatsmsg(int len)
 {
-    if (nats_message_count == 0) {
-        return 0;
+    struct natsmsg *msg;
+    int i;
+
+    if (Natsfree == NULL) {
+        msg = (struct natsmsg *)malloc(NATS_SLOTCHUNK * sizeof(struct natsmsg));
+        if (msg == NULL)
+            return NULL;
+        for (i = 0; i < NATS_SLOTCHUNK; i++) {
+            msg[i].next = Natsfree;
+            Natsfree = &msg[i];
+        }
+    }
+    msg = Natsfree;
+    Natsfree = msg->next;
+    msg->next = NULL;
+    msg->len = len;
+    if (len <= NATS_SLOTSIZE)
+        msg->data = msg->slot;
+    else if ((msg->data = (char *)malloc(len)) == NULL) {
+        msg->next = Natsfree;
+        Natsfree = msg;
+        return NULL;
     }
+    return msg;
+}
+
+static void freenatsmsg(struct natsmsg *msg)
+{
+    if (msg->data != msg->slot)
+        free(msg->data);
+    msg->next = Natsfree;
+    Natsfree = msg;
+}
 
-    // Find first message matching subject
-    int pos = nats_message_read_pos;
-    int checked = 0;
-    int found_at = -1;
+// Stop a NATS listen port from hearing about its subject.  If nothing
+// else is listening, the messages queued for the subject are dropped,
+// and the subject is removed.
+static void natsunlisten(Myport *m)
+{
+    struct natssubj *ns = Natssubjs[m->nats_sid];
+    struct natsmsg *msg;
+    Myport **pm;
 
-    while (checked < nats_message_count) {
-        struct nats_msg_buffer *msg = &nats_message_buffer[pos];
-        if (msg->subject && strcmp(msg->subject, subject) == 0) {
-            found_at = pos;
+    for (pm = &ns->listeners; *pm != NULL; pm = &((*pm)->natsnext)) {
+        if (*pm == m) {
+            *pm = m->natsnext;
             break;
         }
-        pos = (pos + 1) % NATS_MESSAGE_BUFFER_SIZE;
-        checked++;
     }
-
-    if (found_at < 0) {
-        return 0;  // No matching message
+    m->natsnext = NULL;
+    if (ns->listeners != NULL)
+        return;
+    while ((msg = ns->head) != NULL) {
+        ns->head = msg->next;
+        freenatsmsg(msg);
+        Natspending--;
     }
+    ns->tail = NULL;
+    ns->count = 0;
+    natsrmsubject(ns);
+}
 
-    // Copy message data to buffer
-    struct nats_msg_buffer *msg = &nats_message_buffer[found_at];
-    int data_len = strlen(msg->data);
-    int copy_len = (data_len < buffer_size - 1) ? data_len : (buffer_size - 1);
-    memcpy(buffer, msg->data, copy_len);
-    buffer[copy_len] = '\0';
-
-    // Free the message
-    free(msg->subject);
-    free(msg->data);
-    msg->subject = NULL;
-    msg->data = NULL;
+// NATS callback - called from JavaScript when message arrives
+// Keep this minimal to avoid ASYNCIFY issues
+EMSCRIPTEN_KEEPALIVE
+void mdep_on_nats_message(const char *subject, const char *data)
+{
+    struct natssubj *ns;
+    struct natsmsg *msg;
+    Myport *m;
+    int len;
 
-    // Compact buffer by moving later messages forward if needed
-    if (found_at == nats_message_read_pos) {
-        // Message at front - just advance read position
-        nats_message_read_pos = (nats_message_read_pos + 1) % NATS_MESSAGE_BUFFER_SIZE;
-    } else {
-        // Message in middle - shift remaining messages
-        int curr = found_at;
-        while (curr != nats_message_write_pos) {
-            int next = (curr + 1) % NATS_MESSAGE_BUFFER_SIZE;
-            nats_message_buffer[curr] = nats_message_buffer[next];
-            curr = next;
-        }
-        // Adjust write position
-        nats_message_write_pos = (nats_message_write_pos - 1 + NATS_MESSAGE_BUFFER_SIZE) % NATS_MESSAGE_BUFFER_SIZE;
+    // JS subscribes to everything under keykit., so this sees
+    // subjects that nobody here is listening to.
+    ns = natsfindsubject(subject);
+    if (ns == NULL || ns->listeners == NULL)
+        return;
+    if (Natspending >= NATS_MAXPENDING || ns->count >= NATS_MAXPERSUBJ) {
+        if ((Natsdropped++ % 1000) == 0)
+            printf("[NATS C] WARNING: Message buffer full, dropping messages (%ld so far)\n",
+                   Natsdropped);
+        return;
     }
+    len = strlen(data);
+    if ((msg = newnatsmsg(len)) == NULL)
+        return;
+    memcpy(msg->data, data, len);
+    if (ns->tail == NULL)
+        ns->head = msg;
+    else
+        ns->tail->next = msg;
+    ns->tail = msg;
+    ns->count++;
+    Natspending++;
 
-    nats_message_count--;
+    // Queue the ports listening on this subject
+    for (m = ns->listeners; m != NULL; m = m->natsnext)
+        portready(m);
+}
 
-    printf("[NATS C] Retrieved message from buffer for subject '%s' (remaining: %d)\n",
-           subject, nats_message_count);
+// Check if NATS messages are available for a specific subject
+static int nats_has_message_for_subject(int sid)
+{
+    return Natssubjs[sid]->count > 0;
+}
+
+// Get next NATS message for a specific subject
+static int nats_get_message_for_subject(int sid, char *buffer, int buffer_size)
+{
+    struct natssubj *ns = Natssubjs[sid];
+    struct natsmsg *msg;
+    int copy_len;
+
+    if ((msg = ns->head) == NULL)
+        return 0;  // No matching message
+    if ((ns->head = msg->next) == NULL)
+        ns->tail = NULL;
+    ns->count--;
+    Natspending--;
 
+    // Copy message data to buffer
+    copy_len = (msg->len < buffer_size - 1) ? msg->len : (buffer_size - 1);
+    memcpy(buffer, msg->data, copy_len);
+    buffer[copy_len] = '\0';
+    freenatsmsg(msg);
     return copy_len;
 }
 
@@ -2246,50 +2419,118 @@ static Myport *newmyport(char *name)
     m->hasreturnedfinaldata = 0;
     m->buff = NULL;
     m->buffsize = 0;
+    m->buffalloc = 0;
+    m->maxpending = SOCKAWAY_MAX;
     m->nats_subject = NULL;
+    m->nats_sid = -1;
+    m->natsnext = NULL;
+    m->isready = 0;
+    m->readynext = NULL;
+    m->idnext = NULL;
 
     // Add to list
     m->next = Topport;
     Topport = m;
+    hashportid(m);
 
     return m;
 }
 
-// Buffer data when socket not ready
-static void sockaway(Myport *m, char *buff, int size)
+static void hashportid(Myport *m)
 {
-    if (m->buff == NULL) {
-        m->buff = (char *)malloc(size);
-        if (m->buff) {
-            m->buffsize = size;
-            memcpy(m->buff, buff, size);
-        }
-    } else {
-        char *newbuff = (char *)malloc(size + m->buffsize);
-        if (newbuff) {
-            memcpy(newbuff, m->buff, m->buffsize);
-            memcpy(newbuff + m->buffsize, buff, size);
-            free(m->buff);
-            m->buff = newbuff;
-            m->buffsize += size;
+    int b = m->portId % PORTIDHASH;
+
+    m->idnext = Portids[b];
+    Portids[b] = m;
+}
+
+static void unhashportid(Myport *m)
+{
+    Myport **pm;
+
+    for (pm = &Portids[m->portId % PORTIDHASH]; *pm != NULL; pm = &((*pm)->idnext)) {
+        if (*pm == m) {
+            *pm = m->idnext;
+            break;
         }
     }
+    m->idnext = NULL;
 }
 
-// Send buffered data when socket connects
+// Queue a port for mdep_getportdata()
+static void portready(Myport *m)
+{
+    if (m->isready)
+        return;
+    m->isready = 1;
+    m->readynext = NULL;
+    if (Lastreadyport == NULL)
+        Readyport = m;
+    else
+        Lastreadyport->readynext = m;
+    Lastreadyport = m;
+}
+
+static void portunready(Myport *m)
+{
+    Myport *prev, *curr;
+
+    if (!m->isready)
+        return;
+    for (prev = NULL, curr = Readyport; curr != NULL; prev = curr, curr = curr->readynext) {
+        if (curr == m)
+            break;
+    }
+    if (curr == NULL)
+        return;
+    if (prev == NULL)
+        Readyport = m->readynext;
+    else
+        prev->readynext = m->readynext;
+    if (Lastreadyport == m)
+        Lastreadyport = prev;
+    m->readynext = NULL;
+    m->isready = 0;
+}
+
+// Buffer data when socket not ready.  The buffer grows geometrically,
+// so a burst of small put()s isn't quadratic.  Returns -1 (and drops
+// the data) if that would put more than maxpending bytes in it.
+static int sockaway(Myport *m, char *buff, int size)
+{
+    char *newbuff;
+    int newalloc;
+
+    if (m->buffsize + size > m->maxpending)
+        return -1;
+    if (m->buffsize + size > m->buffalloc) {
+        newalloc = m->buffalloc ? m->buffalloc : SOCKAWAY_INIT;
+        while (newalloc < m->buffsize + size)
+            newalloc *= 2;
+        newbuff = (char *)realloc(m->buff, newalloc);
+        if (newbuff == NULL)
+            return -1;
+        m->buff = newbuff;
+        m->buffalloc = newalloc;
+    }
+    memcpy(m->buff + m->buffsize, buff, size);
+    m->buffsize += size;
+    return 0;
+}
+
+// Send buffered data when socket connects, all in one message
 static void sendsockedaway(Myport *mp)
 {
-    if (mp->sockstate != SOCK_CONNECTED) {
+    if (mp->sockstate != SOCK_CONNECTED || mp->buffsize == 0) {
         return;
     }
-    if (mp->buff != NULL) {
-        char *p = mp->buff;
-        int sz = mp->buffsize;
-        mp->buff = NULL;
-        mp->buffsize = 0;
-        js_websocket_send(mp->portId, p, sz);
-        free(p);
+    if (js_websocket_send(mp->portId, mp->buff, mp->buffsize) < 0) {
+        return;  // try again on the next put()
     }
+    free(mp->buff);
+    mp->buff = NULL;
+    mp->buffsize = 0;
+    mp->buffalloc = 0;
 }
 
 // WebSocket event callback from JavaScript
@@ -2298,21 +2539,27 @@ void mdep_on_websocket_event(int portId, const char *event)
 {
     printf("[PORT C] WebSocket event on port %d: %s\n", portId, event);
 
-    // Find the port
+    // Both halves of a tcpip_connect share the same portId
     Myport *m;
-    for (m = Topport; m != NULL; m = m->next) {
-        if (m->portId == portId) {
-            if (strcmp(event, "open") == 0) {
-                m->sockstate = SOCK_CONNECTED;
-                sendsockedaway(m);  // Send any buffered data
-            } else if (strcmp(event, "data") == 0) {
+    for (m = Portids[portId % PORTIDHASH]; m != NULL; m = m->idnext) {
+        if (m->portId != portId)
+            continue;
+        if (strcmp(event, "open") == 0) {
+            m->sockstate = SOCK_CONNECTED;
+            sendsockedaway(m);  // Send any buffered data
+        } else if (strcmp(event, "data") == 0) {
+            if (m->rw != TYPE_WRITE) {
                 m->portstate = PORT_CANREAD;
-            } else if (strcmp(event, "close") == 0) {
-                m->sockstate = SOCK_CLOSED;
-            } else if (strcmp(event, "error") == 0) {
-                m->sockstate = SOCK_REFUSED;
+                portready(m);
             }
-            break;
+        } else if (strcmp(event, "close") == 0) {
+            m->sockstate = SOCK_CLOSED;
+            if (m->rw == TYPE_READ)
+                portready(m);
+        } else if (strcmp(event, "error") == 0) {
+            m->sockstate = SOCK_REFUSED;
+            if (m->rw == TYPE_READ)
+                portready(m);
         }
     }
 }
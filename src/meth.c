@@ -25,10 +25,9 @@ void
 setelement(Kobjectp o,Symstr e,Datum d)
 {
 	Symbolp sym;
-	if ( o->symbols == NULL )
-		execerror("Internal error, o->symbols==NULL in setelement!");
-	sym = syminstall(e,o->symbols,VAR);
+	sym = objinstall(o,e);
 	*symdataptr(sym) = d;
+	strgcbarrier(d);
 }
 
 void
@@ -36,9 +35,7 @@ setmethod(Kobjectp o,char *m,BLTINCODE i)
 {
 	Symbolp sym;
 	Symstr meth = uniqstr(m);
-	if ( o->symbols == NULL )
-		execerror("Internal error, o->symbols==NULL in setelement!");
-	sym = syminstall(meth,o->symbols,VAR);
+	sym = objinstall(o,meth);
 	*symdataptr(sym) = funcdp(sym,i);
 }
 
@@ -47,10 +44,9 @@ setdata(Kobjectp o,char *m,Datum d)
 {
 	Symbolp sym;
 	Symstr meth = uniqstr(m);
-	if ( o->symbols == NULL )
-		execerror("Internal error, o->symbols==NULL in setelement!");
-	sym = syminstall(meth,o->symbols,VAR);
+	sym = objinstall(o,meth);
 	*symdataptr(sym) = d;
+	strgcbarrier(d);
 }
 
 Kobjectp
@@ -186,6 +182,10 @@ o_addinherit(int argc)
 			execerror("Unexpected o==NULL in .inherit!?");
 		o->nextinherit = o2;
 	}
+	/* new elements of either can now change lookups, see objinstall() */
+	o1->oflags |= KOBJ_INHERIT;
+	o2->oflags |= KOBJ_INHERIT;
+	Objversion++;
 	ret(Nullval);
 }
 
@@ -209,9 +209,7 @@ windid(Kobjectp o)
 	Datum d;
 	Symbolp s;
 
-	if ( o->symbols == NULL )
-		execerror("Internal error, o->symbols==NULL in windid!");
-	s = findsym(Str_w.u.str,o->symbols);
+	s = objfindsym(o,Str_w.u.str);
 	if ( s == NULL )
 		execerror("In windid(), couldn't find .w element of window object!?");
 	d = (*symdataptr(s));
@@ -976,9 +974,7 @@ windobject(long id,int complain,char *type)
 	if ( w != Wroot )
 		k_setsize(w,0,0,0,0);
 
-	if ( o->symbols == NULL )
-		execerror("Internal error, o->symbols==NULL in windobject!");
-	s = syminstall(Str_w.u.str,o->symbols,VAR);
+	s = objinstall(o,Str_w.u.str);
 	(*symdataptr(s)) = winddatum(w);
 
 	/* general window methods */
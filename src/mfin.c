@@ -4,6 +4,21 @@
 
 /*
  * Read a Standard MIDI File.
+ *
+ * The whole file is read into Mfbuff, the MTrk chunks are located,
+ * and then each track is decoded on its own by mfdecode().  All of
+ * the decoding state lives in an Mfdecoder and an Mftrack, and the
+ * decoder only makes its own (private) notes, so tracks can be
+ * decoded at the same time.  If MFTHREADS is defined, they're decoded
+ * on a small pool of threads; otherwise (e.g. in WASM) they're done
+ * one at a time.  The decoded notes are turned into real notes and
+ * phrases by mfhandoff(), on the interpreter's thread, in track order.
+ *
+ * A file can also be opened with mfopen(), which keeps it in memory
+ * and only decodes the tracks and time ranges that mfquery() asks
+ * for.  The first query of a track records checkpoints (the decoder's
+ * state every so often) so that later queries can start near the
+ * range they want.  Results are kept in a per-handle LRU cache.
  */
 
 #include <ctype.h>
@@ -11,67 +26,595 @@
 #include "keymidi.h"
 #include "mf.h"
 
+#ifdef MFTHREADS
+#include <pthread.h>
+#endif
+
 int Mf_nomerge = 0;		/* 1 => continue'ed system exclusives are */
 				/* not collapsed. */
-long Mf_currtime = 0L;		/* current time in delta-time units */
 int Mf_skipinit = 1;		/* 1 if initial garbage should be skipped */
 
 #define finished(n) durof(n)=0
 
-static FILE *Mf;
-static long Mf_toberead = 0L;
+#define MFBUFFKEEP 65536	/* a bigger Mfbuff isn't kept around */
+#define MFREADSIZE 32768
+#define MFBLOCKSIZE 65536	/* size of the blocks decoded notes go in */
+#define PENDONCHUNK 256
+#define MSGINCREMENT 128
+#define MFCHECKEVENTS 2048	/* events between checkpoints */
+#define MFCACHEMAX (4L*1024L*1024L)	/* default cache size of a handle */
+
+#ifdef MFTHREADS
+#ifndef MFWORKERS
+#define MFWORKERS 4
+#endif
+#define MFBATCH 64		/* tracks located and decoded at a time */
+#else
+#define MFBATCH 1
+#endif
+
+/* Memory for the notes and messages of a decoded track */
+typedef struct Mfblock {
+	struct Mfblock *next;
+	long used;
+	long size;
+	double align;
+} Mfblock;
+
+/* A note made by the decoder.  Text meta-events are kept as strings, */
+/* and are only turned into notes by mfhandoff(). */
+typedef struct Mfnote {
+	Notedata nt;
+	char *text;
+} Mfnote;
+
+/* A warning that's printed when the track is handed off */
+typedef struct Mfwarn {
+	struct Mfwarn *next;
+	int tp;			/* 1 => tprint it, else warning() */
+	char s[4];
+} Mfwarn;
+
+/*
+ * Pending note-ons are kept in a table indexed by channel and pitch,
+ * so that a note-off finds its note-on without scanning the queue.
+ * Each list is in the same order as the note-ons are in the queue.
+ */
+typedef struct Pendon {
+	Noteptr note;
+	struct Pendon *next;
+} Pendon;
+
+typedef struct Pendchunk {
+	struct Pendchunk *next;
+	Pendon p[PENDONCHUNK];
+} Pendchunk;
+
+/* A note-on that's still pending at a checkpoint */
+typedef struct Mfpend {
+	long clicks;
+	long dur;
+	Unchar chan;
+	Unchar pitch;
+	Unchar vol;
+} Mfpend;
+
+/* The decoder's state at the start of an event in a track */
+typedef struct Mfcheck {
+	long clicks;
+	Unchar *p;
+	long toberead;
+	long currtime;
+	int status;
+	int qhint;
+	int npend;
+	Mfpend *pend;
+} Mfcheck;
+
+/* A track of an opened file */
+typedef struct Mfindex {
+	Unchar *p;		/* start of the chunk's data */
+	long leng;		/* length of the chunk's data */
+	int indexed;		/* 1 once the checkpoints have been made */
+	long clicks;		/* length of the track */
+	Mfcheck *checks;
+	int nchecks;
+	int checksalloc;
+} Mfindex;
+
+/* A cached result of mfquery() */
+typedef struct Mfcached {
+	int track;
+	long start;
+	long end;
+	int onoffmerge;
+	int defrelease;
+	int defport;
+	long size;
+	Phrasep ph;
+	struct Mfcached *prev;
+	struct Mfcached *next;
+} Mfcached;
+
+/* A file opened by mfopen() */
+typedef struct Mfhandle {
+	int id;
+	Unchar *buff;
+	long size;
+	int format;
+	double clickfactor;
+	int ntracks;
+	Mfindex *tracks;
+	Mfcached *first;	/* most recently used */
+	Mfcached *last;
+	long cachesize;
+	long cachemax;
+	struct Mfhandle *next;
+} Mfhandle;
+
+struct Mfdecoder;
+
+/* One MTrk chunk, and what's been decoded from it */
+typedef struct Mftrack {
+	Unchar *p;		/* next byte to read */
+	Unchar *end;		/* end of the file */
+	long toberead;
+	long currtime;		/* current time in delta-time units */
+	int status;		/* running status to start with */
+	long next;		/* offset where the next chunk should be */
+	int windowed;		/* 1 => only keep notes in winstart-winend */
+	long winstart;
+	long winend;
+	int stopearly;		/* 1 => stop once winend is reached */
+	int inwin;		/* pending note-ons inside the window */
+	Mfcheck *from;		/* checkpoint to start at, or NULL */
+	Mfindex *index;		/* where to record checkpoints, or NULL */
+	Phrase out;		/* notes, in the order they were finished */
+	long leng;		/* length of the track in clicks */
+	Mfblock *mem;
+	Mfwarn *warn;
+	Mfwarn *lastwarn;
+	char *err;		/* error that stopped the decoding */
+	struct Mfdecoder *d;	/* NULL unless it's being decoded */
+} Mftrack;
+
+typedef struct Mfdecoder {
+	Mftrack *t;
+	Phrase noteq;		/* notes that aren't finished yet */
+	int numq;
+	Noteptr qgroup;		/* last note in noteq before the latest time */
+	int qhint;		/* 0 once the track has gone back in time */
+	Pendon *pendhead[16][128];
+	Pendon *pendtail[16][128];
+	Pendon *freepend;
+	Pendchunk *pendchunks;
+	Unchar *msgbuff;	/* message buffer */
+	int msgalloc;		/* Size of currently allocated msgbuff */
+	int msgindex;		/* index of next available location */
+	double clickfactor;
+	int onoffmerge;
+	int defrelease;
+	int warnnegative;
+	int defport;
+	jmp_buf begin;
+} Mfdecoder;
+
+static Unchar *Mfbuff = NULL;
+static long Mfbuffsize = 0;
+static long Mfsize = 0;		/* bytes of the file in Mfbuff */
 static int Tracknum;
-static Phrasep Noteq;
-static Phrasep Currph;
-static int Numq = 0;
 static double Clickfactor = 1.0;
 static Htablep Mfarr;
 static int Mformat;
+static Mfdecoder Mfdec;		/* used on the interpreter's thread */
+static Mftrack Mftracks[MFBATCH];
+static Mfhandle *Mfhandles = NULL;
+static int Mfhandleid = 0;
 
 static void
-mferror(char *s)
+mferror(Mftrack *t,char *s)
 {
+	if ( t->d != NULL ) {
+		t->err = s;
+		longjmp(t->d->begin,1);
+	}
 	execerror(s);
 }
 
+static char *
+mfalloc(Mftrack *t,long size)
+{
+	Mfblock *b = t->mem;
+	char *p;
+
+	size = (size+7) & ~7L;
+	if ( b == NULL || b->used + size > b->size ) {
+		long bsize = (size > MFBLOCKSIZE) ? size : MFBLOCKSIZE;
+		b = (Mfblock *) kmalloc((unsigned)(sizeof(Mfblock)+bsize),"mfalloc");
+		b->used = 0;
+		b->size = bsize;
+		b->next = t->mem;
+		t->mem = b;
+	}
+	p = (char *)(b+1) + b->used;
+	b->used += size;
+	return p;
+}
+
 static void
-mfwarning(char *s)
+mffreemem(Mftrack *t)
 {
-	warning(s);
+	Mfblock *b, *nxt;
+
+	for ( b=t->mem; b!=NULL; b=nxt ) {
+		nxt = b->next;
+		kfree(b);
+	}
+	t->mem = NULL;
+	t->warn = t->lastwarn = NULL;
+	setfirstnote(&(t->out)) = lastnote(&(t->out)) = NULL;
 }
 
-int
-mgetc(void)
+static void
+mfaddwarn(Mftrack *t,int tp,char *s)
+{
+	Mfwarn *w = (Mfwarn *) mfalloc(t,(long)(sizeof(Mfwarn)+strlen(s)));
+
+	strcpy(w->s,s);
+	w->tp = tp;
+	w->next = NULL;
+	if ( t->lastwarn == NULL )
+		t->warn = w;
+	else
+		t->lastwarn->next = w;
+	t->lastwarn = w;
+}
+
+static void
+mfwarning(Mftrack *t,char *s)
+{
+	if ( t->d != NULL )
+		mfaddwarn(t,0,s);
+	else
+		warning(s);
+}
+
+static int
+mgetc(Mftrack *t)
+{
+	if ( t->p >= t->end )
+		return EOF;
+	return *(t->p)++;
+}
+
+/* read the whole of f into Mfbuff */
+static void
+mfslurp(FILE *f)
+{
+	size_t r;
+
+	Mfsize = 0;
+	for ( ;; ) {
+		makeroom(Mfsize+MFREADSIZE,(char **)&Mfbuff,&Mfbuffsize);
+		r = fread(Mfbuff+Mfsize,1,(size_t)(Mfbuffsize-Mfsize),f);
+		if ( r == 0 )
+			break;
+		Mfsize += (long)r;
+	}
+}
+
+static void
+mfrelease(void)
+{
+	int n;
+
+	for ( n=0; n<MFBATCH; n++ )
+		mffreemem(&Mftracks[n]);
+	Mfsize = 0;
+	if ( Mfbuffsize > MFBUFFKEEP ) {
+		kfree(Mfbuff);
+		Mfbuff = NULL;
+		Mfbuffsize = 0;
+	}
+}
+
+static Pendon *
+newpendon(Mfdecoder *d)
+{
+	Pendon *pd;
+
+	if ( d->freepend == NULL ) {
+		Pendchunk *pc;
+		int n;
+		pc = (Pendchunk *) kmalloc(sizeof(Pendchunk),"newpendon");
+		pc->next = d->pendchunks;
+		d->pendchunks = pc;
+		for ( n=0; n<PENDONCHUNK; n++ ) {
+			pc->p[n].next = d->freepend;
+			d->freepend = &(pc->p[n]);
+		}
+	}
+	pd = d->freepend;
+	d->freepend = pd->next;
+	return pd;
+}
+
+/* add an NT_ON note (which has just been put into noteq) to the table */
+static void
+pendadd(Mfdecoder *d,Noteptr n)
+{
+	int chan = chanof(n);
+	int pitch = pitchof(n) & 0x7f;
+	Pendon *pd = newpendon(d);
+	Pendon *p, *prev;
+
+	pd->note = n;
+	p = d->pendtail[chan][pitch];
+	if ( p == NULL || ntcmporder(p->note,n) <= 0 ) {
+		/* the usual case, it goes at the end */
+		pd->next = NULL;
+		if ( p == NULL )
+			d->pendhead[chan][pitch] = pd;
+		else
+			p->next = pd;
+		d->pendtail[chan][pitch] = pd;
+		return;
+	}
+	/* keep the same order that ntinsert() gave it in noteq */
+	prev = NULL;
+	for ( p=d->pendhead[chan][pitch]; p!=NULL && ntcmporder(p->note,n)<=0; p=p->next )
+		prev = p;
+	pd->next = p;
+	if ( prev == NULL )
+		d->pendhead[chan][pitch] = pd;
+	else
+		prev->next = pd;
+}
+
+/* remove note n (usually the first one) from the table */
+static void
+pendremove(Mfdecoder *d,Noteptr n)
+{
+	int chan = chanof(n);
+	int pitch = pitchof(n) & 0x7f;
+	Pendon *pd, *prev = NULL;
+
+	for ( pd=d->pendhead[chan][pitch]; pd!=NULL; pd=pd->next ) {
+		if ( pd->note == n )
+			break;
+		prev = pd;
+	}
+	if ( pd == NULL )
+		return;
+	if ( prev == NULL )
+		d->pendhead[chan][pitch] = pd->next;
+	else
+		prev->next = pd->next;
+	if ( pd->next == NULL )
+		d->pendtail[chan][pitch] = prev;
+	pd->next = d->freepend;
+	d->freepend = pd;
+}
+
+static void
+pendclear(Mfdecoder *d)
+{
+	int chan, pitch;
+
+	for ( chan=0; chan<16; chan++ ) {
+		for ( pitch=0; pitch<128; pitch++ ) {
+			while ( d->pendhead[chan][pitch] != NULL )
+				pendremove(d,d->pendhead[chan][pitch]->note);
+		}
+	}
+}
+
+static void
+initdecoder(Mfdecoder *d)
+{
+	int chan, pitch;
+
+	for ( chan=0; chan<16; chan++ ) {
+		for ( pitch=0; pitch<128; pitch++ ) {
+			d->pendhead[chan][pitch] = NULL;
+			d->pendtail[chan][pitch] = NULL;
+		}
+	}
+	d->freepend = NULL;
+	d->pendchunks = NULL;
+	d->msgbuff = NULL;
+	d->msgalloc = 0;
+	d->msgindex = 0;
+	d->t = NULL;
+}
+
+#ifdef MFTHREADS
+static Mfdecoder *
+newdecoder(void)
+{
+	Mfdecoder *d = (Mfdecoder *) kmalloc(sizeof(Mfdecoder),"newdecoder");
+
+	initdecoder(d);
+	d->clickfactor = Mfdec.clickfactor;
+	d->onoffmerge = Mfdec.onoffmerge;
+	d->defrelease = Mfdec.defrelease;
+	d->warnnegative = Mfdec.warnnegative;
+	d->defport = Mfdec.defport;
+	return d;
+}
+
+static void
+freedecoder(Mfdecoder *d)
+{
+	Pendchunk *pc, *nxt;
+
+	for ( pc=d->pendchunks; pc!=NULL; pc=nxt ) {
+		nxt = pc->next;
+		kfree(pc);
+	}
+	kfree(d->msgbuff);
+	kfree(d);
+}
+#endif
+
+/* a new (private) note in the current track */
+static Noteptr
+mfnewnt(Mfdecoder *d)
+{
+	Mfnote *m = (Mfnote *) mfalloc(d->t,(long)sizeof(Mfnote));
+	Noteptr n = &(m->nt);
+
+	m->text = NULL;
+	n->next = NULL;
+#ifdef NTATTRIB
+	n->attrib = Nullstr;
+#endif
+	n->flags = 0;
+	return n;
+}
+
+static Midimessp
+mfsavemess(Mfdecoder *d,Unchar *mess,int leng)
+{
+	Midimessp m;
+
+	m = (Midimessp) mfalloc(d->t,(long)sizeof(Midimessdata));
+	m->leng = leng;
+	m->bytes = (Unchar *) mfalloc(d->t,(long)leng);
+	memcpy(m->bytes,mess,(size_t)leng);
+	return(m);
+}
+
+/* Put n into noteq, in the same place ntinsert() would.  Times in */
+/* a track don't go backwards, so only the notes at the latest time */
+/* (the ones after qgroup) need to be looked at. */
+static void
+noteqadd(Mfdecoder *d,Noteptr n)
+{
+	Phrasep q = &(d->noteq);
+	Noteptr last = lastnote(q);
+	Noteptr p, prev;
+
+	if ( last == NULL || ntcmporder(n,last) >= 0 ) {
+		if ( last == NULL || timeof(last) < timeof(n) )
+			d->qgroup = last;
+		n->next = NULL;
+		if ( last == NULL )
+			setfirstnote(q) = n;
+		else
+			last->next = n;
+		lastnote(q) = n;
+		return;
+	}
+	if ( d->qhint == 0 ) {
+		ntinsert(n,q);
+		return;
+	}
+	prev = d->qgroup;
+	p = (prev==NULL) ? firstnote(q) : prev->next;
+	for ( ; p!=NULL && ntcmporder(p,n)<=0; p=p->next )
+		prev = p;
+	/* p can't be NULL, since n goes before the last note */
+	n->next = p;
+	if ( prev == NULL )
+		setfirstnote(q) = n;
+	else
+		prev->next = n;
+}
+
+/* Append n to the track's notes.  Out-of-order notes get sorted */
+/* when the phrase is made, in mfhandoff(). */
+static void
+curradd(Mfdecoder *d,Noteptr n)
+{
+	Phrasep out = &(d->t->out);
+	Noteptr last = lastnote(out);
+
+	if ( d->t->windowed && (timeof(n) < d->t->winstart
+			|| timeof(n) >= d->t->winend) )
+		return;
+	n->next = NULL;
+	if ( last == NULL )
+		setfirstnote(out) = n;
+	else
+		last->next = n;
+	lastnote(out) = n;
+}
+
+/* stable merge sort of the notes in p, using ntcmporder */
+static void
+mfsortph(Phrasep p)
 {
-	return getc(Mf);
+	Noteptr list = firstnote(p);
+	Noteptr a, b, t, tail, head;
+	long width, na, nb;
+	int merges;
+
+	if ( list == NULL )
+		return;
+	for ( width=1; ; width*=2 ) {
+		a = list;
+		head = tail = NULL;
+		merges = 0;
+		while ( a != NULL ) {
+			merges++;
+			b = a;
+			for ( na=0; na<width && b!=NULL; na++ )
+				b = b->next;
+			nb = width;
+			while ( na > 0 || (nb > 0 && b != NULL) ) {
+				if ( na == 0 ) {
+					t = b; b = b->next; nb--;
+				}
+				else if ( nb == 0 || b == NULL || ntcmporder(a,b) <= 0 ) {
+					t = a; a = a->next; na--;
+				}
+				else {
+					t = b; b = b->next; nb--;
+				}
+				if ( tail == NULL )
+					head = t;
+				else
+					tail->next = t;
+				tail = t;
+			}
+			a = b;
+		}
+		tail->next = NULL;
+		list = head;
+		if ( merges <= 1 )
+			break;
+	}
+	setfirstnote(p) = list;
+	lastnote(p) = tail;
 }
 
 /* read a single character and abort on EOF */
 static int
-egetc(void)
+egetc(Mftrack *t)
 {
-	int c = mgetc();
+	int c = mgetc(t);
 
 	if ( c == EOF )
-		mferror("premature EOF");
-	Mf_toberead--;
+		mferror(t,"premature EOF");
+	t->toberead--;
 	return(c);
 }
 
 /* readvarinum - read a varying-length number */
 
 static long
-readvarinum(void)
+readvarinum(Mftrack *t)
 {
 	long value;
 	int c;
 
-	c = egetc();
+	c = egetc(t);
 	value = c;
 	if ( c & 0x80 ) {
 		value &= 0x7f;
 		do {
-			c = egetc();
+			c = egetc(t);
 			value = (value << 7) + (c & 0x7f);
 		} while (c & 0x80);
 	}
@@ -97,62 +640,57 @@ to16bit(int c1,int c2)
 }
 
 static long
-read32bit(void)
+read32bit(Mftrack *t)
 {
 	int c1, c2, c3, c4;
 
-	c1 = egetc();
-	c2 = egetc();
-	c3 = egetc();
-	c4 = egetc();
+	c1 = egetc(t);
+	c2 = egetc(t);
+	c3 = egetc(t);
+	c4 = egetc(t);
 	return to32bit(c1,c2,c3,c4);
 }
 
 static int
-read16bit(void)
+read16bit(Mftrack *t)
 {
 	int c1, c2;
-	c1 = egetc();
-	c2 = egetc();
+	c1 = egetc(t);
+	c2 = egetc(t);
 	return to16bit(c1,c2);
 }
 
 /* The code below allows collection of a system exclusive message of */
-/* arbitrary length.  The Msg1buff is expanded as necessary.  The only */
+/* arbitrary length.  The msgbuff is expanded as necessary.  The only */
 /* visible data/routines are msginit(), msgadd(), msg(), msgleng(). */
 
-#define MSGINCREMENT 128
-static Unchar *Msg1buff = NULL;	/* message buffer */
-static int Msg1alloc = 0;		/* Size of currently allocated Msg1 */
-static int Msg1index = 0;	/* index of next available location in Msg1 */
-
 static void
-msginit(void)
+msginit(Mfdecoder *d)
 {
-	Msg1index = 0;
+	d->msgindex = 0;
 }
 
 static Unchar *
-msg(void)
+msg(Mfdecoder *d)
 {
-	return(Msg1buff);
+	return(d->msgbuff);
 }
 
 static int
-msgleng(void)
+msgleng(Mfdecoder *d)
 {
-	return(Msg1index);
+	return(d->msgindex);
 }
 
 static void
-msgenlarge(void)
+msgenlarge(Mfdecoder *d)
 {
 	Unchar *newmess;
-	Unchar *oldmess = Msg1buff;
-	int oldleng = Msg1alloc;
+	Unchar *oldmess = d->msgbuff;
+	int oldleng = d->msgalloc;
 
-	Msg1alloc += MSGINCREMENT;
-	newmess = (Unchar *) kmalloc( (unsigned)(sizeof(char)*Msg1alloc),"msgenlarge");
+	d->msgalloc += MSGINCREMENT;
+	newmess = (Unchar *) kmalloc( (unsigned)(sizeof(char)*d->msgalloc),"msgenlarge");
 
 	/* copy old message into larger new one */
 	if ( oldmess != NULL ) {
@@ -164,22 +702,22 @@ msgenlarge(void)
 			*p = *q;
 		kfree(oldmess);
 	}
-	Msg1buff = newmess;
+	d->msgbuff = newmess;
 }
 
 static void
-msgadd(int c)
+msgadd(Mfdecoder *d,int c)
 {
 	/* If necessary, allocate larger message buffer. */
-	if ( Msg1index >= Msg1alloc )
-		msgenlarge();
-	Msg1buff[Msg1index++] = c;
+	if ( d->msgindex >= d->msgalloc )
+		msgenlarge(d);
+	d->msgbuff[d->msgindex++] = c;
 }
 
 /* read through the "MThd" or "MTrk" header string */
 /* if skip is 1, we attempt to skip initial garbage. */
 static int
-readmt(char *s,int skip)
+readmt(Mftrack *t,char *s,int skip)
 {
 	int nread = 0;
 	char b[4];
@@ -189,11 +727,11 @@ readmt(char *s,int skip)
 
     retry:
 	while ( nread<4 ) {
-		c = mgetc();
+		c = mgetc(t);
 		if ( c == EOF ) {
 			strcpy(buff,"EOF while expecting ");
 			strcat(buff,s);
-			mfwarning(buff);
+			mfwarning(t,buff);
 			return(EOF);
 		}
 		b[nread++] = c;
@@ -212,41 +750,51 @@ readmt(char *s,int skip)
 	}
 	strcpy(buff,errmsg);
 	strcat(buff,s);
-	mferror(buff);
+	mferror(t,buff);
 	return(0);
 }
 
+static void k_header(int f,int n,int d);
+
 /* read a header chunk */
 static int
-readheader(void)
+readheader(Mftrack *t)
 {
 	int format, ntrks, division;
 
-	if ( readmt("MThd",Mf_skipinit) == EOF )
+	if ( readmt(t,"MThd",Mf_skipinit) == EOF )
 		return(0);
 
-	Mf_toberead = read32bit();
-	format = read16bit();
-	ntrks = read16bit();
-	division = read16bit();
+	t->toberead = read32bit(t);
+	format = read16bit(t);
+	ntrks = read16bit(t);
+	division = read16bit(t);
 
 	k_header(format,ntrks,division);
 
 	/* flush any extra stuff, in case the length of header is not 6 */
-	while ( Mf_toberead > 0 )
-		(void) egetc();
+	while ( t->toberead > 0 )
+		(void) egetc(t);
 	return(ntrks);
 }
 
+static void k_seqnum(Mfdecoder *d,int n);
+static void k_metatext(Mfdecoder *d,int type,int leng,Unchar *mess);
+static void k_chanprefix(Mfdecoder *d,unsigned c);
+static void k_tempo(Mfdecoder *d,long tempo);
+static void k_smpte(Mfdecoder *d,unsigned hr,unsigned mn,unsigned se,unsigned fr,unsigned ff);
+static void k_timesig(Mfdecoder *d,unsigned nn,unsigned dd,unsigned cc,unsigned bb);
+static void k_keysig(Mfdecoder *d,unsigned sf,unsigned mi);
+
 static void
-metaevent(int type)
+metaevent(Mfdecoder *d,int type)
 {
-	int leng = msgleng();
-	Unchar *m = msg();
+	int leng = msgleng(d);
+	Unchar *m = msg(d);
 
 	switch  ( type ) {
 	case 0x00:
-		k_seqnum(to16bit((int)(m[0]),(int)(m[1])));
+		k_seqnum(d,to16bit((int)(m[0]),(int)(m[1])));
 		break;
 	case 0x01:	/* Text event */
 	case 0x02:	/* Copyright notice */
@@ -264,26 +812,26 @@ metaevent(int type)
 	case 0x0e:
 	case 0x0f:
 		/* These are all text events */
-		k_metatext(type,leng,m);
+		k_metatext(d,type,leng,m);
 		break;
 	case 0x20:	/* Channel prefix */
 	case 0x21:	/* Supposedly some people mistakenly used 0x21 ? */
-		k_chanprefix(m[0]);
+		k_chanprefix(d,m[0]);
 		break;
 	case 0x2f:	/* End of Track */
 		/* k_eot(); */
 		break;
 	case 0x51:	/* Set tempo */
-		k_tempo(to32bit(0,(int)m[0],(int)m[1],(int)m[2]));
+		k_tempo(d,to32bit(0,(int)m[0],(int)m[1],(int)m[2]));
 		break;
 	case 0x54:
-		k_smpte(m[0],m[1],m[2],m[3],m[4]);
+		k_smpte(d,m[0],m[1],m[2],m[3],m[4]);
 		break;
 	case 0x58:
-		k_timesig(m[0],m[1],m[2],m[3]);
+		k_timesig(d,m[0],m[1],m[2],m[3]);
 		break;
 	case 0x59:
-		k_keysig(m[0],m[1]);
+		k_keysig(d,m[0],m[1]);
 		break;
 	case 0x7f:
 		/* k_sqspecific(leng,m); */
@@ -294,45 +842,53 @@ metaevent(int type)
 	}
 }
 
+static void k_noteoff(Mfdecoder *d,int chan,int pitch,int vol);
+static void k_noteon(Mfdecoder *d,int chan,int pitch,int vol);
+static void k_pressure(Mfdecoder *d,int chan,int pitch,int press);
+static void k_controller(Mfdecoder *d,int chan,int control,int value);
+static void k_pitchbend(Mfdecoder *d,int chan,int msb,int lsb);
+static void k_program(Mfdecoder *d,int chan,int program);
+static void k_chanpressure(Mfdecoder *d,int chan,int press);
+
 static void
-chanmessage(int status,int c1,int c2)
+chanmessage(Mfdecoder *d,int status,int c1,int c2)
 {
 	int chan = status & 0xf;
 
 	switch ( status & 0xf0 ) {
 	case NOTEOFF:
-		k_noteoff(chan,c1,c2);
+		k_noteoff(d,chan,c1,c2);
 		break;
 	case NOTEON:
-		k_noteon(chan,c1,c2);
+		k_noteon(d,chan,c1,c2);
 		break;
 	case PRESSURE:
-		k_pressure(chan,c1,c2);
+		k_pressure(d,chan,c1,c2);
 		break;
 	case CONTROLLER:
-		k_controller(chan,c1,c2);
+		k_controller(d,chan,c1,c2);
 		break;
 	case PITCHBEND:
-		k_pitchbend(chan,c1,c2);
+		k_pitchbend(d,chan,c1,c2);
 		break;
 	case PROGRAM:
-		k_program(chan,c1);
+		k_program(d,chan,c1);
 		break;
 	case CHANPRESSURE:
-		k_chanpressure(chan,c1);
+		k_chanpressure(d,chan,c1);
 		break;
 	}
 }
 
 static long
-mfclicks(void)
+mfclicks(Mfdecoder *d)
 {
-	double clks = (double)Mf_currtime/Clickfactor;
+	double clks = (double)(d->t->currtime)/d->clickfactor;
 	return((long)(clks+0.5)); /* round it */
 }
 
 /*ARGSUSED*/
-void
+static void
 k_header(int f,int n,int d)
 {
 	Mformat = f;
@@ -356,112 +912,129 @@ k_header(int f,int n,int d)
 
 }
 
-void
-k_starttrack(void)
+#define inwindow(t,n) ((t)->windowed && timeof(n) >= (t)->winstart \
+			&& timeof(n) < (t)->winend)
+
+/* called just before a note-on leaves the pending table, after */
+/* which nothing later in the track can change it */
+static void
+unpend(Mfdecoder *d,Noteptr n)
 {
-	Symbolp se;
-	Datum d, *dp;
+	if ( typeof(n) == NT_ON && inwindow(d->t,n) )
+		d->t->inwin--;
+}
 
-	d = numdatum((long)(Tracknum++));
-	se = arraysym(Mfarr,d,H_INSERT);
-	clearsym(se);
-	dp = symdataptr(se);
-	*dp = phrdatum(newph(1));
-	Currph = dp->u.phr;
+static void
+k_starttrack(Mfdecoder *d)
+{
+	setfirstnote(&(d->noteq)) = lastnote(&(d->noteq)) = NULL;
+	d->numq = 0;
+	d->qgroup = NULL;
+	d->qhint = 1;
 }
 
-/* output the top Noteq and remove it from the list */
-void
-putnfree(void)
+/* output the top noteq and remove it from the list */
+static void
+putnfree(Mfdecoder *d)
 {
-	Noteptr n = firstnote(Noteq);
+	Phrasep q = &(d->noteq);
+	Noteptr n = firstnote(q);
 	Noteptr nxt = nextnote(n);
 
-	setfirstnote(Noteq) = nxt; 	/* remove from list */
-	if ( n == lastnote(Noteq) )
-		lastnote(Noteq) = nxt;
+	setfirstnote(q) = nxt; 	/* remove from list */
+	if ( n == lastnote(q) )
+		lastnote(q) = nxt;
+	if ( n == d->qgroup )
+		d->qgroup = NULL;
 
+	if ( typeof(n) == NT_ON ) {
+		unpend(d,n);
+		pendremove(d,n);
+	}
 	if ( durof(n) == UNFINISHED_DURATION )
-		durof(n) = mfclicks() - timeof(n);
-
-	ntinsert(n,Currph);
-	/* DO NOT call ntfree(), since we've given the note away to Currph */
-	Numq--;
-}
+		durof(n) = mfclicks(d) - timeof(n);
 
-void
-putallnotes(void)
-{
-	while ( firstnote(Noteq) != NULL )
-		putnfree();
-	lastnote(Noteq) = NULL;
-	Currph->p_leng = mfclicks();
+	curradd(d,n);
+	d->numq--;
 }
 
-void
-k_endtrack(void)
+static void
+putallnotes(Mfdecoder *d)
 {
-	putallnotes();
+	while ( firstnote(&(d->noteq)) != NULL )
+		putnfree(d);
+	lastnote(&(d->noteq)) = NULL;
+	pendclear(d);
+	d->t->leng = mfclicks(d);
 }
 
-void
-k_noteon(int chan,int pitch,int vol)
+static void
+k_endtrack(Mfdecoder *d)
 {
-	if ( vol == 0 ) {
-		k_noteoff(chan,pitch,(int)(*Defrelease));
-		return;
-	}
-	(void) queuenote(chan,pitch,vol,NT_ON);
+	putallnotes(d);
 }
 
-Noteptr
-queuenote(int chan,int pitch,int vol,int type)
+static Noteptr
+queuenote(Mfdecoder *d,int chan,int pitch,int vol,int type)
 {
-	Noteptr n = newnt();
+	Noteptr n = mfnewnt(d);
 	typeof(n) = type;
-	timeof(n) = mfclicks();
+	timeof(n) = mfclicks(d);
 	setchanof(n) = chan;
 	pitchof(n) = pitch;
 	volof(n) = vol;
 	durof(n) = UNFINISHED_DURATION;
-	portof(n) = Defport;
+	portof(n) = d->defport;
 	nextnote(n) = NULL;
-	ntinsert(n,Noteq);
-	Numq++;
+	noteqadd(d,n);
+	d->numq++;
+	if ( type == NT_ON ) {
+		pendadd(d,n);
+		if ( inwindow(d->t,n) )
+			d->t->inwin++;
+	}
 	return n;
 }
 
-void
-k_noteoff(int chan,int pitch,int vol)
+static void
+k_noteon(Mfdecoder *d,int chan,int pitch,int vol)
+{
+	if ( vol == 0 ) {
+		k_noteoff(d,chan,pitch,d->defrelease);
+		return;
+	}
+	(void) queuenote(d,chan,pitch,vol,NT_ON);
+}
+
+static void
+k_noteoff(Mfdecoder *d,int chan,int pitch,int vol)
 {
 	Noteptr n;
+	Pendon *pd;
 
 	/* find the first note-on (if any) that matches this one */
-	for ( n=firstnote(Noteq); n!=NULL; n=nextnote(n) ) {
-		if ( chanof(n)==chan
-			&& (int)pitchof(n)==pitch
-			&& typeof(n)==NT_ON ) {
-			break;
-		}
-	}
+	pd = d->pendhead[chan&0xf][pitch&0x7f];
+	n = (pd==NULL) ? NULL : pd->note;
 	if ( n == NULL ) {
 		/* it's an isolated note-off */
-		n = queuenote(chan,pitch,vol,NT_OFF);
+		n = queuenote(d,chan,pitch,vol,NT_OFF);
 		finished(n);
 	}
-	else if ( *Onoffmerge == 0 && vol != (int)(*Defrelease) ) {
+	else if ( d->onoffmerge == 0 && vol != d->defrelease ) {
 		/* If the note-off matches a previous note-on, but has a */
 		/* non-default velocity, then we have to turn it into a */
 		/* separate keykit note-off, instead of merging it with */
 		/* the note-on into a single note. */
-		Noteptr o = queuenote(chan,pitch,vol,NT_OFF);
+		Noteptr o = queuenote(d,chan,pitch,vol,NT_OFF);
 		finished(o);
 		finished(n);
 	}
 	else {
 		/* A completed note. */
+		unpend(d,n);
+		pendremove(d,n);
 		typeof(n) = NT_NOTE;
-		durof(n) = mfclicks() - timeof(n);
+		durof(n) = mfclicks(d) - timeof(n);
 
 		/* If the MIDI File contains negative delta times (which */
 		/* probably aren't legal!) the duration turns out to be */
@@ -477,124 +1050,129 @@ k_noteoff(int chan,int pitch,int vol)
 	/* times of the notes are in the proper (ie. monotonically */
 	/* progressing) order. */
 
-	while ( (n=firstnote(Noteq)) != NULL ) {
+	while ( (n=firstnote(&(d->noteq))) != NULL ) {
 		/* quit when we get to the first unfinished note */
 		if ( typeof(n)!=NT_BYTES && durof(n) == UNFINISHED_DURATION )
 			break;
-		putnfree();
+		putnfree(d);
 	}
-	/* If the number of notes int Noteq gets too big, then we're */
+	/* If the number of notes int noteq gets too big, then we're */
 	/* probably suffering from a note-on that never had a note-off.*/
 	/* Force it out. */
-	if ( Numq > 1024 )
-		putnfree();
+	if ( d->numq > 1024 )
+		putnfree(d);
 
 }
 
-void
-k_pressure(int chan,int pitch,int press)
+static void
+queuemess(Mfdecoder *d,Unchar *mess,int leng)
 {
-	threebytes(PRESSURE | chan,pitch,press);
+	Noteptr n = mfnewnt(d);
+	timeof(n) = mfclicks(d);
+	typeof(n) = NT_BYTES;
+	messof(n) = mfsavemess(d,mess,leng);
+	portof(n) = d->defport;
+	nextnote(n) = NULL;
+	noteqadd(d,n);
+	d->numq++;
 }
 
-void
-k_controller(int chan,int control,int value)
+static void
+threebytes(Mfdecoder *d,int c1,int c2,int c3)
 {
-	threebytes(CONTROLLER | chan,control,value);
+	Unchar bytes[3];
+
+	bytes[0] = c1;
+	bytes[1] = c2;
+	bytes[2] = c3;
+	queuemess(d,bytes,3);
 }
 
-void
-k_pitchbend(int chan,int msb,int lsb)
+static void
+twobytes(Mfdecoder *d,int c1,int c2)
 {
-	threebytes(PITCHBEND | chan,msb,lsb);
+	Unchar bytes[2];
+
+	bytes[0] = c1;
+	bytes[1] = c2;
+	queuemess(d,bytes,2);
 }
 
-void
-k_program(int chan,int program)
+static void
+k_pressure(Mfdecoder *d,int chan,int pitch,int press)
 {
-	twobytes(PROGRAM | chan,program);
+	threebytes(d,PRESSURE | chan,pitch,press);
 }
 
-void
-k_chanpressure(int chan,int press)
+static void
+k_controller(Mfdecoder *d,int chan,int control,int value)
 {
-	twobytes(CHANPRESSURE | chan,press);
+	threebytes(d,CONTROLLER | chan,control,value);
 }
 
-void
-threebytes(int c1,int c2,int c3)
+static void
+k_pitchbend(Mfdecoder *d,int chan,int msb,int lsb)
 {
-	Unchar bytes[3];
-	Noteptr n = newnt();
-	timeof(n) = mfclicks();
-	typeof(n) = NT_BYTES;
-	bytes[0] = c1;
-	bytes[1] = c2;
-	bytes[2] = c3;
-	messof(n) = savemess(bytes,3);
-	portof(n) = Defport;
-	nextnote(n) = NULL;
-	ntinsert(n,Noteq);
-	Numq++;
+	threebytes(d,PITCHBEND | chan,msb,lsb);
 }
 
-void
-twobytes(int c1,int c2)
+static void
+k_program(Mfdecoder *d,int chan,int program)
 {
-	Unchar bytes[2];
-	Noteptr n = newnt();
-	timeof(n) = mfclicks();
-	typeof(n) = NT_BYTES;
-	bytes[0] = c1;
-	bytes[1] = c2;
-	messof(n) = savemess(bytes,2);
-	portof(n) = Defport;
-	nextnote(n) = NULL;
-	ntinsert(n,Noteq);
-	Numq++;
+	twobytes(d,PROGRAM | chan,program);
 }
 
-void
-queuemess(Unchar *mess,int leng)
+static void
+k_chanpressure(Mfdecoder *d,int chan,int press)
 {
-	Noteptr n = newnt();
-	timeof(n) = mfclicks();
-	typeof(n) = NT_BYTES;
-	messof(n) = savemess(mess,leng);
-	portof(n) = Defport;
-	nextnote(n) = NULL;
-	ntinsert(n,Noteq);
-	Numq++;
+	twobytes(d,CHANPRESSURE | chan,press);
 }
 
 static void
-k_sysex(int leng,Unchar *mess)
+k_sysex(Mfdecoder *d,int leng,Unchar *mess)
 {
-	queuemess(mess,leng);
+	queuemess(d,mess,leng);
 }
 
 static void
-sysex(void)
+sysex(Mfdecoder *d)
 {
-	k_sysex(msgleng(),msg());
+	k_sysex(d,msgleng(d),msg(d));
 }
 
-void
-k_arbitrary(int leng,Unchar *mess)
+static void
+k_arbitrary(Mfdecoder *d,int leng,Unchar *mess)
 {
-	queuemess(mess,leng);
+	queuemess(d,mess,leng);
 }
 
-void
-k_tempo(long tempo)
+/* A text meta-event; it's turned into a note by strtotextmess(), */
+/* in mfhandoff(). */
+static void
+textmess(Mfdecoder *d,char *s)
+{
+	Mfnote *m;
+	Noteptr n = mfnewnt(d);
+
+	timeof(n) = mfclicks(d);
+	typeof(n) = NT_BYTES;
+	messof(n) = NULL;
+	m = (Mfnote *)n;
+	m->text = mfalloc(d->t,(long)strlen(s)+1);
+	strcpy(m->text,s);
+	curradd(d,n);
+}
+
+static void
+k_tempo(Mfdecoder *d,long tempo)
 {
 	char s[100];
-	sprintf(s,"\"Tempo=%ld\"t%ld",tempo,mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(s,"\"Tempo=%ld\"t%ld",tempo,mfclicks(d));
+	textmess(d,s);
 }
 
-void
-k_timesig(unsigned nn,unsigned dd,unsigned cc,unsigned bb)
+static void
+k_timesig(Mfdecoder *d,unsigned nn,unsigned dd,unsigned cc,unsigned bb)
 {
 	char s[100];
 	int denom = 1;
@@ -603,44 +1181,44 @@ k_timesig(unsigned nn,unsigned dd,unsigned cc,unsigned bb)
 		denom *= 2;
 	/* First 2 numbers are time signature, next is MIDI-clocks-per-click, */
 	/* and the last is 32nd-notes-per-24-MIDI-clocks. */
-	sprintf(s,"\"Timesig=%d/%d,%d,%d\"t%ld", nn,denom,cc,bb,mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(s,"\"Timesig=%d/%d,%d,%d\"t%ld", nn,denom,cc,bb,mfclicks(d));
+	textmess(d,s);
 }
 
-void
-k_keysig(unsigned sf,unsigned mi)
+static void
+k_keysig(Mfdecoder *d,unsigned sf,unsigned mi)
 {
 	char s[100];
-	sprintf(s,"\"Keysig=%d,%d\"t%ld",sf,mi,mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(s,"\"Keysig=%d,%d\"t%ld",sf,mi,mfclicks(d));
+	textmess(d,s);
 }
 
-void
-k_chanprefix(unsigned c)
+static void
+k_chanprefix(Mfdecoder *d,unsigned c)
 {
 	char s[100];
-	sprintf(s,"\"Channelprefix=%d\"t%ld",c,mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(s,"\"Channelprefix=%d\"t%ld",c,mfclicks(d));
+	textmess(d,s);
 }
 
-void
-k_seqnum(int n)
+static void
+k_seqnum(Mfdecoder *d,int n)
 {
 	char s[100];
-	sprintf(s,"\"Sequence=%d\"t%ld",n,mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(s,"\"Sequence=%d\"t%ld",n,mfclicks(d));
+	textmess(d,s);
 }
 
-void
-k_smpte(unsigned hr,unsigned mn,unsigned se,unsigned fr,unsigned ff)
+static void
+k_smpte(Mfdecoder *d,unsigned hr,unsigned mn,unsigned se,unsigned fr,unsigned ff)
 {
 	char s[100];
-	sprintf(s,"\n\"Smpte=%d,%d,%d,%d,%d\"t%ld",hr,mn,se,fr,ff,mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(s,"\n\"Smpte=%d,%d,%d,%d,%d\"t%ld",hr,mn,se,fr,ff,mfclicks(d));
+	textmess(d,s);
 }
 
-void
-k_metatext(int type,int leng,Unchar *mess)
+static void
+k_metatext(Mfdecoder *d,int type,int leng,Unchar *mess)
 {
 	static char *ttype[] = {
 		NULL,
@@ -669,14 +1247,96 @@ k_metatext(int type,int leng,Unchar *mess)
 		sprintf(es, (isprint(c)||isspace(c)) ? "%c" : "\\0x%02x" , c);
 		es += strlen(es);
 	}
-	sprintf(es,"\"t%ld",mfclicks());
-	ntinsert(strtotextmess(s),Currph);
+	sprintf(es,"\"t%ld",mfclicks(d));
+	textmess(d,s);
 	kfree(s);
 }
 
-/* read a track chunk */
+/* Record a checkpoint in t->index.  That's only possible when the */
+/* noteq holds nothing but pending note-ons, since those are all that */
+/* mfrestore() can rebuild; returns 0 if it's not possible yet. */
 static int
-readtrack(void)
+mfcheckpoint(Mfdecoder *d,int status)
+{
+	Mftrack *t = d->t;
+	Mfindex *ix = t->index;
+	Mfcheck *c;
+	Mfpend *mp;
+	Noteptr n;
+
+	for ( n=firstnote(&(d->noteq)); n!=NULL; n=nextnote(n) ) {
+		if ( typeof(n) != NT_ON )
+			return 0;
+	}
+	if ( ix->nchecks >= ix->checksalloc ) {
+		Mfcheck *nc;
+		int nalloc = (ix->checksalloc==0) ? 16 : ix->checksalloc*2;
+		nc = (Mfcheck *) kmalloc((unsigned)(nalloc*sizeof(Mfcheck)),"mfcheckpoint");
+		if ( ix->checks != NULL ) {
+			memcpy(nc,ix->checks,ix->nchecks*sizeof(Mfcheck));
+			kfree(ix->checks);
+		}
+		ix->checks = nc;
+		ix->checksalloc = nalloc;
+	}
+	c = &(ix->checks[ix->nchecks++]);
+	c->clicks = mfclicks(d);
+	c->p = t->p;
+	c->toberead = t->toberead;
+	c->currtime = t->currtime;
+	c->status = status;
+	c->qhint = d->qhint;
+	c->npend = d->numq;
+	c->pend = NULL;
+	if ( d->numq == 0 )
+		return 1;
+	/* saved in noteq order, which is also the pending table's order */
+	c->pend = mp = (Mfpend *) kmalloc((unsigned)(d->numq*sizeof(Mfpend)),"mfcheckpoint");
+	for ( n=firstnote(&(d->noteq)); n!=NULL; n=nextnote(n) ) {
+		mp->clicks = timeof(n);
+		mp->dur = durof(n);
+		mp->chan = chanof(n);
+		mp->pitch = pitchof(n);
+		mp->vol = volof(n);
+		mp++;
+	}
+	return 1;
+}
+
+/* Start decoding at checkpoint c.  The noteq held nothing but */
+/* the pending note-ons there, so rebuilding them is enough. */
+static void
+mfrestore(Mfdecoder *d,Mfcheck *c)
+{
+	Mftrack *t = d->t;
+	Noteptr n;
+	int k;
+
+	t->p = c->p;
+	t->toberead = c->toberead;
+	t->currtime = c->currtime;
+	t->status = c->status;
+	d->qhint = 0;
+	for ( k=0; k<c->npend; k++ ) {
+		n = mfnewnt(d);
+		typeof(n) = NT_ON;
+		timeof(n) = c->pend[k].clicks;
+		setchanof(n) = c->pend[k].chan;
+		pitchof(n) = c->pend[k].pitch;
+		volof(n) = c->pend[k].vol;
+		durof(n) = c->pend[k].dur;
+		portof(n) = d->defport;
+		noteqadd(d,n);
+		d->numq++;
+		pendadd(d,n);
+	}
+	d->qhint = c->qhint;
+	d->qgroup = NULL;
+}
+
+/* decode the body of a track chunk */
+static void
+readtrack(Mfdecoder *d)
 {
 	/* This array is indexed by the high half of a status byte.  It's */
 	/* value is either the number of bytes needed (1 or 2) for a channel */
@@ -685,37 +1345,54 @@ readtrack(void)
 		0, 0, 0, 0, 0, 0, 0, 0,		/* 0x00 through 0x70 */
 		2, 2, 2, 2, 1, 1, 2, 0		/* 0x80 through 0xf0 */
 	};
+	Mftrack *t = d->t;
 	long lookfor, lng;
 	int c, c1, type;
 	int sysexcontinue = 0;	/* 1 if last message was an unfinished sysex */
 	int running = 0;	/* 1 when running status used */
-	int status = 0;		/* (possibly running) status byte */
+	int status;		/* (possibly running) status byte */
 	int needed;
+	int nevents = 0;
 
-	if ( readmt("MTrk",0) == EOF )
-		return EOF;
+	k_starttrack(d);
 
-	Mf_toberead = read32bit();
-	Mf_currtime = 0;
+	if ( t->from != NULL )
+		mfrestore(d,t->from);
+	else {
+		t->currtime = 0;
+		t->status = 0;
+	}
+	status = t->status;
 
-	k_starttrack();
+	while ( t->toberead > 0 ) {
 
-	while ( Mf_toberead > 0 ) {
+		if ( t->index != NULL && ++nevents >= MFCHECKEVENTS
+				&& sysexcontinue == 0 && d->qhint != 0 ) {
+			if ( mfcheckpoint(d,status) )
+				nevents = 0;
+		}
+		if ( t->stopearly && t->inwin == 0 && d->qhint != 0
+				&& mfclicks(d) >= t->winend )
+			break;
 
-		long dt = readvarinum();	/* delta time */
-		if ( dt < 0 && (*Warnnegative != 0) ) {
-			tprint("Warning: negative delta time (%ld) in MIDI file!\n",dt);
+		long dt = readvarinum(t);	/* delta time */
+		if ( dt < 0 && d->warnnegative != 0 ) {
+			char buff[80];
+			sprintf(buff,"Warning: negative delta time (%ld) in MIDI file!\n",dt);
+			mfaddwarn(t,1,buff);
 		}
-		Mf_currtime += dt;
+		t->currtime += dt;
+		if ( dt < 0 )
+			d->qhint = 0;
 
-		c = egetc();
+		c = egetc(t);
 
 		if ( sysexcontinue && c != 0xf7 )
-			mfwarning("didn't find expected continuation of a sysex");
+			mfwarning(t,"didn't find expected continuation of a sysex");
 
 		if ( (c & 0x80) == 0 ) {	 /* running status? */
 			if ( status == 0 )
-				mfwarning("unexpected running status");
+				mfwarning(t,"unexpected running status");
 			running = 1;
 		}
 		else {
@@ -730,14 +1407,14 @@ readtrack(void)
 			if ( running )
 				c1 = c;
 			else
-				c1 = egetc() & 0x7f;
+				c1 = egetc(t) & 0x7f;
 
 			/* The &0xf7 here may seem unnecessary, but I've seen */
 			/* 'bad' midi files that had, e.g., volume bytes */
 			/* with the upper bit set.  This code should not harm */
 			/* proper data. */
 
-			chanmessage( status, c1, (needed>1) ? (egetc()&0x7f) : 0 );
+			chanmessage(d, status, c1, (needed>1) ? (egetc(t)&0x7f) : 0 );
 			continue;
 		}
 
@@ -745,31 +1422,31 @@ readtrack(void)
 
 		case 0xff:			/* meta event */
 
-			type = egetc();
+			type = egetc(t);
 			/* watch out - Don't combine the next 2 statements */
-			lng = readvarinum();
-			lookfor = Mf_toberead - lng;
-			msginit();
+			lng = readvarinum(t);
+			lookfor = t->toberead - lng;
+			msginit(d);
 
-			while ( Mf_toberead > lookfor )
-				msgadd(egetc());
+			while ( t->toberead > lookfor )
+				msgadd(d,egetc(t));
 
-			metaevent(type);
+			metaevent(d,type);
 			break;
 
 		case 0xf0:		/* start of system exclusive */
 
 			/* watch out - Don't combine the next 2 statements */
-			lng = readvarinum();
-			lookfor = Mf_toberead - lng;
-			msginit();
-			msgadd(0xf0);
+			lng = readvarinum(t);
+			lookfor = t->toberead - lng;
+			msginit(d);
+			msgadd(d,0xf0);
 
-			while ( Mf_toberead > lookfor )
-				msgadd(c=egetc());
+			while ( t->toberead > lookfor )
+				msgadd(d,c=egetc(t));
 
 			if ( c==0xf7 || Mf_nomerge==0 )
-				sysex();
+				sysex(d);
 			else
 				sysexcontinue = 1;  /* merge into next msg */
 			break;
@@ -777,20 +1454,20 @@ readtrack(void)
 		case 0xf7:	/* sysex continuation or arbitrary stuff */
 
 			/* watch out - Don't combine the next 2 statements */
-			lng = readvarinum();
-			lookfor = Mf_toberead - lng;
+			lng = readvarinum(t);
+			lookfor = t->toberead - lng;
 
 			if ( ! sysexcontinue )
-				msginit();
+				msginit(d);
 
-			while ( Mf_toberead > lookfor )
-				msgadd(c=egetc());
+			while ( t->toberead > lookfor )
+				msgadd(d,c=egetc(t));
 
 			if ( ! sysexcontinue ) {
-				k_arbitrary(msgleng(),msg());
+				k_arbitrary(d,msgleng(d),msg(d));
 			}
 			else if ( c == 0xf7 ) {
-				sysex();
+				sysex(d);
 				sysexcontinue = 0;
 			}
 			break;
@@ -798,45 +1475,573 @@ readtrack(void)
 			{
 			char buff[32];
 			sprintf(buff,"unexpected byte: 0x%02x",c);
-			mfwarning(buff);
+			mfwarning(t,buff);
 			}
 			break;
 		}
 	}
-	k_endtrack();
-	return 0;
+	k_endtrack(d);
 }
 
-int
-mftoarr(char *mfname,Htablep arr)
+/* Decode track t with decoder d.  This doesn't touch anything */
+/* outside of d and t, so it can be done on any thread. */
+static void
+mfdecode(Mfdecoder *d,Mftrack *t)
 {
-	int ntrks;
+	d->t = t;
+	t->d = d;
+	if ( setjmp(d->begin) == 0 )
+		readtrack(d);
+	else {
+		/* t->err is set.  The notes that were finished are */
+		/* kept, the unfinished ones are dropped. */
+		setfirstnote(&(d->noteq)) = lastnote(&(d->noteq)) = NULL;
+		pendclear(d);
+	}
+	t->d = NULL;
+	d->t = NULL;
+}
 
-	Mfarr = arr;
+/* Locate up to max track chunks, starting at p.  Returns the number */
+/* found; anything odd is left for readmt() to complain about. */
+static int
+mflocate(Unchar *p,int max)
+{
+	Unchar *end = Mfbuff + Mfsize;
+	Mftrack *t;
+	long leng;
+	int n;
+
+	for ( n=0; n<max; n++ ) {
+		if ( end - p < 8 || memcmp(p,"MTrk",4) != 0 )
+			break;
+		leng = to32bit(p[4],p[5],p[6],p[7]);
+		t = &Mftracks[n];
+		mffreemem(t);
+		t->p = p + 8;
+		t->end = end;
+		t->toberead = leng;
+		t->leng = 0;
+		t->err = NULL;
+		t->d = NULL;
+		t->windowed = 0;
+		t->stopearly = 0;
+		t->from = NULL;
+		t->index = NULL;
+		if ( leng > (end - p) - 8 ) {
+			/* it'll get a premature EOF */
+			t->next = Mfsize;
+			n++;
+			break;
+		}
+		p += 8 + leng;
+		t->next = p - Mfbuff;
+	}
+	return n;
+}
+
+#ifdef MFTHREADS
+static pthread_mutex_t Mfworklock = PTHREAD_MUTEX_INITIALIZER;
+static int Mfworkn;
+static int Mfworknext;
+
+static void *
+mfworker(void *arg)
+{
+	Mfdecoder *d = (Mfdecoder *)arg;
+	int n;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&Mfworklock);
+		n = Mfworknext++;
+		pthread_mutex_unlock(&Mfworklock);
+		if ( n >= Mfworkn )
+			break;
+		mfdecode(d,&Mftracks[n]);
+	}
+	return NULL;
+}
+#endif
+
+/* decode the first n tracks in Mftracks */
+static void
+mfdecodeall(int n)
+{
+	int k;
+#ifdef MFTHREADS
+	pthread_t tid[MFWORKERS];
+	Mfdecoder *dec[MFWORKERS];
+	int nw;
+
+	if ( n > 1 ) {
+		Mfworkn = n;
+		Mfworknext = 0;
+		nw = (n < MFWORKERS) ? n : MFWORKERS;
+		/* This thread is one of the workers, using Mfdec. */
+		for ( k=1; k<nw; k++ ) {
+			dec[k] = newdecoder();
+			if ( pthread_create(&tid[k],NULL,mfworker,dec[k]) != 0 ) {
+				freedecoder(dec[k]);
+				break;
+			}
+		}
+		nw = k;
+		(void) mfworker(&Mfdec);
+		for ( k=1; k<nw; k++ ) {
+			pthread_join(tid[k],NULL);
+			freedecoder(dec[k]);
+		}
+		return;
+	}
+#endif
+	for ( k=0; k<n; k++ )
+		mfdecode(&Mfdec,&Mftracks[k]);
+}
+
+static void
+mfwarnings(Mftrack *t)
+{
+	Mfwarn *w;
+
+	for ( w=t->warn; w!=NULL; w=w->next ) {
+		if ( w->tp )
+			tprint("%s",w->s);
+		else
+			warning(w->s);
+	}
+}
+
+/* Turn the notes decoded for t into real notes in ph. */
+static void
+mfmakeph(Mftrack *t,Phrasep ph)
+{
+	Noteptr pn, n, last = NULL;
+	int sorted = 1;
+
+	for ( pn=firstnote(&(t->out)); pn!=NULL; pn=pn->next ) {
+		if ( ((Mfnote *)pn)->text != NULL )
+			n = strtotextmess(((Mfnote *)pn)->text);
+		else {
+			n = newnt();
+			*n = *pn;
+			if ( typeof(n) == NT_BYTES )
+				messof(n) = savemess(messof(pn)->bytes,messof(pn)->leng);
+		}
+		n->next = NULL;
+		if ( last == NULL )
+			setfirstnote(ph) = n;
+		else {
+			if ( sorted && ntcmporder(last,n) > 0 )
+				sorted = 0;
+			last->next = n;
+		}
+		last = n;
+	}
+	lastnote(ph) = last;
+	/* Sorting once gives the same result as doing an ntinsert() */
+	/* of each note. */
+	if ( ! sorted )
+		mfsortph(ph);
+}
+
+/* Turn the notes decoded for t into a phrase in Mfarr. */
+static void
+mfhandoff(Mftrack *t)
+{
+	Symbolp se;
+	Datum d, *dp;
+	Phrasep ph;
+
+	d = numdatum((long)(Tracknum++));
+	se = arraysym(Mfarr,d,H_INSERT);
+	clearsym(se);
+	dp = symdataptr(se);
+	*dp = phrdatum(newph(1));
+	ph = dp->u.phr;
+
+	mfwarnings(t);
+	mfmakeph(t,ph);
+	if ( t->err != NULL ) {
+		char *err = t->err;
+		mffreemem(t);
+		mferror(t,err);
+	}
+	ph->p_leng = t->leng;
+	mffreemem(t);
+}
+
+static void
+mfsetdecoder(double clickfactor)
+{
+	static int initdone = 0;
+
+	if ( ! initdone ) {
+		initdecoder(&Mfdec);
+		initdone = 1;
+	}
+	pendclear(&Mfdec);
+	Mfdec.clickfactor = clickfactor;
+	Mfdec.onoffmerge = (int)(*Onoffmerge);
+	Mfdec.defrelease = (int)(*Defrelease);
+	Mfdec.warnnegative = (int)(*Warnnegative);
+	Mfdec.defport = Defport;
+}
+
+/* read the file (or stdin, if it's "-") into Mfbuff */
+static void
+mfreadfile(char *mfname)
+{
+	FILE *f;
 
 	if ( strcmp(mfname,"-") != 0 ) {
 		if ( *mfname == '\0' )
 			execerror("Invalid (null) filename given to midifile");
-		OPENBINFILE(Mf,mfname,"r");
-		if ( Mf == NULL )
+		OPENBINFILE(f,mfname,"r");
+		if ( f == NULL )
 			execerror("Can't open midifile for reading - %s (%s)",
 				mfname,strerror(errno));
 	}
 	else
-		Mf = stdin;
+		f = stdin;
 
-	Noteq = newph(0);
+	mfrelease();
+	mfslurp(f);
+	if ( f != stdin )
+		myfclose(f);
+}
 
-	ntrks = readheader();
+int
+mftoarr(char *mfname,Htablep arr)
+{
+	Mftrack hdr;
+	Unchar *p;
+	int ntrks, n, k;
+
+	Mfarr = arr;
+
+	mfreadfile(mfname);
+
+	hdr.p = Mfbuff;
+	hdr.end = Mfbuff + Mfsize;
+	hdr.d = NULL;
+	ntrks = readheader(&hdr);
 	if ( ntrks <= 0 )
-		mfwarning("No tracks!");
-	while ( ntrks-- > 0 ) {
-		if ( readtrack() == EOF )
+		mfwarning(&hdr,"No tracks!");
+
+	mfsetdecoder(Clickfactor);
+
+	p = hdr.p;
+	while ( ntrks > 0 ) {
+		n = mflocate(p,(ntrks<MFBATCH)?ntrks:MFBATCH);
+		if ( n == 0 ) {
+			/* Something other than a track; this gives */
+			/* the same warning or error it always has. */
+			hdr.p = p;
+			if ( readmt(&hdr,"MTrk",0) != EOF )
+				(void) read32bit(&hdr);
 			break;
+		}
+		mfdecodeall(n);
+		for ( k=0; k<n; k++ ) {
+			Mftrack *t = &Mftracks[k];
+			mfhandoff(t);
+			ntrks--;
+			p = t->p;
+			/* If a track ran past the end of its chunk, the */
+			/* chunks after it have to be located again. */
+			if ( (p - Mfbuff) != t->next )
+				break;
+		}
 	}
 
-	if ( Mf != stdin )
-		myfclose(Mf);
-
+	mfrelease();
 	return Mformat;
 }
+
+static Mfhandle *
+mfhandle(int id)
+{
+	Mfhandle *h;
+
+	for ( h=Mfhandles; h!=NULL; h=h->next ) {
+		if ( h->id == id )
+			return h;
+	}
+	execerror("No open midifile with handle %d",id);
+	return NULL;
+}
+
+/* Open a MIDI file for mfquery().  Only the track chunks are located */
+/* here, nothing is decoded.  Returns the handle. */
+int
+mfopen(char *mfname,long cachemax)
+{
+	Mfhandle *h;
+	Mftrack hdr;
+	Unchar *p, *end;
+	long leng;
+	int ntrks, n;
+
+	mfreadfile(mfname);
+
+	hdr.p = Mfbuff;
+	hdr.end = Mfbuff + Mfsize;
+	hdr.d = NULL;
+	ntrks = readheader(&hdr);
+	if ( ntrks <= 0 )
+		mfwarning(&hdr,"No tracks!");
+
+	h = (Mfhandle *) kmalloc(sizeof(Mfhandle),"mfopen");
+	h->id = ++Mfhandleid;
+	h->format = Mformat;
+	h->clickfactor = Clickfactor;
+	h->first = h->last = NULL;
+	h->cachesize = 0;
+	h->cachemax = (cachemax >= 0) ? cachemax : MFCACHEMAX;
+	h->ntracks = 0;
+	h->tracks = NULL;
+	if ( ntrks > 0 )
+		h->tracks = (Mfindex *) kmalloc((unsigned)(ntrks*sizeof(Mfindex)),"mfopen");
+
+	/* locate the tracks */
+	end = Mfbuff + Mfsize;
+	for ( p=hdr.p,n=0; n<ntrks; n++ ) {
+		Mfindex *ix = &(h->tracks[n]);
+		if ( end - p < 8 || memcmp(p,"MTrk",4) != 0 )
+			break;
+		leng = to32bit(p[4],p[5],p[6],p[7]);
+		ix->p = p + 8;
+		ix->leng = leng;
+		ix->indexed = 0;
+		ix->clicks = 0;
+		ix->checks = NULL;
+		ix->nchecks = 0;
+		ix->checksalloc = 0;
+		h->ntracks++;
+		if ( leng > (end - p) - 8 )
+			break;
+		p += 8 + leng;
+	}
+	if ( h->ntracks < ntrks )
+		mfwarning(&hdr,"Some tracks are missing!");
+
+	/* The handle keeps the file's bytes */
+	h->buff = Mfbuff;
+	h->size = Mfsize;
+	Mfbuff = NULL;
+	Mfbuffsize = 0;
+	Mfsize = 0;
+
+	h->next = Mfhandles;
+	Mfhandles = h;
+	return h->id;
+}
+
+int
+mfntracks(int id)
+{
+	return mfhandle(id)->ntracks;
+}
+
+int
+mfformat(int id)
+{
+	return mfhandle(id)->format;
+}
+
+static void
+mfuncache(Mfhandle *h,Mfcached *c)
+{
+	if ( c->prev == NULL )
+		h->first = c->next;
+	else
+		c->prev->next = c->next;
+	if ( c->next == NULL )
+		h->last = c->prev;
+	else
+		c->next->prev = c->prev;
+	h->cachesize -= c->size;
+	phdecruse(c->ph);
+	kfree(c);
+}
+
+static void
+mfcache(Mfhandle *h,int track,long start,long end,Phrasep ph)
+{
+	Mfcached *c;
+	Noteptr n;
+	long size = 0;
+
+	for ( n=firstnote(ph); n!=NULL; n=nextnote(n) ) {
+		size += sizeof(Notedata);
+		if ( typeof(n) == NT_BYTES && messof(n) != NULL )
+			size += sizeof(Midimessdata) + messof(n)->leng;
+	}
+	if ( size > h->cachemax )
+		return;
+	while ( h->last != NULL && h->cachesize + size > h->cachemax )
+		mfuncache(h,h->last);
+
+	c = (Mfcached *) kmalloc(sizeof(Mfcached),"mfcache");
+	c->track = track;
+	c->start = start;
+	c->end = end;
+	c->onoffmerge = Mfdec.onoffmerge;
+	c->defrelease = Mfdec.defrelease;
+	c->defport = Mfdec.defport;
+	c->size = size;
+	c->ph = newph(1);
+	phcopy(c->ph,ph);
+	c->prev = NULL;
+	c->next = h->first;
+	if ( h->first == NULL )
+		h->last = c;
+	else
+		h->first->prev = c;
+	h->first = c;
+	h->cachesize += size;
+}
+
+/* Find the last checkpoint before start.  Everything before it */
+/* is outside the window. */
+static Mfcheck *
+mffindcheck(Mfindex *ix,long start)
+{
+	int lo = 0, hi = ix->nchecks, mid;
+
+	while ( lo < hi ) {
+		mid = (lo + hi) / 2;
+		if ( ix->checks[mid].clicks < start )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo == 0) ? NULL : &(ix->checks[lo-1]);
+}
+
+static void
+mffreechecks(Mfindex *ix)
+{
+	int k;
+
+	for ( k=0; k<ix->nchecks; k++ )
+		kfree(ix->checks[k].pend);
+	kfree(ix->checks);
+	ix->checks = NULL;
+	ix->nchecks = 0;
+	ix->checksalloc = 0;
+	ix->indexed = 0;
+}
+
+/* Return a phrase with the notes of the given track that start at */
+/* or after start, and before end. */
+Phrasep
+mfquery(int id,int track,long start,long end)
+{
+	Mfhandle *h = mfhandle(id);
+	Mfindex *ix;
+	Mfcached *c;
+	Mftrack t;
+	Phrasep ph;
+
+	if ( track < 0 || track >= h->ntracks )
+		execerror("No track %d in midifile handle %d",track,id);
+	ix = &(h->tracks[track]);
+
+	mfsetdecoder(h->clickfactor);
+
+	for ( c=h->first; c!=NULL; c=c->next ) {
+		if ( c->track == track && c->start == start && c->end == end
+			&& c->onoffmerge == Mfdec.onoffmerge
+			&& c->defrelease == Mfdec.defrelease
+			&& c->defport == Mfdec.defport )
+			break;
+	}
+	if ( c != NULL ) {
+		/* move it to the front */
+		if ( c->prev != NULL ) {
+			c->prev->next = c->next;
+			if ( c->next == NULL )
+				h->last = c->prev;
+			else
+				c->next->prev = c->prev;
+			c->prev = NULL;
+			c->next = h->first;
+			h->first->prev = c;
+			h->first = c;
+		}
+		ph = newph(0);
+		phcopy(ph,c->ph);
+		return ph;
+	}
+
+	t.p = ix->p;
+	t.end = h->buff + h->size;
+	t.toberead = ix->leng;
+	t.windowed = 1;
+	t.winstart = start;
+	t.winend = end;
+	t.inwin = 0;
+	t.leng = 0;
+	t.mem = NULL;
+	t.warn = t.lastwarn = NULL;
+	t.err = NULL;
+	t.d = NULL;
+	setfirstnote(&(t.out)) = lastnote(&(t.out)) = NULL;
+	if ( ix->indexed ) {
+		t.from = mffindcheck(ix,start);
+		t.index = NULL;
+		t.stopearly = 1;
+	}
+	else {
+		/* The first time, the whole track is decoded */
+		/* and the checkpoints are recorded. */
+		t.from = NULL;
+		t.index = ix;
+		t.stopearly = 0;
+	}
+
+	mfdecode(&Mfdec,&t);
+	mfwarnings(&t);
+	if ( t.err != NULL ) {
+		if ( t.index != NULL )
+			mffreechecks(ix);
+		mffreemem(&t);
+		execerror(t.err);
+	}
+	if ( t.index != NULL ) {
+		ix->indexed = 1;
+		ix->clicks = t.leng;
+	}
+
+	ph = newph(0);
+	mfmakeph(&t,ph);
+	ph->p_leng = (end < ix->clicks) ? end : ix->clicks;
+	mffreemem(&t);
+
+	mfcache(h,track,start,end,ph);
+	return ph;
+}
+
+void
+mfclose(int id)
+{
+	Mfhandle *h = mfhandle(id);
+	Mfhandle *hp;
+	int n;
+
+	if ( Mfhandles == h )
+		Mfhandles = h->next;
+	else {
+		for ( hp=Mfhandles; hp->next!=h; hp=hp->next )
+			;
+		hp->next = h->next;
+	}
+	while ( h->first != NULL )
+		mfuncache(h,h->first);
+	for ( n=0; n<h->ntracks; n++ )
+		mffreechecks(&(h->tracks[n]));
+	kfree(h->tracks);
+	kfree(h->buff);
+	kfree(h);
+}
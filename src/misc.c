@@ -81,18 +81,17 @@ hexchar(register int c)
 long
 numscan(register char **as)
 {
-	char c = **as;
+	register char *s = *as;
 	long num = 0;
 	int sign = 1;
 
-	if ( c == '-' ) {
+	if ( *s == '-' ) {
 		sign = -1;
-		c = *(++(*as));
-	}
-	while ( c>='0' && c<='9' ) {
-		num = num * 10 + (c-'0');
-		c = *(++(*as));
+		s++;
 	}
+	while ( *s>='0' && *s<='9' )
+		num = num * 10 + (*s++ - '0');
+	*as = s;
 	return(num*sign);
 }
 
@@ -306,6 +305,8 @@ mmdump(void)
 			(long long)(m->ptr),m->size,m->tag,visstr(m->ptr));
 		keyerrfile(buff);
 	}
+	ntstatsprint();
+	reclaimstatsprint();
 }
 #endif
 
@@ -23,9 +23,31 @@ Noteptr Freent = NULL;
 Phrasep Topph = NULL;		/* Phrases in use */
 Phrasep Freeph = NULL;		/* Free list, available for re-use by newph() */
 
-int Numnotes = 0;	/* Total number of notes in use. */
+int Numnotes = 0;	/* Notes in use, or on released chains (see below) */
 int Numalloc = 0;	/* Total number of notes that have been allocated. */
 
+/*
+ * Notes are carved out of ALLOCNT-sized chunks.  Single notes go back
+ * on Freent, but when a whole phrase is released (see phcheck()), its
+ * note list is parked intact on the Ntdead stack.  newnt() takes those
+ * chains apart one note at a time, so releasing a phrase costs the
+ * same however many notes it has (nothing is freed, rewritten or
+ * counted), and a new phrase built from a recycled chain gets its
+ * notes back in the order they were laid out.  Since a released chain
+ * isn't counted, its notes stay in Numnotes until newnt() reuses them;
+ * the statistics count the pending notes when they're asked for.
+ */
+static Noteptr *Ntdead = NULL;	/* stack of released note chains */
+static int Ntdeadn = 0;
+static int Ntdeadsize = 0;
+static Noteptr Ntrecycle = NULL;	/* chain currently being reused */
+static long Ntchunks = 0;	/* number of ALLOCNT-sized chunks */
+static long Ntpeak = 0;		/* high-water mark of Numnotes */
+static long Ntreleases = 0;	/* number of chains released */
+static long Ntrecycled = 0;	/* notes reused from released chains */
+
+static void ntunbytes(Noteptr n);
+
 #ifdef OLDSTUFF
 void
 countnotes(void)
@@ -107,27 +129,39 @@ newnt(void)
 		}
 	}
 
-	/* First check the free list and use those nodes, before using */
-	/* the newly allocated stuff. */
+	/* First check the free list and the released chains, and use */
+	/* those nodes, before using the newly allocated stuff. */
 	if ( Freent != NULL ) {
 		n = Freent;
 		Freent = Freent->next;
 		goto getout;
 	}
+	if ( Ntrecycle == NULL && Ntdeadn > 0 )
+		Ntrecycle = Ntdead[--Ntdeadn];
+	if ( Ntrecycle != NULL ) {
+		n = Ntrecycle;
+		Ntrecycle = Ntrecycle->next;
+		ntunbytes(n);
+		Ntrecycled++;
+		goto recycled;	/* it's still counted in Numnotes */
+	}
 	if ( used == ALLOCNT ) {
 		Numalloc += ALLOCNT;
+		Ntchunks++;
 		used = 0;
 		lastn = (Noteptr) kmalloc(ALLOCNT*sizeof(Notedata),"newnt");
 	}
 	used++;
 	n = lastn++;
     getout:
+	if ( ++Numnotes > Ntpeak )
+		Ntpeak = Numnotes;
+    recycled:
 	n->next = NULL;
 #ifdef NTATTRIB
 	n->attrib = Nullstr;
 #endif
 	n->flags = 0;
-	Numnotes++;
 	return(n);
 }
 
@@ -148,23 +182,30 @@ savemess(Unchar* mess,int leng)
 	return(m);
 }
 
-/*
- * Add a node to the free list
- */
-void
-ntfree(Noteptr n)
+/* Free the message bytes held by an NT_BYTES note */
+static void
+ntunbytes(Noteptr n)
 {
         register Midimessp m;
 
-	if ( n == NULL )
-		return;
-        if ( typeof(n) == NT_BYTES ) {
+        if ( typeof(n) == NT_BYTES && messof(n) != NULL ) {
                 m = messof(n);
                 kfree(m->bytes);
                 kfree(m);
                 /* make sure we can't try to free it again */
                 messof(n) = NULL;
         }
+}
+
+/*
+ * Add a node to the free list
+ */
+void
+ntfree(Noteptr n)
+{
+	if ( n == NULL )
+		return;
+	ntunbytes(n);
         nextnote(n) = Freent;
         Freent = n;
 	Numnotes--;
@@ -216,6 +257,94 @@ freents(Noteptr n)
 	}
 }
 
+/*
+ * ntrelease(n) - give back an entire list of notes in one step.
+ * The list isn't touched here; newnt() recycles it lazily.
+ */
+void
+ntrelease(Noteptr n)
+{
+	Noteptr *newdead;
+
+	if ( n == NULL )
+		return;
+	if ( Ntdeadn >= Ntdeadsize ) {
+		int newsize = (Ntdeadsize==0) ? 64 : Ntdeadsize*2;
+		newdead = (Noteptr *) kmalloc(newsize*sizeof(Noteptr),"ntrelease");
+		if ( Ntdeadn > 0 )
+			memcpy(newdead,Ntdead,Ntdeadn*sizeof(Noteptr));
+		if ( Ntdead != NULL )
+			kfree(Ntdead);
+		Ntdead = newdead;
+		Ntdeadsize = newsize;
+	}
+	Ntdead[Ntdeadn++] = n;
+	Ntreleases++;
+}
+
+/* Number of notes on the released chains, waiting for newnt() */
+static long
+ntpendingcount(void)
+{
+	Noteptr n;
+	long cnt = 0;
+	int i;
+
+	for ( n=Ntrecycle; n!=NULL; n=nextnote(n) )
+		cnt++;
+	for ( i=0; i<Ntdeadn; i++ ) {
+		for ( n=Ntdead[i]; n!=NULL; n=nextnote(n) )
+			cnt++;
+	}
+	return cnt;
+}
+
+static long
+ntfreecount(void)
+{
+	Noteptr n;
+	long cnt = 0;
+
+	for ( n=Freent; n!=NULL; n=nextnote(n) )
+		cnt++;
+	return cnt;
+}
+
+/* Return an array of note allocator statistics, for coreleft("notes") */
+Datum
+ntstatsarr(void)
+{
+	Datum da;
+	Htablep arr;
+	long pending = ntpendingcount();
+
+	da = newarrdatum(0,12);
+	arr = da.u.arr;
+	setarraydata(arr,strdatum(uniqstr("chunks")),numdatum(Ntchunks));
+	setarraydata(arr,strdatum(uniqstr("allocated")),numdatum((long)Numalloc));
+	setarraydata(arr,strdatum(uniqstr("inuse")),numdatum((long)Numnotes-pending));
+	setarraydata(arr,strdatum(uniqstr("pending")),numdatum(pending));
+	setarraydata(arr,strdatum(uniqstr("peak")),numdatum(Ntpeak));
+	setarraydata(arr,strdatum(uniqstr("free")),numdatum(ntfreecount()));
+	setarraydata(arr,strdatum(uniqstr("pendingchains")),
+		numdatum((long)Ntdeadn+(Ntrecycle!=NULL)));
+	setarraydata(arr,strdatum(uniqstr("releases")),numdatum(Ntreleases));
+	setarraydata(arr,strdatum(uniqstr("recycled")),numdatum(Ntrecycled));
+	setarraydata(arr,strdatum(uniqstr("notesize")),numdatum((long)sizeof(Notedata)));
+	return da;
+}
+
+void
+ntstatsprint(void)
+{
+	long pending = ntpendingcount();
+
+	eprint("notes: chunks=%ld allocated=%d inuse=%ld peak=%ld free=%ld notesize=%d\n",
+		Ntchunks,Numalloc,(long)Numnotes-pending,Ntpeak,ntfreecount(),(int)sizeof(Notedata));
+	eprint("notes: releases=%ld pending_chains=%d pending=%ld recycled=%ld\n",
+		Ntreleases,Ntdeadn+(Ntrecycle!=NULL),pending,Ntrecycled);
+}
+
 /* compare two Midimess (ie. raw bytes) */
 int
 bytescmp(Noteptr n1,Noteptr n2)
@@ -780,13 +909,11 @@ char *
 notetoke(INTFUNC infunc)
 {
 	static char *notebuff = NULL;
-	static unsigned int buffsize = 0;
-	static int buffinc = 32;
-	static char *endofbuff = NULL;
+	static long buffsize = 0;
 	static int savechar = 0;
 	register int sc = savechar;
 	register int state = 0;
-	register char *p = notebuff;
+	register long i = 0;
 	register int c;
 
 	while ( state >= 0 ) {
@@ -801,27 +928,14 @@ notetoke(INTFUNC infunc)
 		if ( c == EOF )
 			break;
 
-		if ( p>=endofbuff ) {
-			/* increase size of notebuff */
-			char *r, *newbuff;
-			char *q = notebuff;
-
-			buffsize += buffinc;
-			buffinc = (buffinc*3)/2;
-			newbuff = kmalloc(buffsize,"notetoke");
-			r = newbuff;
-			while ( q < p )
-				*r++ = *q++;
-			kfree(notebuff);
-			notebuff = newbuff;
-			endofbuff = notebuff + buffsize;
-			p = r;
-		}
+		/* room for this char and the terminating NUL */
+		if ( i+2 > buffsize )
+			makeroom(i+2,&notebuff,&buffsize);
 
 		switch (state) {
 		case 0:
 			if ( c == ',' ) {
-				*p++ = c;
+				notebuff[i++] = c;
 				state = 1;
 				break;
 			}
@@ -829,8 +943,8 @@ notetoke(INTFUNC infunc)
 				break;
 			/* single quotes are returned immediately */
 			if ( c == '\'' ) {
-				*p++ = c;
-				*p = '\0';
+				notebuff[i++] = c;
+				notebuff[i] = '\0';
 				state = -1;
 				break;
 			}
@@ -841,7 +955,7 @@ notetoke(INTFUNC infunc)
 				break;
 			}
 			/* First char of a normal token */
-			*p++ = c;
+			notebuff[i++] = c;
 			if ( c == '"' )
 				state = 3;
 			else
@@ -862,7 +976,7 @@ notetoke(INTFUNC infunc)
 				break;
 			}
 			/* First char of a normal token (after comma) */
-			*p++ = c;
+			notebuff[i++] = c;
 			if ( c == '"' )
 				state = 3;
 			else
@@ -878,7 +992,7 @@ notetoke(INTFUNC infunc)
 				c = '\0';
 				state = -1;
 			}
-			*p++ = c;
+			notebuff[i++] = c;
 			break;
 		case 3:	/* scanning quoted string */
 #ifdef OLDSTUFF
@@ -887,7 +1001,7 @@ notetoke(INTFUNC infunc)
 				c = '"';
 			}
 #endif
-			*p++ = c;
+			notebuff[i++] = c;
 			if ( c == '"' ) {
 				/* a 't'ime may follow the quoted string */
 				state = 2;
@@ -910,75 +1024,203 @@ notetoke(INTFUNC infunc)
 		return(notebuff);
 }
 
-Phrasep
-yyphrase(INTFUNC infunc)
+/*
+ * strtoke(as)
+ *
+ * The in-memory equivalent of notetoke(), for strtophr().  It finds
+ * the next token directly in the string (*as) and copies it into a
+ * buffer that is reused from call to call, rather than being handed
+ * the string one character at a time.  The tokens it returns (and the
+ * NULL returned when the string runs out in the middle of one) are
+ * exactly the ones notetoke(strinput) would return.
+ */
+
+static char *Tokebuff = NULL;
+static long Tokesize = 0;
+
+static char *
+strtoke(char **as)
 {
-	Noteptr n;
-	Noteptr lastn = NULL;
+	register char *s = *as;
+	register int c;
+	char *start;
+	int comma = 0;
+	long leng;
+
+	/* skip separators and comments, up to the first char of a token */
+	for ( ;; ) {
+		c = *s;
+		if ( c == '\0' )
+			return(NULL);
+		if ( c == ',' && ! comma ) {
+			comma = 1;
+		}
+		else if ( c == '#' ) {
+			/* a comment extends to the end of the line */
+			while ( (c=*++s) != '\n' && c != '\r' ) {
+				if ( c == '\0' )
+					return(NULL);
+			}
+		}
+		else if ( c == '\'' ) {
+			/* a lone comma before a quote is ignored */
+			*as = s + 1;
+			return("'");
+		}
+		else if ( ! ( isspace(c) || (c == '|' && ! comma) ) )
+			break;
+		s++;
+	}
+
+	start = s;
+	if ( *s++ == '"' ) {
+		/* a quoted string, possibly followed by a 't'ime */
+		while ( (c=*s++) != '"' ) {
+			if ( c == '\0' )
+				return(NULL);
+		}
+	}
+	/* the rest of the note */
+	for ( ;; ) {
+		c = *s;
+		if ( c == '\0' )
+			return(NULL);
+		if ( c == ',' || c == '\'' || c == '|' || isspace(c) )
+			break;
+		s++;
+	}
+	leng = (long)(s - start);
+	/* a terminating comma or quote is left to start the next token */
+	*as = ( c == ',' || c == '\'' ) ? s : s + 1;
+
+	if ( leng+2 > Tokesize )
+		makeroom(leng+2,&Tokebuff,&Tokesize);
+	if ( comma )
+		Tokebuff[0] = ',';
+	memcpy(Tokebuff+comma,start,(size_t)leng);
+	Tokebuff[comma+leng] = '\0';
+	return(Tokebuff);
+}
+
+/*
+ * A phrase being built from a literal by yyphrase() or strtophr().
+ * Notes normally arrive in order, so each is appended after the last
+ * one.  A note that sorts earlier (e.g. the lower note of a chord
+ * written high to low) is inserted, searching from the mark rather
+ * than from the start of the phrase.  The mark is the last note
+ * before the current time, so chords don't make the literal
+ * quadratic to parse.
+ */
+
+typedef struct Phrbuild {
 	Phrasep p;
-	char *buff;
-	long maxend = UNDEFCLICKS;
-	int nquotes = 0;
+	Noteptr last;	/* last note in the phrase */
+	Noteptr mark;	/* a note known to sort before the current time */
+	long maxend;	/* maximum note ending time */
+} Phrbuild;
 
+static void
+phrbegin(Phrbuild *b)
+{
 	/* reset default values for volume, duration, etc. */
 	resetdef();
 
-	p = newph(0);
-	setfirstnote(p) = NULL;
-	p->p_leng = UNDEFCLICKS;
-
-	while ( (buff=notetoke(infunc)) != NULL ) {
+	b->p = newph(0);
+	setfirstnote(b->p) = NULL;
+	b->p->p_leng = UNDEFCLICKS;
+	b->last = NULL;
+	b->mark = NULL;
+	b->maxend = UNDEFCLICKS;
+}
 
-		/* if we see a quote, ignore it, but quit reading when we */
-		/* get a second one, no matter what state we're in. */
-		if ( *buff == '\'' ) {
-			if ( ++nquotes >= 2 )
-				break;
-			continue;
-		}
-		/* Be forgiving of isolated or duplicated commas */
-		if ( *buff==',' && *(buff+1)=='\0' )
-			continue;
+/* Add the note described by a token from notetoke() or strtoke(). */
+static void
+phrappend(Phrbuild *b,char *buff)
+{
+	Noteptr n, prevnt, nt1;
 
-		n = ntparse(buff,p);
+	n = ntparse(buff,b->p);
 
-		/* keep track of the maximum note ending time */
-		if ( maxend==UNDEFCLICKS || Def2time>maxend )
-			maxend = Def2time;
+	/* keep track of the maximum note ending time */
+	if ( b->maxend==UNDEFCLICKS || Def2time>b->maxend )
+		b->maxend = Def2time;
 
-		if ( n == NULL )
-			continue;
+	if ( n == NULL )
+		return;
 
-		/* Avoid ntinsert() if possibe (as an optimization) */
-		if ( firstnote(p) == NULL ) {
-			setfirstnote(p) = n;
-			lastn = n;
-		}
-		else if ( ntcmporder(n,lastn) >= 0 ) {
-			lastn->next = n;
-			lastn = n;
+	/* Avoid ntinsert() if possibe (as an optimization) */
+	if ( b->last == NULL ) {
+		setfirstnote(b->p) = n;
+		b->last = n;
+	}
+	else if ( ntcmporder(n,b->last) >= 0 ) {
+		if ( timeof(n) > timeof(b->last) )
+			b->mark = b->last;
+		b->last->next = n;
+		b->last = n;
+	}
+	else if ( b->mark != NULL && ntcmporder(n,b->mark) > 0 ) {
+		/* it goes somewhere between the mark and the last note */
+		prevnt = b->mark;
+		nt1 = prevnt->next;
+		while ( ntcmporder(nt1,n) <= 0 ) {
+			prevnt = nt1;
+			nt1 = nt1->next;
 		}
-		else {
+		prevnt->next = n;
+		n->next = nt1;
+	}
+	else {
 /* printf("yyphrase is doing an insert, lastn=(p=%d t=%ld) thisn=(p=%d t=%ld)\n",
-pitchof(lastn),timeof(lastn),pitchof(n),timeof(n)); */
-			ntinsert(n,p);
-			/* make sure lastn is correct */
-			while ( lastn->next != NULL )
-				lastn = lastn->next;
-		}
-
+pitchof(b->last),timeof(b->last),pitchof(n),timeof(n)); */
+		b->p->p_end = b->last;
+		ntinsert(n,b->p);
 	}
-	p->p_end = lastn;
+}
+
+static Phrasep
+phrend(Phrbuild *b)
+{
+	Phrasep p = b->p;
+
+	p->p_end = b->last;
 
 	/* If the phrase length isn't explicit, it's the maximum */
 	/* note ending time.  Note that we want to handle trailing */
 	/* rests, which update Deftime* but aren't real notes. */
 	if ( p->p_leng == UNDEFCLICKS ) {
-		p->p_leng = ( (maxend==UNDEFCLICKS) ? 0 : maxend );
+		p->p_leng = ( (b->maxend==UNDEFCLICKS) ? 0 : b->maxend );
 	}
 	return(p);
 }
 
+Phrasep
+yyphrase(INTFUNC infunc)
+{
+	Phrbuild b;
+	char *buff;
+	int nquotes = 0;
+
+	phrbegin(&b);
+
+	while ( (buff=notetoke(infunc)) != NULL ) {
+
+		/* if we see a quote, ignore it, but quit reading when we */
+		/* get a second one, no matter what state we're in. */
+		if ( *buff == '\'' ) {
+			if ( ++nquotes >= 2 )
+				break;
+			continue;
+		}
+		/* Be forgiving of isolated or duplicated commas */
+		if ( *buff==',' && *(buff+1)=='\0' )
+			continue;
+
+		phrappend(&b,buff);
+	}
+	return(phrend(&b));
+}
+
 static Symstr Strptr;
 
 int
@@ -991,8 +1233,25 @@ strinput(void)
 Phrasep
 strtophr(Symstr s)
 {
-	Strptr = s;
-	return(yyphrase(strinput));
+	Phrbuild b;
+	char *buff;
+	int nquotes = 0;
+
+	phrbegin(&b);
+
+	while ( (buff=strtoke(&s)) != NULL ) {
+		/* same handling of quotes and commas as yyphrase() */
+		if ( *buff == '\'' ) {
+			if ( ++nquotes >= 2 )
+				break;
+			continue;
+		}
+		if ( *buff==',' && *(buff+1)=='\0' )
+			continue;
+
+		phrappend(&b,buff);
+	}
+	return(phrend(&b));
 }
 
 int
@@ -1100,7 +1359,9 @@ attscan(char **s)
 	**s = '\0';
 	r = uniqstr(olds);
 	**s = savec;
-	(*s)++;
+	/* an unterminated value runs to the end of the note */
+	if ( savec != '\0' )
+		(*s)++;
 	return r;
 }
 
@@ -1116,8 +1377,6 @@ attscan(char **s)
 Noteptr 
 strtont(char *s)
 {
-	static char pitchnames[]={'c','d','e','f','g','a','b','\0'};
-	static int pitchvals[] = { 24, 26, 28, 29, 31, 33, 35};	/* octave 0 */
 	int vol, octave, chan;
 	DURATIONTYPE dur;
 	int val = 0, pitch = -1, isrest = 0;
@@ -1149,18 +1408,17 @@ strtont(char *s)
 	}
 	else {
 		/* Otherwise, it should be a pitch name */
-		int i = 0;
-		int schr = *s;
-		register char *pn = pitchnames;
-
-		while ( (c=(*pn++)) != '\0' ) {
-			if ( c == schr )
-				break;
-			i++;
-		}
-		if ( c == '\0' )
+		switch (*s) {
+		case 'c': val = 24; break;	/* octave 0 */
+		case 'd': val = 26; break;
+		case 'e': val = 28; break;
+		case 'f': val = 29; break;
+		case 'g': val = 31; break;
+		case 'a': val = 33; break;
+		case 'b': val = 35; break;
+		default:
 			return((Noteptr)NULL);
-		val = pitchvals[i];
+		}
 		s++;
 	}
 	/* Now pick up any of the optional suffixes */
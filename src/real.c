@@ -276,6 +276,9 @@ static Sched *Freesch = NULL;
 static Notedata Intnt;
 static Noteptr Earliestcurrent = NULL;
 static Noteptr Recmiddle = NULL;
+static long Recunwritten = 0;	/* notes recorded since the last recflush() */
+
+#define RECFLUSHNOTES 256	/* recorded notes between writes to a recfile */
 
 #define NOACT ((actfunc)0)
 
@@ -1408,6 +1411,57 @@ eprint("I don't expect this to happen (Earliestcurrent) n.time=%ld earliest=%ld\
 	if ( endof(n) > (*Recphr)->p_leng ) {
 		(*Recphr)->p_leng = endof(n);
 	}
+
+	if ( ++Recunwritten >= RECFLUSHNOTES )
+		recflush(0);
+}
+
+/* If the Recorded phrase is being streamed to a file, write the notes */
+/* in it that can no longer change (the ones before Recmiddle) and */
+/* remove them.  If all is set, everything in it is written. */
+void
+recflush(int all)
+{
+	Phrasep p = *Recphr;
+	Noteptr n, nxt, limit;
+
+	if ( ! mfrecording() )
+		return;
+	/* If someone else is using it, wait until ntrecord() copies it */
+	if ( phreallyused(p) > 1 )
+		return;
+	if ( all )
+		limit = NULL;
+	else if ( (limit=Recmiddle) == NULL )
+		return;
+	if ( firstnote(p) == limit )
+		return;
+
+	mfrecwrite(firstnote(p),limit);
+	for ( n=firstnote(p); n!=limit; n=nxt ) {
+		nxt = nextnote(n);
+		ntfree(n);
+	}
+	setfirstnote(p) = limit;
+	if ( limit == NULL ) {
+		lastnote(p) = NULL;
+		Recmiddle = NULL;
+	}
+	Recunwritten = 0;
+}
+
+/* Write whatever's left of the Recorded phrase, and close the file */
+/* it's being streamed to. */
+void
+recfinish(void)
+{
+	if ( ! mfrecording() )
+		return;
+	if ( phreallyused(*Recphr) > 1 )
+		mfrecwrite(firstnote(*Recphr),NULL);	/* it can't be changed */
+	else
+		recflush(1);
+	mfrecclose((*Recphr)->p_leng);
 }
 
 struct midiaction Intmidi = {
@@ -23,6 +23,7 @@ Symlongp Millicount, Throttle2, Loadverbose, Warnnegative, Midifilenoteoff;
 Symlongp Drawcount, Mousedisable, Forceinputport, Showsync, Echoport;
 Symlongp Inputistty, Debugoff, Fakewrap, Mfsysextype;
 Symlongp Tempotrack, Onoffmerge, Defrelease, Grablimit, Mfformat, Defoutport;
+Symlongp Phrasebinary;
 Symlongp Filter, Record, Recsched, Throttle, Recfilter, Recinput, Recsysex;
 Symlongp Lowcorelim, Arraysort, Midithrottle, Defpriority;
 Symlongp Taskaddr, Debuginst, Usewindfifos, Prepoll, Printsplit;
@@ -32,7 +33,7 @@ Symlongp Consecho, Checkcount, Isofuncwarn, Consupdown, Monitor_fnum;
 Symlongp Consecho_fnum, Slashcheck, Directcount, SubstrCount;
 Symlongp Mousefnum, Consinfnum, Consoutfnum, Midi_in_fnum, Mousefifolimit;
 Symlongp Saveglobalsize, Warningsleep, Millires, Milliwarn, Resizefix;
-Symlongp Deftimeout;
+Symlongp Deftimeout, Reclaimlimit, Reclaimtime, Strgcslice;
 Symlongp Minbardx, Kobjectoffset, Midi_out_fnum, Mousemoveevents;
 Symlongp Numinst1, Numinst2, Offsetpitch, Offsetfilter, DoDirectinput;
 Symlongp Offsetportfilter;
@@ -128,24 +129,198 @@ findsym(register char *p,Htablep symbols)
 		return NULL;
 }
 
+static Kshape Emptyshape;
+static Kshapep Topshape = NULL;
+static long Nshapes = 0;
+static Kslotsp Freeslots = NULL;
+
+void
+objslotsinit(Kobjectp o)
+{
+	o->shape = &Emptyshape;
+	o->slots = NULL;
+	o->oflags = 0;
+	o->strmark = 0;
+}
+
+/* The shape you get by adding element nm to shape sh, or NULL */
+/* if there isn't room for another one. */
+static Kshapep
+shapeadd(Kshapep sh,Symstr nm)
+{
+	Kshapep k;
+
+	for ( k=sh->kids; k!=NULL; k=k->nextkid ) {
+		if ( k->name == nm )
+			return k;
+	}
+	if ( sh->nslots >= OBJSLOTMAX || Nshapes >= OBJSHAPEMAX )
+		return NULL;
+	k = (Kshapep) kmalloc(sizeof(Kshape),"shapeadd");
+	k->names = (Symstr *) kmalloc((sh->nslots+1)*sizeof(Symstr),"shapeadd");
+	if ( sh->nslots > 0 )
+		memcpy(k->names,sh->names,sh->nslots*sizeof(Symstr));
+	k->names[sh->nslots] = nm;
+	k->name = nm;
+	k->nslots = sh->nslots+1;
+	k->kids = NULL;
+	k->nextkid = sh->kids;
+	sh->kids = k;
+	k->next = Topshape;
+	Topshape = k;
+	Nshapes++;
+	return k;
+}
+
+static Symbolp
+objslot(Kobjectp o,int n)
+{
+	Kslotsp ks = o->slots;
+
+	for ( ; n >= OBJSLOTCHUNK; n -= OBJSLOTCHUNK )
+		ks = ks->next;
+	return &(ks->s[n]);
+}
+
+static Kslotsp
+newslots(void)
+{
+	static Kslotsp lastslots;
+	static int used = ALLOCSLOTS;
+	Kslotsp ks;
+
+	if ( Freeslots != NULL ) {
+		ks = Freeslots;
+		Freeslots = Freeslots->next;
+	}
+	else {
+		if ( used == ALLOCSLOTS ) {
+			used = 0;
+			lastslots = (Kslotsp) kmalloc(ALLOCSLOTS*sizeof(Kslots),"newslots");
+		}
+		used++;
+		ks = lastslots++;
+	}
+	ks->next = NULL;
+	return ks;
+}
+
+/* Look up an element of o itself, not of what it inherits from. */
 Symbolp
-findobjsym(char *p,Kobjectp o,Kobjectp *foundobj)
+objfindsym(Kobjectp o,Symstr p)
 {
-	Datum key;
-	Hnodep h;
-	Htablep symbols = o->symbols;
+	Kshapep sh = o->shape;
+	int n;
+
+	/* Slot names are compared by pointer */
+	p = strintern(p);
+	for ( n=sh->nslots-1; n>=0; n-- ) {
+		if ( sh->names[n] == p )
+			return objslot(o,n);
+	}
+	if ( o->symbols != NULL )
+		return findsym(p,o->symbols);
+	return NULL;
+}
+
+/* Look up an element of o, adding it if it's not there. */
+Symbolp
+objinstall(Kobjectp o,Symstr p)
+{
+	Kshapep sh;
+	Kslotsp ks, *pks;
 	Symbolp s;
+	int n;
 
-	if ( symbols == NULL ) {
-		mdep_popup("Internal error - findobjsym finds NULL symbols!");
-		return NULL;
+	p = strintern(p);
+	if ( (s=objfindsym(o,p)) != NULL )
+		return s;
+	/* A new element of o may hide one it inherits */
+	if ( o->oflags & KOBJ_INHERIT )
+		Objversion++;
+	sh = NULL;
+	if ( o->symbols == NULL )
+		sh = shapeadd(o->shape,p);
+	if ( sh == NULL ) {
+		if ( o->symbols == NULL )
+			o->symbols = newht(13);
+		return syminstall(p,o->symbols,VAR);
 	}
-	key = strdatum(p);
-	h = hashtable(symbols,key,H_LOOK);
-	if ( h ) {
+	n = o->shape->nslots;
+	if ( n % OBJSLOTCHUNK == 0 ) {
+		ks = newslots();
+		for ( pks=&(o->slots); *pks!=NULL; pks=&((*pks)->next) )
+			;
+		*pks = ks;
+	}
+	o->shape = sh;
+	s = objslot(o,n);
+	s->next = NULL;
+	s->name = strdatum(p);
+	s->stype = VAR;
+	s->stackpos = 0;
+	s->flags = 0;
+	s->onchange = NULL;
+	s->sd = Noval;
+	return s;
+}
+
+/* Call f for each element of o itself.  Slots are passed as */
+/* temporary Hnodes, like the dense part of an array in hashvisit(). */
+void
+objvisit(Kobjectp o,HNODEFUNC f)
+{
+	Hnode tmp;
+	Symbolp s;
+	int n;
+
+	for ( n=0; n<o->shape->nslots; n++ ) {
+		s = objslot(o,n);
+		tmp.next = NULL;
+		tmp.key = s->name;
+		tmp.val = symdatum(s);
+		if ( (*f)(&tmp) )
+			return;
+	}
+	if ( o->symbols != NULL )
+		hashvisit(o->symbols,f);
+}
+
+/* Clear all the elements of o */
+void
+objclear(Kobjectp o)
+{
+	Kslotsp ks, nextks;
+	int n;
+
+	for ( n=0; n<o->shape->nslots; n++ )
+		clearsym(objslot(o,n));
+	for ( ks=o->slots; ks!=NULL; ks=nextks ) {
+		nextks = ks->next;
+		ks->next = Freeslots;
+		Freeslots = ks;
+	}
+	o->slots = NULL;
+	o->shape = &Emptyshape;
+	o->strmark = 0;
+	/* Give the table back (freeht() keeps it for reuse), so */
+	/* that new elements go in slots again, see objinstall() */
+	if ( o->symbols != NULL ) {
+		freeht(o->symbols);
+		o->symbols = NULL;
+	}
+}
+
+Symbolp
+findobjsym(char *p,Kobjectp o,Kobjectp *foundobj)
+{
+	Symbolp s;
+
+	s = objfindsym(o,p);
+	if ( s != NULL ) {
 		if ( foundobj )
 			*foundobj = o;
-		return h->val.u.sym;
+		return s;
 	}
 
 	/* Not found, try inherited objects */
@@ -161,6 +336,84 @@ findobjsym(char *p,Kobjectp o,Kobjectp *foundobj)
 	return NULL;
 }
 
+/*
+ * Inline caches for findobjsym(), used by the instructions that look
+ * up object elements.  Entries are in a direct-mapped table indexed by
+ * the call site (the Pc of the instruction) and the object, so a site
+ * that's used on many different objects (e.g. a loop over all the
+ * windows) keeps an entry for each of them.  An entry is good for as
+ * long as the object is alive and Objversion hasn't changed; Objversion
+ * is bumped whenever inheritance changes, an object that's involved in
+ * inheritance is freed, or an element is added to an object that's
+ * involved in inheritance.  Entries for an object itself are checked
+ * against its gen, which changes when it's freed and when it's reused.
+ */
+#define OBJCACHESIZE 4096
+
+typedef struct Objcache {
+	Unchar *site;
+	Kobjectp obj;
+	long gen;
+	Symstr name;
+	long version;
+	Symbolp sym;
+	Kobjectp found;
+} Objcache;
+
+static Objcache Objcaches[OBJCACHESIZE];
+static unsigned long Objcache_hits = 0;
+static unsigned long Objcache_misses = 0;
+
+Symbolp
+findobjsymcache(Unchar *site,char *p,Kobjectp o,Kobjectp *foundobj)
+{
+	Objcache *oc;
+	Symbolp s;
+
+	/* The name is kept, so it has to be interned */
+	p = strintern(p);
+	oc = &Objcaches[(((intptr_t)site>>2) ^ ((intptr_t)o>>4)) & (OBJCACHESIZE-1)];
+	if ( oc->site == site && oc->obj == o && oc->gen == o->gen
+			&& oc->name == p && oc->version == Objversion ) {
+		Objcache_hits++;
+		if ( foundobj )
+			*foundobj = oc->found;
+		return oc->sym;
+	}
+	Objcache_misses++;
+	s = findobjsym(p,o,&(oc->found));
+	if ( s == NULL ) {
+		oc->site = NULL;
+		return NULL;
+	}
+	oc->site = site;
+	oc->obj = o;
+	oc->gen = o->gen;
+	oc->name = p;
+	oc->version = Objversion;
+	oc->sym = s;
+	if ( foundobj )
+		*foundobj = oc->found;
+	return s;
+}
+
+void
+objstatsprint(void)
+{
+	Kobjectp o;
+	long nobj = 0, ntable = 0;
+
+	for ( o=Topobj; o!=NULL; o=o->onext ) {
+		nobj++;
+		if ( o->symbols != NULL )
+			ntable++;
+	}
+	eprint("object caches: hits=%lu misses=%lu version=%ld\n",
+		Objcache_hits,Objcache_misses,Objversion);
+	eprint("object shapes: %ld\n",Nshapes);
+	eprint("objects: %ld, %ld with elements in a table\n",nobj,ntable);
+}
+
 Symbolp
 uniqvar(char* pre)
 {
@@ -233,7 +486,7 @@ syminstall(Symstr p,Htablep symbols,int t)
 		execerror("Unexpected h==NULL in syminstall!?");
 	if ( isnoval(h->val) ) {
 		s = newsy();
-		s->name = key;
+		s->name = h->key;	/* interned, see hashtable() */
 		s->stype = t;
 		s->stackpos = 0;
 		s->sd = Noval;
@@ -388,8 +641,19 @@ needvalidfifo(char *s,Datum d)
 	return f;
 }
 
+/* The string returned is interned, so builtins can keep it */
+/* or compare it with other interned strings. */
 char *
 needstr(char *s,Datum d)
+{
+	if ( d.type != D_STR )
+		execerror("%s expects a string, got %s!",s,atypestr(d.type));
+	return ( strintern(d.u.str) );
+}
+
+/* For builtins that only look at the string while they run */
+char *
+needtmpstr(char *s,Datum d)
 {
 	if ( d.type != D_STR )
 		execerror("%s expects a string, got %s!",s,atypestr(d.type));
@@ -563,6 +827,7 @@ phrsplit(Phrasep p)
 		}
 		p2->p_leng = tm2;
 		*symdataptr(s) = phrdatum(p2);
+		strgcbarrier(*symdataptr(s));
 
 		/* If any notes are pending, take into account elapsed */
 		/* time, and if they expire, get rid of them. */
@@ -680,6 +945,7 @@ setarraydata(Htablep arr,Datum i,Datum d)
 		execerror("Can't use undefined value as array index\n");
 	s = arraysym(arr,i,H_INSERT);
 	*symdataptr(s) = d;
+	strgcbarrier(d);
 }
 
 void
@@ -774,6 +1040,9 @@ static struct binum {
 	{ "Mousedisable", 0L, &Mousedisable },
 	{ "Forceinputport", -1L, &Forceinputport },
 	{ "Checkcount", 20L, &Checkcount },
+	{ "Reclaimlimit", 2000L, &Reclaimlimit },
+	{ "Reclaimtime", 5L, &Reclaimtime },
+	{ "Strgcslice", 2000L, &Strgcslice },
 	{ "Loadverbose", 0L, &Loadverbose },
 	{ "Warnnegative", 1L, &Warnnegative },
 	{ "Midifilenoteoff", 1L, &Midifilenoteoff },
@@ -789,6 +1058,7 @@ static struct binum {
 	{ "Grablimit", 1000, &Grablimit },
 	{ "Mfformat", 0, &Mfformat },
 	{ "Mfsysextype", 0, &Mfsysextype },
+	{ "Phrasebinary", 0, &Phrasebinary },
 	{ "Trace", 1, &Linetrace },
 	{ "Abortonint", 0, &Abortonint },
 	{ "Abortonerr", 0, &Abortonerr },
@@ -1156,6 +1426,458 @@ pfprint(char *s)
 	fputs(s,Mf);
 }
 
+/*
+ * Binary phrase files.  They start with PHBIN_MAGIC and a version
+ * byte, followed by the phrase length, a table of the attrib strings,
+ * and the notes.  Each note starts with a byte of PHB_* bits telling
+ * which fields are different from the previous note; only those are
+ * written.  Times are deltas from the previous note, and numbers are
+ * written as variable-length integers (7 bits per byte, the high bit
+ * set on all but the last), zigzag-encoded when they can be negative.
+ * The leading 0 byte can't start a text phrase file, so filetoph()
+ * can tell them apart.
+ */
+#define PHBIN_MAGIC "\0KPH"
+#define PHBIN_MAGICLENG 4
+#define PHBIN_VERSION 1
+
+#define PHB_TYPE 0x01
+#define PHB_CHAN 0x02
+#define PHB_PITCH 0x04
+#define PHB_VOL 0x08
+#define PHB_DUR 0x10
+#define PHB_PORT 0x20
+#define PHB_FLAGS 0x40
+#define PHB_ATTRIB 0x80
+
+static char *Phb = NULL;	/* where a binary phrase is built or read */
+static long Phbsize = 0;
+static long Phbleng;
+static long Phbpos;
+static char *Phbatts = NULL;	/* the attribs (Symstr) read from a file */
+static long Phbattssize = 0;
+
+static void
+phbbyte(int c)
+{
+	if ( Phbleng >= Phbsize )
+		makeroom(Phbleng+1,&Phb,&Phbsize);
+	Phb[Phbleng++] = (char)c;
+}
+
+static void
+phbnum(unsigned long v)
+{
+	while ( v >= 0x80 ) {
+		phbbyte((int)((v & 0x7f) | 0x80));
+		v >>= 7;
+	}
+	phbbyte((int)v);
+}
+
+/* signed numbers are zigzag-encoded, so small negative ones are short */
+static void
+phbsnum(long v)
+{
+	phbnum((v<0) ? ((~(unsigned long)v)<<1)|1 : ((unsigned long)v)<<1);
+}
+
+static void
+phbbytes(Unchar *b,long n)
+{
+	if ( Phbleng+n > Phbsize )
+		makeroom(Phbleng+n,&Phb,&Phbsize);
+	memcpy(Phb+Phbleng,b,(size_t)n);
+	Phbleng += n;
+}
+
+#ifdef NTATTRIB
+/* Attrib strings are unique, so the table is hashed by address. */
+static char **Phbatt = NULL;	/* hash of attribs, Phbattsize slots */
+static int *Phbattnum = NULL;	/* table number of each slot */
+static int Phbattsize = 0;
+static int Phbnatt;
+static char *Phbattlist = NULL;	/* the attribs (char *) in table order */
+static long Phbattlistsize = 0;
+
+static int
+phbattslot(char *a)
+{
+	unsigned int h = (unsigned int)((intptr_t)a>>3) * 2654435761U;
+	int k = (int)(h & (unsigned int)(Phbattsize-1));
+
+	while ( Phbatt[k] != NULL && Phbatt[k] != a )
+		k = (k+1) & (Phbattsize-1);
+	return k;
+}
+
+/* Add a to the attrib table, if it's not there already */
+static void
+phbattadd(char *a)
+{
+	int k;
+
+	if ( Phbnatt*2 >= Phbattsize ) {
+		char **oa = Phbatt;
+		int *on = Phbattnum;
+		int osize = Phbattsize;
+
+		Phbattsize = (osize==0) ? 16 : osize*2;
+		Phbatt = (char **) kmalloc(Phbattsize*sizeof(char*),"phbattadd");
+		Phbattnum = (int *) kmalloc(Phbattsize*sizeof(int),"phbattadd");
+		for ( k=0; k<Phbattsize; k++ )
+			Phbatt[k] = NULL;
+		while ( osize-- > 0 ) {
+			if ( oa[osize] != NULL ) {
+				int j = phbattslot(oa[osize]);
+				Phbatt[j] = oa[osize];
+				Phbattnum[j] = on[osize];
+			}
+		}
+		kfree(oa);
+		kfree(on);
+	}
+	k = phbattslot(a);
+	if ( Phbatt[k] == NULL ) {
+		Phbatt[k] = a;
+		Phbattnum[k] = ++Phbnatt;	/* 0 is Nullstr */
+		makeroom((long)(Phbnatt*sizeof(char*)),&Phbattlist,&Phbattlistsize);
+		((char **)Phbattlist)[Phbnatt-1] = a;
+	}
+}
+#endif
+
+/* Encode p into Phb */
+static void
+phtobin(Phrasep p)
+{
+	Noteptr n, prev;
+	unsigned long nnotes = 0;
+	long lasttime = 0;
+	int mask, k;
+	Unchar *b;
+
+	Phbleng = 0;
+	phbbytes((Unchar*)PHBIN_MAGIC,PHBIN_MAGICLENG);
+	phbbyte(PHBIN_VERSION);
+	phbsnum(p->p_leng);
+
+	/* The attrib table goes first, its entries are numbered from 1 */
+#ifdef NTATTRIB
+	Phbnatt = 0;
+	for ( k=0; k<Phbattsize; k++ )
+		Phbatt[k] = NULL;
+	for ( n=firstnote(p); n!=NULL; n=nextnote(n) ) {
+		if ( attribof(n) != Nullstr )
+			phbattadd(attribof(n));
+	}
+	phbnum((unsigned long)Phbnatt);
+	for ( k=0; k<Phbnatt; k++ ) {
+		char *a = ((char **)Phbattlist)[k];
+		phbnum((unsigned long)strlen(a));
+		phbbytes((Unchar*)a,(long)strlen(a));
+	}
+#else
+	phbnum(0L);
+#endif
+
+	for ( n=firstnote(p); n!=NULL; n=nextnote(n) )
+		nnotes++;
+	phbnum(nnotes);
+
+	prev = NULL;
+	for ( n=firstnote(p); n!=NULL; prev=n,n=nextnote(n) ) {
+		if ( prev == NULL )
+			mask = PHB_TYPE|PHB_CHAN|PHB_PITCH|PHB_VOL|PHB_DUR
+				|PHB_PORT|PHB_FLAGS|PHB_ATTRIB;
+		else {
+			mask = 0;
+			if ( typeof(n) != typeof(prev) )
+				mask |= PHB_TYPE;
+			if ( ntisnote(n) ) {
+				if ( ! ntisnote(prev) )
+					mask |= PHB_CHAN|PHB_PITCH|PHB_VOL|PHB_DUR;
+				else {
+					if ( chanof(n) != chanof(prev) )
+						mask |= PHB_CHAN;
+					if ( pitchof(n) != pitchof(prev) )
+						mask |= PHB_PITCH;
+					if ( volof(n) != volof(prev) )
+						mask |= PHB_VOL;
+					if ( durof(n) != durof(prev) )
+						mask |= PHB_DUR;
+				}
+			}
+			if ( portof(n) != portof(prev) )
+				mask |= PHB_PORT;
+			if ( flagsof(n) != flagsof(prev) )
+				mask |= PHB_FLAGS;
+#ifdef NTATTRIB
+			if ( attribof(n) != attribof(prev) )
+				mask |= PHB_ATTRIB;
+#endif
+		}
+		phbbyte(mask);
+		phbsnum(timeof(n)-lasttime);
+		lasttime = timeof(n);
+		if ( mask & PHB_TYPE )
+			phbbyte(typeof(n));
+		if ( ntisnote(n) ) {
+			if ( mask & PHB_CHAN )
+				phbbyte(chanof(n));
+			if ( mask & PHB_PITCH )
+				phbbyte(pitchof(n));
+			if ( mask & PHB_VOL )
+				phbbyte(volof(n));
+			if ( mask & PHB_DUR )
+				phbsnum(durof(n));
+		}
+		else {
+			k = ntbytesleng(n);
+			b = ptrtobyte(n,0);
+			phbnum((unsigned long)k);
+			phbbytes(b,(long)k);
+		}
+		if ( mask & PHB_PORT )
+			phbbyte(portof(n));
+		if ( mask & PHB_FLAGS )
+			phbnum((unsigned long)flagsof(n));
+		if ( mask & PHB_ATTRIB ) {
+#ifdef NTATTRIB
+			if ( attribof(n) == Nullstr )
+				phbnum(0L);
+			else
+				phbnum((unsigned long)Phbattnum[phbattslot(attribof(n))]);
+#else
+			phbnum(0L);
+#endif
+		}
+	}
+}
+
+/* Don't hold on to a big buffer after a big phrase */
+static void
+phbshrink(void)
+{
+	if ( Phbsize > 65536 ) {
+		kfree(Phb);
+		Phb = NULL;
+		Phbsize = 0;
+	}
+}
+
+/* Write p to f as a binary phrase */
+void
+phtobinfile(FILE *f,Phrasep p)
+{
+	phtobin(p);
+	if ( fwrite(Phb,1,(size_t)Phbleng,f) != (size_t)Phbleng || fflush(f) )
+		eprint("Error writing binary phrase!?\n");
+	phbshrink();
+}
+
+/* The phrase bintoph() is building, so an error can throw it away */
+static Phrasep Phbph = NULL;
+
+static void
+phbbad(char *fname)
+{
+	if ( Phbph != NULL ) {
+		addtobechecked(Phbph);
+		Phbph = NULL;
+	}
+	phbshrink();
+	execerror("Bad binary phrase in '%s'",fname);
+}
+
+static int
+phbgetbyte(char *fname)
+{
+	if ( Phbpos >= Phbleng )
+		phbbad(fname);
+	return Phb[Phbpos++] & 0xff;
+}
+
+static unsigned long
+phbgetnum(char *fname)
+{
+	unsigned long v = 0;
+	int shift = 0;
+	int c;
+
+	do {
+		c = phbgetbyte(fname);
+		if ( shift >= (int)(8*sizeof(unsigned long)) )
+			phbbad(fname);
+		v |= ((unsigned long)(c & 0x7f)) << shift;
+		shift += 7;
+	} while ( c & 0x80 );
+	return v;
+}
+
+static long
+phbgetsnum(char *fname)
+{
+	unsigned long v = phbgetnum(fname);
+
+	return (v&1) ? (long)~(v>>1) : (long)(v>>1);
+}
+
+/* Decode the binary phrase in Phb, after the magic number */
+static Phrasep
+bintoph(char *fname)
+{
+	Phrasep p;
+	Noteptr n = NULL, last = NULL;
+	Symstr *atts;
+	unsigned long natt, nnotes, k, leng;
+	long t = 0;
+	long dur = 0;
+	int mask, type = NT_NOTE, chan = 0, pitch = 0, vol = 0, port = 0;
+	int flags = 0, i;
+	Symstr att = Nullstr;
+
+	if ( phbgetbyte(fname) > PHBIN_VERSION ) {
+		phbshrink();
+		execerror("Binary phrase in '%s' is a newer version than this KeyKit can read",fname);
+	}
+	Phbph = p = newph(0);
+	p->p_leng = phbgetsnum(fname);
+
+	natt = phbgetnum(fname);
+	if ( natt > (unsigned long)(Phbleng-Phbpos) )
+		phbbad(fname);
+	makeroom((long)((natt+1)*sizeof(Symstr)),&Phbatts,&Phbattssize);
+	atts = (Symstr *)Phbatts;
+	for ( k=0; k<natt; k++ ) {
+		char *s;
+
+		leng = phbgetnum(fname);
+		if ( leng > (unsigned long)(Phbleng-Phbpos) )
+			phbbad(fname);
+		s = kmalloc((unsigned)(leng+1),"bintoph");
+		memcpy(s,Phb+Phbpos,(size_t)leng);
+		s[leng] = '\0';
+		Phbpos += leng;
+		atts[k] = uniqstr(s);
+		kfree(s);
+	}
+
+	nnotes = phbgetnum(fname);
+	for ( k=0; k<nnotes; k++ ) {
+		mask = phbgetbyte(fname);
+		t += phbgetsnum(fname);
+		if ( mask & PHB_TYPE )
+			type = phbgetbyte(fname);
+		/* The note is linked in right away, so phbbad() frees */
+		/* it with the phrase.  An NT_BYTES note is an NT_NOTE */
+		/* until its message is saved. */
+		n = newnt();
+		timeof(n) = t;
+		typeof(n) = NT_NOTE;
+		if ( last == NULL )
+			setfirstnote(p) = n;
+		else
+			nextnote(last) = n;
+		lastnote(p) = last = n;
+		switch ( type ) {
+		case NT_NOTE:
+		case NT_ON:
+		case NT_OFF:
+			if ( mask & PHB_CHAN )
+				chan = phbgetbyte(fname);
+			if ( mask & PHB_PITCH )
+				pitch = phbgetbyte(fname);
+			if ( mask & PHB_VOL )
+				vol = phbgetbyte(fname);
+			if ( mask & PHB_DUR )
+				dur = phbgetsnum(fname);
+			setchanof(n) = chan;
+			pitchof(n) = pitch;
+			volof(n) = vol;
+			durof(n) = dur;
+			break;
+		case NT_LE3BYTES:
+			leng = phbgetnum(fname);
+			if ( leng > 3 || leng > (unsigned long)(Phbleng-Phbpos) )
+				phbbad(fname);
+			typeof(n) = NT_LE3BYTES;	/* for ptrtobyte() */
+			le3_nbytesof(n) = (Unchar)leng;
+			for ( i=0; i<(int)leng; i++ )
+				*ptrtobyte(n,i) = (Unchar)Phb[Phbpos++];
+			break;
+		case NT_BYTES:
+			leng = phbgetnum(fname);
+			if ( leng > (unsigned long)(Phbleng-Phbpos) )
+				phbbad(fname);
+			messof(n) = savemess((Unchar*)(Phb+Phbpos),(int)leng);
+			Phbpos += leng;
+			break;
+		default:
+			phbbad(fname);
+		}
+		typeof(n) = type;
+		if ( mask & PHB_PORT )
+			port = phbgetbyte(fname);
+		if ( mask & PHB_FLAGS )
+			flags = (int)phbgetnum(fname);
+		if ( mask & PHB_ATTRIB ) {
+			unsigned long a = phbgetnum(fname);
+			if ( a > natt )
+				phbbad(fname);
+			att = (a==0) ? Nullstr : atts[a-1];
+		}
+		portof(n) = port;
+		flagsof(n) = (UINT16)flags;
+#ifdef NTATTRIB
+		attribof(n) = att;
+#endif
+	}
+	Phbph = NULL;
+	return p;
+}
+
+/* Read a binary phrase from f, whose magic number has been read */
+Phrasep
+binfiletoph(FILE *f,char *fname)
+{
+	size_t r;
+	Phrasep p;
+
+	Phbleng = 0;
+	for ( ;; ) {
+		makeroom(Phbleng+BUFSIZ,&Phb,&Phbsize);
+		r = fread(Phb+Phbleng,1,(size_t)(Phbsize-Phbleng),f);
+		if ( r == 0 )
+			break;
+		Phbleng += (long)r;
+	}
+	Phbpos = 0;
+	p = bintoph(fname);
+	phbshrink();
+	return p;
+}
+
+/* If the next bytes of f are PHBIN_MAGIC, they're read and 1 is */
+/* returned.  Otherwise nothing is consumed (f must be at its start). */
+int
+isbinphrase(FILE *f)
+{
+	int c = getc(f);
+
+	if ( c == EOF )
+		return 0;
+	if ( c != PHBIN_MAGIC[0] ) {
+		ungetc(c,f);
+		return 0;
+	}
+	/* a text phrase file can't start with a 0 byte */
+	if ( getc(f) != PHBIN_MAGIC[1] || getc(f) != PHBIN_MAGIC[2]
+			|| getc(f) != PHBIN_MAGIC[3] )
+		return 0;
+	return 1;
+}
+
 void
 phtofile(FILE *f,Phrasep p)
 {
@@ -1170,10 +1892,13 @@ void
 vartofile(Symbolp s, char *fname)
 {
 	FILE *f;
+	int bin = 0;
 	
 	if ( fname==NULL || *fname == '\0' )
 		return;
 
+	/* Only plain files get the binary form of Phrasebinary, */
+	/* stdout and pipes are always given text. */
 	if ( stdioname(fname) )
 		f = stdout;
 	else if ( *fname == '|' ) {
@@ -1189,14 +1914,18 @@ vartofile(Symbolp s, char *fname)
 #endif
 	}
 	else {
-		f = getnopen(fname,"w");
+		bin = (*Phrasebinary != 0);
+		f = getnopen(fname,bin?"wb":"w");
 		if ( f == NULL ) {
 			eprint("Can't open %s\n",fname);
 			return;
 		}
 	}
 
-	phtofile(f,symdataptr(s)->u.phr);
+	if ( bin )
+		phtobinfile(f,symdataptr(s)->u.phr);
+	else
+		phtofile(f,symdataptr(s)->u.phr);
 	
 	if ( f != stdout ) {
 		if ( *fname != '|' )
@@ -1242,7 +1971,8 @@ filetovar(register Symbolp s, char *fname)
 		if ( pf )
 			fname = pf;
 
-		f = getnopen(fname,"r");
+		/* binary, since it may hold a binary phrase */
+		f = getnopen(fname,"rb");
 	}
 	if ( f == NULL || feof(f) )
 		return;		/* Silence.  Might be appropriate to */
@@ -1252,6 +1982,7 @@ filetovar(register Symbolp s, char *fname)
 	ph = filetoph(f,fname);
 	phincruse(ph);
 	*symdataptr(s) = phrdatum(ph);
+	strgcbarrier(*symdataptr(s));
 
 	if ( f != stdin ) {
 		if ( *fname != '|' )
@@ -1321,6 +2052,9 @@ freehn(Hnodep hn)
 		break;
 	case D_WIND:
 		break;
+	case D_OBJ:
+		/* Objtable entries, the object itself is freed by freeobj() */
+		break;
 	default:
 		eprint("Hey, type=%d in clearhn, should something go here??\n",hn->val.type);
 		break;
@@ -1349,6 +2083,21 @@ chkfreeht() {
 /* To avoid freeing and re-allocating the large chunks of memory */
 /* used for the hash tables, we keep them around and reuse them. */
 
+#define HT_DENSEKEEP 256
+
+/* Number of elements in the hash buckets rather than the vector */
+#define HTHASHCOUNT(ht) ((ht)->count - ((ht)->densen - (ht)->denseholes))
+
+/* Called whenever elements are added or removed */
+void
+htchanged(Htablep ht)
+{
+	if ( ht->sorted != NULL ) {
+		kfree(ht->sorted);
+		ht->sorted = NULL;
+	}
+}
+
 Htablep
 newht(int size)
 {
@@ -1382,7 +2131,17 @@ newht(int size)
 		ht = (Htablep) kmalloc( sizeof(Htable), "newht" );
 		h = (Hnodepp) kmalloc( size * sizeof(Hnodep), "newht" );
 		ht->size = size;
+		ht->initsize = size;
 		ht->nodetable = h;
+		ht->oldtable = NULL;
+		ht->oldsize = 0;
+		ht->rehashpos = 0;
+		ht->dense = NULL;
+		ht->densen = 0;
+		ht->densesize = 0;
+		ht->denseholes = 0;
+		ht->sorted = NULL;
+		ht->h_state = 0;
 		/* initialize entire table to NULLS */
 		pp = h + size;
 		while ( pp-- != h )
@@ -1394,12 +2153,15 @@ newht(int size)
 	ht->h_tobe = 0;
 	ht->h_next = NULL;
 	ht->h_prev = NULL;
-	ht->h_state = 0;
+	ht->h_state &= ~(HT_TOBECHECKED|HT_DRAINING|HT_FREE);
+	ht->h_visiting = 0;
 	if ( Topht != NULL ) {
 		Topht->h_prev = ht;
 		ht->h_next = Topht;
 	}
 	Topht = ht;
+	if ( Strgcmarking )
+		strgcnewht(ht);
 	return(ht);
 }
 
@@ -1408,8 +2170,19 @@ clearht(Htablep ht)
 {
 	register Hnodep hn, nexthn;
 	register Hnodepp pp;
-	register int n = ht->size;
+	register int n;
 	
+	htfinishrehash(ht);
+	htchanged(ht);
+	while ( htpopdense(ht) )
+		;
+	/* Don't hang on to a big vector in a table that will be reused */
+	if ( ht->densesize > HT_DENSEKEEP ) {
+		kfree(ht->dense);
+		ht->dense = NULL;
+		ht->densesize = 0;
+	}
+	n = ht->size;
 	pp = ht->nodetable;
 	/* as we're freeing the Hnodes pointed to by this hash table, */
 	/* we zero out the table, in preparation for its reuse. */
@@ -1427,51 +2200,50 @@ clearht(Htablep ht)
 		}
 	}
 	ht->count = 0;
+	/* A table that has grown goes back to its original */
+	/* size, so newht() can reuse it for the same size. */
+	if ( ht->size != ht->initsize ) {
+		kfree(ht->nodetable);
+		ht->size = ht->initsize;
+		ht->nodetable = (Hnodepp) kmalloc(ht->size*sizeof(Hnodep),"newht");
+		memset(ht->nodetable,0,ht->size*sizeof(Hnodep));
+	}
 }
 
-static int
+/* Take ht out of the list starting at *headp, which it's known to */
+/* be on (or on no list, with NULL links) */
+static void
 unlinkht(Htablepp headp, Htablep ht)
 {
-	register Htablep h;
-
-	for ( h = *headp; h != NULL; h = h->h_next ) {
-		if ( h == ht )
-			break;
-	}
-	if ( h == NULL )
-		return 0;
-
-	if ( h == *headp )
-		*headp = h->h_next;
-	if ( h->h_next != NULL )
-		h->h_next->h_prev = h->h_prev;
-	if ( h->h_prev != NULL )
-		h->h_prev->h_next = h->h_next;
-	return 1;
+	if ( ht == *headp )
+		*headp = ht->h_next;
+	if ( ht->h_next != NULL )
+		ht->h_next->h_prev = ht->h_prev;
+	if ( ht->h_prev != NULL )
+		ht->h_prev->h_next = ht->h_next;
 }
 
 void
 freeht(Htablep ht)
 {
-	register Htablep ht2;
+	if ( (ht->h_state & HT_FREE) != 0 ) {
+		eprint("HEY!, Trying to free an ht node (%lld) that's already in the Free list!!\n",(intptr_t)ht);
+		abort();
+	}
 
 	clearht(ht);
 
-	/* A table can be freed directly while still in Topht (Windhash does
-	 * this), or from htcheck() after being removed from a saved
-	 * Htobechecked list. Search live lists before unlinking so stale
-	 * h_next/h_prev values are not treated as ownership. */
-	(void) unlinkht(&Topht, ht);
-	(void) unlinkht(&Htobechecked, ht);
+	/* h_state says which list the table is on, as in httobechecked(). */
+	/* It can be freed directly while still in Topht (Windhash does */
+	/* this).  Tables drained by htcheck() are on no list. */
+	if ( (ht->h_state & HT_DRAINING) == 0 ) {
+		if ( (ht->h_state & HT_TOBECHECKED) != 0 )
+			unlinkht(&Htobechecked, ht);
+		else
+			unlinkht(&Topht, ht);
+	}
 	ht->h_next = NULL;
 	ht->h_prev = NULL;
-
-	for ( ht2=Freeht; ht2!=NULL; ht2=ht2->h_next ) {
-		if ( ht == ht2 ) {
-			eprint("HEY!, Trying to free an ht node (%lld) that's already in the Free list!!\n",(intptr_t)ht);
-			abort();
-		}
-	}
 	/* Add to Freeht list */
 	if ( Freeht )
 		Freeht->h_prev = ht;
@@ -1479,7 +2251,8 @@ freeht(Htablep ht)
 	ht->h_prev = NULL;
 	ht->h_used = 0;
 	ht->h_tobe = 0;
-	ht->h_state = 0;
+	ht->h_state &= ~(HT_TOBECHECKED|HT_DRAINING);
+	ht->h_state |= HT_FREE;
 	Freeht = ht;
 }
 
@@ -1505,22 +2278,47 @@ htlists(void)
  * carries a small header immediately before the returned char * so future
  * owned-string or tracing work can find per-string metadata without changing
  * the large existing Symstr ABI.
+ *
+ * The results of string operations (see strresult(), used by addstr(),
+ * substr() and get() on a file fifo) are transient strings instead,
+ * unless they're short.  They have the same header, but aren't interned,
+ * so building a string doesn't hash it or leave it in the table.  They're
+ * kept in a separate table by address, and the string collector frees
+ * the ones that it finds unreachable in two cycles in a row.  Anything
+ * that depends on the identity of a string (hash table keys, symbol
+ * names, needstr() in builtins, note attributes) uses strintern() to get
+ * the interned copy, which the transient remembers in its owner field.
  */
 
 #define STR_MAGIC 0x4b535452U	/* "KSTR" */
 #define STRF_INTERNED 0x0001
 #define STRF_IMMORTAL 0x0002
 #define STRF_QUARANTINED 0x0004
+#define STRF_TRANSIENT 0x0008
 
 #define STRGC_SAMPLE_LIMIT 8
+
+/* The string table doubles in size when it holds more than */
+/* STRTAB_LOAD strings per bucket.  The chains are moved over to */
+/* the new buckets a few at a time, on each uniqstr() call. */
+#define STRTAB_DEFSIZE 1024
+#define STRTAB_LOAD 2
+#define STRTAB_REHASHSTEP 8
+#define STRTAB_LONGCHAIN 8
 #define STRGC_DATUM_SCAN_LIMIT 1000000L
 
+/* Results shorter than this are interned, see strresult() */
+#define STRTRANS_MINLEN 64
+#define STRTRANS_DEFSIZE 256
+
 typedef struct Strhdr {
 	unsigned int magic;
 	unsigned short flags;
 	unsigned short mark;
 	unsigned long len;
-	Strnodep owner;
+	unsigned int hash;	/* full hash value, so rehashing is cheap */
+	Strnodep owner;		/* for transients, the interned copy (if any) */
+	struct Strhdr *tnext;	/* chain in Strtrans, or Strptrs if interned */
 	char bytes[1];
 } Strhdr;
 
@@ -1530,11 +2328,22 @@ static unsigned long Str_alloc_bytes = 0;
 static unsigned long Str_lookups = 0;
 static unsigned long Str_hits = 0;
 static unsigned long Str_misses = 0;
-static unsigned long Str_moves = 0;
+static unsigned long Str_resizes = 0;
 static unsigned short Str_mark_generation = 1;
 static unsigned long Str_quarantine_lookups = 0;
 static unsigned long Str_quarantine_marks = 0;
 
+static Strhdr **Strtrans = NULL;	/* transient strings, by address */
+static int Strtranssize = 0;
+static int Strtranscount = 0;
+static Strhdr **Strptrs = NULL;	/* interned strings, by address */
+static int Strptrsize = 0;
+static unsigned long Strtrans_bytes = 0;
+static unsigned long Strtrans_made = 0;
+static unsigned long Strtrans_freed = 0;
+static unsigned long Strtrans_freedbytes = 0;
+static unsigned long Strtrans_interned = 0;
+
 typedef struct Strcode {
 	Codep cp;
 	unsigned long len;
@@ -1545,6 +2354,74 @@ typedef struct Strcode {
 
 static Strcode *Strcodes = NULL;
 
+/* The registered code blocks again, sorted by start address, so that */
+/* strcode_containing() can do a binary search. */
+static Strcode **Strcodeidx = NULL;
+static long Strcodeidxn = 0;
+static long Strcodeidxsize = 0;
+
+/*
+ * The string collector is incremental, using tri-colour marking.
+ * Strings, tables and code blocks without the current mark are white;
+ * grey ones are marked and sit on the Strgreys stack waiting to be
+ * scanned; black ones have been scanned.  Marking and sweeping are
+ * done in slices of *Strgcslice units of work (see strgcslice(),
+ * called from exectasks()), so a collection doesn't block the realtime
+ * loop.  While marking, strgcbarrier() shades values as they are
+ * stored, new tables are shaded, and strings that are created or
+ * looked up are marked right away.  When the grey stack empties, the
+ * roots are scanned once more (atomically) before sweeping starts.
+ * Like before, the sweep only quarantines unmarked strings.
+ */
+#define STRGC_IDLE 0
+#define STRGC_MARK 1
+#define STRGC_SWEEP 2
+
+#define STRGREY_NONE 0
+#define STRGREY_HTABLE 1
+#define STRGREY_CODE 2
+#define STRGREY_PHRASE 3
+#define STRGREY_OBJECT 4
+
+#define STRGC_MINNEW 1000
+
+typedef struct Strgrey {
+	int kind;
+	int pos;	/* next bucket to scan, for tables */
+	int size;	/* table size when the scan started */
+	void *p;
+} Strgrey;
+
+static Strgrey *Strgreys = NULL;
+static int Strgreyn = 0;
+static int Strgreysize = 0;
+
+int Strgcmarking = 0;	/* used by strgcbarrier() */
+int Strgcpending = 0;	/* a cycle is due or in progress */
+
+static int Strgc_phase = STRGC_IDLE;
+static int Strgc_sweeppos = 0;
+static int Strgc_tsweeppos = 0;
+static int Strgc_verbose = 0;
+static unsigned long Strgc_work = 0;
+static unsigned long Strgc_newsince = 0;
+
+/* results of the sweep in progress, and of the last complete cycle */
+static unsigned long Strgc_marked, Strgc_markedbytes;
+static unsigned long Strgc_unmarked, Strgc_unmarkedbytes;
+static unsigned long Strgc_quarantined, Strgc_newlyquarantined;
+static unsigned long Strgc_freed;
+static unsigned long Strgc_samplecount;
+
+static unsigned long Strgc_cycles = 0;
+static unsigned long Strgc_slices = 0;
+static unsigned long Strgc_totalwork = 0;
+static unsigned long Strgc_barriers = 0;
+static long Strgc_lastpause = 0;
+static long Strgc_maxpause = 0;
+static long Strgc_totalpause = 0;
+static long Strgc_maxatomic = 0;
+
 static void strmark_datum(Datum d);
 static void strmark_symbol(Symbolp s);
 static void strmark_htable(Htablep ht);
@@ -1556,6 +2433,10 @@ static void strmark_object(Kobjectp o);
 static void strmark_window(Kwind *w);
 static void strmark_dnodes(Dnode *dn);
 static void strmark_codeptr(Codep cp,int preferred_kind);
+static void strgrey_forget(void *p);
+static void strgrey_push(int kind,void *p);
+static void strgc_sample(Symstr s);
+static Strnodep strnode_for_ptr(Symstr s);
 
 /* Strnode pool allocator */
 #define ALLOCSN 128
@@ -1584,10 +2465,18 @@ static Strtable *
 new_strtable(int size)
 {
 	Strtable *st = (Strtable *) kmalloc(sizeof(Strtable),"new_strtable");
-	st->size = size;
+	int sz;
+
+	/* round up to a power of 2, so a mask selects the bucket */
+	for ( sz=64; sz<size; sz*=2 )
+		;
+	st->size = sz;
 	st->count = 0;
-	st->buckets = (Strnodep *) kmalloc(size*sizeof(Strnodep),"strtable_buckets");
-	memset(st->buckets, 0, size*sizeof(Strnodep));
+	st->buckets = (Strnodep *) kmalloc(sz*sizeof(Strnodep),"strtable_buckets");
+	memset(st->buckets, 0, sz*sizeof(Strnodep));
+	st->oldbuckets = NULL;
+	st->oldsize = 0;
+	st->rehashpos = 0;
 	return st;
 }
 
@@ -1596,64 +2485,188 @@ strtab_init(void)
 {
 	if ( Strtab == NULL ) {
 		char *p = getenv("STRHASHSIZE");
-		Strtab = new_strtable( p ? atoi(p) : 1009 );
+		Strtab = new_strtable( p ? atoi(p) : STRTAB_DEFSIZE );
+	}
+}
+
+/* Move up to n chains from the old buckets to the new ones */
+static void
+strtab_rehash(int n)
+{
+	Strnodep h, nxt, *bp;
+	int mask = Strtab->size - 1;
+
+	while ( Strtab->oldbuckets != NULL && n-- > 0 ) {
+		for ( h=Strtab->oldbuckets[Strtab->rehashpos]; h!=NULL; h=nxt ) {
+			nxt = h->next;
+			bp = &(Strtab->buckets[h->hdr->hash & mask]);
+			h->next = *bp;
+			*bp = h;
+		}
+		Strtab->oldbuckets[Strtab->rehashpos] = NULL;
+		if ( ++(Strtab->rehashpos) >= Strtab->oldsize ) {
+			kfree(Strtab->oldbuckets);
+			Strtab->oldbuckets = NULL;
+			Strtab->oldsize = 0;
+			Strtab->rehashpos = 0;
+		}
+	}
+}
+
+/* Things that walk the whole table call this first, */
+/* so they only have to look at one set of buckets. */
+static void
+strtab_finishrehash(void)
+{
+	if ( Strtab != NULL && Strtab->oldbuckets != NULL )
+		strtab_rehash(Strtab->oldsize);
+}
+
+static void
+strtab_chkgrow(void)
+{
+	int newsize;
+
+	if ( Strtab->oldbuckets != NULL
+			|| Strtab->count <= Strtab->size * STRTAB_LOAD )
+		return;
+	/* Don't move chains around under a sweep in progress */
+	if ( Strgc_phase == STRGC_SWEEP )
+		return;
+	newsize = Strtab->size * 2;
+	Strtab->oldbuckets = Strtab->buckets;
+	Strtab->oldsize = Strtab->size;
+	Strtab->rehashpos = 0;
+	Strtab->buckets = (Strnodep *) kmalloc(newsize*sizeof(Strnodep),"strtable_buckets");
+	memset(Strtab->buckets, 0, newsize*sizeof(Strnodep));
+	Strtab->size = newsize;
+	Str_resizes++;
+}
+
+/* Start a new collection once the strings have grown by half */
+static void
+strgc_chknew(void)
+{
+	if ( ++Strgc_newsince >= STRGC_MINNEW
+			+ (unsigned long)((Strtab->count+Strtranscount)/2)
+			&& Strgc_phase == STRGC_IDLE
+			&& Strgcslice != NULL && *Strgcslice > 0 )
+		Strgcpending = 1;
+}
+
+/* Transient strings (and, in Strptrs, interned ones) are hashed by address */
+static int
+strtrans_bucket(char *s,int size)
+{
+	return (int)(((unsigned int)((intptr_t)s>>3) * 2654435761U) & (unsigned int)(size-1));
+}
+
+/* Double the size of a table of strings hashed by address */
+static void
+straddr_grow(Strhdr ***tabp,int *sizep)
+{
+	Strhdr **nt, *hdr, *nxt;
+	int i, b, newsize;
+
+	newsize = (*sizep == 0) ? STRTRANS_DEFSIZE : *sizep * 2;
+	nt = (Strhdr **) kmalloc(newsize*sizeof(Strhdr *),"straddr");
+	memset(nt, 0, newsize*sizeof(Strhdr *));
+	for ( i=0; i<*sizep; i++ ) {
+		for ( hdr=(*tabp)[i]; hdr!=NULL; hdr=nxt ) {
+			nxt = hdr->tnext;
+			b = strtrans_bucket(hdr->bytes,newsize);
+			hdr->tnext = nt[b];
+			nt[b] = hdr;
+		}
 	}
+	if ( *tabp != NULL )
+		kfree(*tabp);
+	*tabp = nt;
+	*sizep = newsize;
 }
 
 static void
-strnode_setstr(Strnodep h,char *s)
+strnode_setstr(Strnodep h,char *s,unsigned int hash,unsigned long len)
 {
-	unsigned int len;
 	unsigned int alloclen;
 	Strhdr *hdr;
+	int b;
 
-	len = (unsigned int) strlen(s);
-	alloclen = (unsigned int) sizeof(Strhdr) + len;
+	alloclen = (unsigned int) sizeof(Strhdr) + (unsigned int) len;
 	hdr = (Strhdr *) kmalloc(alloclen,"uniqstr");
 	hdr->magic = STR_MAGIC;
 	hdr->flags = STRF_INTERNED | STRF_IMMORTAL;
-	hdr->mark = 0;
-	hdr->len = (unsigned long) len;
+	/* Strings created during a collection are black */
+	hdr->mark = (Strgc_phase != STRGC_IDLE) ? Str_mark_generation : 0;
+	hdr->len = len;
+	hdr->hash = hash;
 	hdr->owner = h;
-	strcpy(hdr->bytes,s);
+	memcpy(hdr->bytes,s,len+1);
+
+	/* Interned strings are never freed, so the */
+	/* address index only has to grow. */
+	if ( Strptrs == NULL || Strtab->count >= Strptrsize )
+		straddr_grow(&Strptrs,&Strptrsize);
+	b = strtrans_bucket(hdr->bytes,Strptrsize);
+	hdr->tnext = Strptrs[b];
+	Strptrs[b] = hdr;
 
 	h->hdr = hdr;
 	h->str = hdr->bytes;
-	Str_payload_bytes += (unsigned long) len + 1;
+	Str_payload_bytes += len + 1;
 	Str_alloc_bytes += (unsigned long) alloclen;
+	strgc_chknew();
 }
 
-/* Compute hash value of a string (same algorithm as the old uniqstr) */
-static int
-strhash(char *s, int tablesize)
+/* FNV-1a hash of a string, also returning its length */
+static unsigned int
+strhash(char *s, unsigned long *lenp)
 {
-	register unsigned int t = 0;
-	register int c;
-	register char *p = s;
+	register unsigned int t = 2166136261U;
+	register Unchar *p = (Unchar *)s;
+
+	while ( *p != '\0' ) {
+		t ^= *p++;
+		t *= 16777619U;
+	}
+	*lenp = (unsigned long)(p - (Unchar *)s);
+	return t;
+}
 
-	while ( (c=(*p++)) != '\0' ) {
-		t += c;
-		t <<= 3;
+/* Find the bucket that a hash value belongs in.  While the table */
+/* is growing, chains that haven't been moved yet are still in */
+/* the old buckets. */
+static Strnodep *
+strtab_bucket(unsigned int hash)
+{
+	if ( Strtab->oldbuckets != NULL ) {
+		int i = (int)(hash & (Strtab->oldsize - 1));
+		if ( i >= Strtab->rehashpos )
+			return &(Strtab->oldbuckets[i]);
 	}
-	return t % tablesize;
+	return &(Strtab->buckets[hash & (Strtab->size - 1)]);
 }
 
 static void
 strnote_lookup(Strnodep h)
 {
-	if ( h != NULL && h->hdr != NULL
-	  && (h->hdr->flags & STRF_QUARANTINED) != 0 ) {
+	if ( h == NULL || h->hdr == NULL )
+		return;
+	if ( (h->hdr->flags & STRF_QUARANTINED) != 0 ) {
 		h->hdr->flags &= ~STRF_QUARANTINED;
 		Str_quarantine_lookups++;
 	}
+	if ( Strgc_phase != STRGC_IDLE )
+		h->hdr->mark = Str_mark_generation;
 }
 
-Symstr
-uniqstr(char *s)
+static Strnodep
+uniqnode(char *s)
 {
-	Strnodep *table;
-	Strnodep h, toph;
-	int v;
+	Strnodep *bp;
+	Strnodep h;
+	unsigned int hash;
+	unsigned long len;
 
 	if ( s == NULL ) {
 		eprint("uniqstr: NULL string passed!\n");
@@ -1663,62 +2676,165 @@ uniqstr(char *s)
 	strtab_init();
 	Str_lookups++;
 
-	v = strhash(s, Strtab->size);
-
-	table = Strtab->buckets;
-	toph = table[v];
-	if ( toph == NULL ) {
-		/* no collision */
-		h = newsn();
-		strnode_setstr(h,s);
-		Strtab->count++;
-		Str_misses++;
-	}
-	else {
-		Strnodep prev;
+	if ( Strtab->oldbuckets != NULL )
+		strtab_rehash(STRTAB_REHASHSTEP);
 
-		/* quick test for first node in list, most common case */
-		if ( strcmp(toph->str,s) == 0  ) {
-			Str_hits++;
-			strnote_lookup(toph);
-			return(toph->str);
-		}
+	hash = strhash(s,&len);
+	bp = strtab_bucket(hash);
 
-		/* Look through entire list */
-		h = toph;
-		for ( prev=h; (h=h->next) != NULL; prev=h ) {
-			if ( strcmp(h->str,s) == 0 )
-				break;
-		}
-		if ( h == NULL ) {
-			/* string wasn't found, add it */
-			h = newsn();
-			strnode_setstr(h,s);
-			Strtab->count++;
-			Str_misses++;
-		}
-		else {
-			/* Symstr found.  Delete it from its current */
-			/* position so we can move it to the top. */
-			prev->next = h->next;
+	/* The cached hash and length avoid most strcmp() calls.  Found */
+	/* strings are left where they are, chains are short enough that */
+	/* moving them to the front doesn't pay for the writes. */
+	for ( h=(*bp); h!=NULL; h=h->next ) {
+		if ( h->hdr->hash == hash && h->hdr->len == len
+				&& strcmp(h->str,s) == 0 ) {
 			Str_hits++;
-			Str_moves++;
 			strnote_lookup(h);
+			return(h);
 		}
 	}
-	/* Whether we've just allocated a new node, or whether we've */
-	/* found the node somewhere in the list, we insert it at the */
-	/* top of the list.  Ie. the lists are constantly re-arranging */
-	/* themselves to put the most recently seen entries on top. */
-	h->next = toph;
-	table[v] = h;
-	return(h->str);
+	/* string wasn't found, add it to the top of the list */
+	h = newsn();
+	strnode_setstr(h,s,hash,len);
+	Strtab->count++;
+	Str_misses++;
+	h->next = *bp;
+	*bp = h;
+	strtab_chkgrow();
+	return(h);
+}
+
+Symstr
+uniqstr(char *s)
+{
+	return uniqnode(s)->str;
+}
+
+static void
+strtrans_chkgrow(void)
+{
+	if ( Strtrans != NULL && Strtranscount <= Strtranssize )
+		return;
+	/* The sweep walks the buckets by position */
+	if ( Strtrans != NULL && Strgc_phase == STRGC_SWEEP )
+		return;
+	straddr_grow(&Strtrans,&Strtranssize);
+}
+
+/* Return the header of s if it's a transient string, else NULL. */
+static Strhdr *
+strtrans_find(Symstr s)
+{
+	Strhdr *hdr;
+
+	if ( Strtranscount == 0 || s == NULL )
+		return NULL;
+	for ( hdr=Strtrans[strtrans_bucket(s,Strtranssize)]; hdr!=NULL; hdr=hdr->tnext ) {
+		if ( hdr->bytes == s )
+			return hdr;
+	}
+	return NULL;
+}
+
+/* Allocate a transient string of len bytes.  The caller fills it in; */
+/* it's already terminated. */
+Symstr
+strtransalloc(long len)
+{
+	unsigned int alloclen;
+	Strhdr *hdr;
+	int b;
+
+	strtab_init();
+	strtrans_chkgrow();
+	alloclen = (unsigned int) sizeof(Strhdr) + (unsigned int) len;
+	hdr = (Strhdr *) kmalloc(alloclen,"strtransalloc");
+	hdr->magic = STR_MAGIC;
+	hdr->flags = STRF_TRANSIENT;
+	/* Strings created during a collection are black */
+	hdr->mark = (Strgc_phase != STRGC_IDLE) ? Str_mark_generation : 0;
+	hdr->len = (unsigned long) len;
+	hdr->hash = 0;
+	hdr->owner = NULL;
+	hdr->bytes[len] = '\0';
+
+	b = strtrans_bucket(hdr->bytes,Strtranssize);
+	hdr->tnext = Strtrans[b];
+	Strtrans[b] = hdr;
+	Strtranscount++;
+	Strtrans_made++;
+	Strtrans_bytes += (unsigned long) alloclen;
+	strgc_chknew();
+	return hdr->bytes;
+}
+
+/* The result of a string operation, from len bytes at s (which */
+/* needn't be terminated).  Short results are interned, since */
+/* they're cheap to look up and likely to be used again. */
+Symstr
+strresult(char *s,long len)
+{
+	char buff[STRTRANS_MINLEN];
+	Symstr p;
+
+	if ( len < STRTRANS_MINLEN ) {
+		memcpy(buff,s,(size_t)len);
+		buff[len] = '\0';
+		return uniqstr(buff);
+	}
+	p = strtransalloc(len);
+	memcpy(p,s,(size_t)len);
+	return p;
+}
+
+/* Return the interned copy of s, which is s itself unless */
+/* it's a transient string. */
+Symstr
+strintern(Symstr s)
+{
+	Strhdr *hdr;
+
+	if ( (hdr=strtrans_find(s)) == NULL )
+		return s;
+	if ( hdr->owner == NULL ) {
+		hdr->owner = uniqnode(s);
+		Strtrans_interned++;
+	}
+	return hdr->owner->str;
+}
+
+/* Like strlen, but transient strings know their length */
+long
+strlength(Symstr s)
+{
+	Strhdr *hdr;
+
+	if ( (hdr=strtrans_find(s)) != NULL )
+		return (long) hdr->len;
+	return (long) strlen(s);
+}
+
+/* Index of the first entry in Strcodeidx whose start is >= cp. */
+static long
+strcode_search(Codep cp)
+{
+	long lo = 0, hi = Strcodeidxn, mid;
+
+	while ( lo < hi ) {
+		mid = (lo+hi)/2;
+		if ( (intptr_t)Strcodeidx[mid]->cp < (intptr_t)cp )
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
 void
 strregistercode(Codep cp,unsigned long len,int kind)
 {
 	Strcode *sc;
+	long i;
 
 	if ( cp == NULL || len == 0 )
 		return;
@@ -1729,12 +2845,30 @@ strregistercode(Codep cp,unsigned long len,int kind)
 	sc->mark = 0;
 	sc->next = Strcodes;
 	Strcodes = sc;
+
+	if ( Strcodeidxn >= Strcodeidxsize ) {
+		long newsize = Strcodeidxsize ? Strcodeidxsize*2 : 256;
+		Strcode **newidx;
+		newidx = (Strcode **) kmalloc(newsize*sizeof(Strcode*),"strregistercode");
+		if ( Strcodeidxn > 0 )
+			memcpy(newidx,Strcodeidx,Strcodeidxn*sizeof(Strcode*));
+		if ( Strcodeidx != NULL )
+			kfree(Strcodeidx);
+		Strcodeidx = newidx;
+		Strcodeidxsize = newsize;
+	}
+	i = strcode_search(cp);
+	if ( i < Strcodeidxn )
+		memmove(&Strcodeidx[i+1],&Strcodeidx[i],(Strcodeidxn-i)*sizeof(Strcode*));
+	Strcodeidx[i] = sc;
+	Strcodeidxn++;
 }
 
 void
 strunregistercode(Codep cp)
 {
 	Strcode *sc, *prev;
+	long i;
 
 	prev = NULL;
 	for ( sc=Strcodes; sc!=NULL; sc=sc->next ) {
@@ -1748,6 +2882,14 @@ strunregistercode(Codep cp)
 		Strcodes = sc->next;
 	else
 		prev->next = sc->next;
+	i = strcode_search(cp);
+	while ( i < Strcodeidxn && Strcodeidx[i] != sc && Strcodeidx[i]->cp == cp )
+		i++;
+	if ( i < Strcodeidxn && Strcodeidx[i] == sc ) {
+		Strcodeidxn--;
+		memmove(&Strcodeidx[i],&Strcodeidx[i+1],(Strcodeidxn-i)*sizeof(Strcode*));
+	}
+	strgrey_forget(sc);
 	kfree(sc);
 }
 
@@ -1755,40 +2897,51 @@ static Strcode *
 strcode_containing(Codep cp)
 {
 	Strcode *sc;
-	intptr_t p, start, end;
+	intptr_t p, start;
+	long i;
 
-	if ( cp == NULL )
+	if ( cp == NULL || Strcodeidxn == 0 )
 		return NULL;
 	p = (intptr_t)cp;
-	for ( sc=Strcodes; sc!=NULL; sc=sc->next ) {
-		start = (intptr_t)sc->cp;
-		end = start + (intptr_t)sc->len;
-		if ( p >= start && p < end )
-			return sc;
-	}
+	/* the candidate is the last block starting at or before cp */
+	i = strcode_search(cp);
+	if ( i < Strcodeidxn && (intptr_t)Strcodeidx[i]->cp == p )
+		return Strcodeidx[i];
+	if ( i == 0 )
+		return NULL;
+	sc = Strcodeidx[i-1];
+	start = (intptr_t)sc->cp;
+	if ( p >= start && p < start + (intptr_t)sc->len )
+		return sc;
 	return NULL;
 }
 
+/* Chain length statistics.  *probesp is the total number of */
+/* comparisons needed to find every string once. */
 static void
-strtab_summarize(int *usedp,int *maxchainp,unsigned long *chainsp)
+strtab_summarize(int *usedp,int *maxchainp,int *longp,unsigned long *probesp)
 {
 	int i, n;
 	Strnodep h;
 
 	*usedp = 0;
 	*maxchainp = 0;
-	*chainsp = 0;
+	*longp = 0;
+	*probesp = 0;
 	if ( Strtab == NULL )
 		return;
+	strtab_finishrehash();
 	for ( i=0; i<Strtab->size; i++ ) {
 		n = 0;
 		for ( h=Strtab->buckets[i]; h!=NULL; h=h->next )
 			n++;
 		if ( n != 0 ) {
 			(*usedp)++;
-			*chainsp += (unsigned long) n;
+			*probesp += (unsigned long)n * (unsigned long)(n+1) / 2;
 			if ( n > *maxchainp )
 				*maxchainp = n;
+			if ( n > STRTAB_LONGCHAIN )
+				(*longp)++;
 		}
 	}
 }
@@ -1796,33 +2949,84 @@ strtab_summarize(int *usedp,int *maxchainp,unsigned long *chainsp)
 void
 strstatsprint(void)
 {
-	int used, maxchain;
-	unsigned long chains;
+	int used, maxchain, longchains;
+	unsigned long probes, mean;
 
 	if ( Strtab == NULL ) {
 		eprint("string table: empty\n");
 		return;
 	}
-	strtab_summarize(&used,&maxchain,&chains);
+	strtab_summarize(&used,&maxchain,&longchains,&probes);
 	eprint("string table: strings=%d buckets=%d used_buckets=%d max_chain=%d\n",
 		Strtab->count,Strtab->size,used,maxchain);
-	eprint("string table: payload_bytes=%lu allocated_bytes=%lu lookups=%lu hits=%lu misses=%lu moves=%lu\n",
-		Str_payload_bytes,Str_alloc_bytes,Str_lookups,Str_hits,Str_misses,Str_moves);
+	/* in hundredths */
+	mean = used ? (100UL * (unsigned long)Strtab->count) / (unsigned long)used : 0;
+	eprint("string table: mean_chain=%lu.%02lu long_chains=%d avg_probes=%lu.%02lu resizes=%lu\n",
+		mean/100,mean%100,longchains,
+		Strtab->count ? (probes/(unsigned long)Strtab->count) : 0UL,
+		Strtab->count ? ((100UL*probes)/(unsigned long)Strtab->count)%100 : 0UL,
+		Str_resizes);
+	eprint("string table: payload_bytes=%lu allocated_bytes=%lu lookups=%lu hits=%lu misses=%lu\n",
+		Str_payload_bytes,Str_alloc_bytes,Str_lookups,Str_hits,Str_misses);
 	eprint("string table: mark_generation=%u quarantine_lookup_rescues=%lu quarantine_mark_rescues=%lu\n",
 		(unsigned int)Str_mark_generation,Str_quarantine_lookups,Str_quarantine_marks);
-	dummyusage(chains);
+	eprint("transient strings: count=%d bytes=%lu buckets=%d made=%lu freed=%lu freed_bytes=%lu interned=%lu\n",
+		Strtranscount,Strtrans_bytes,Strtranssize,Strtrans_made,
+		Strtrans_freed,Strtrans_freedbytes,Strtrans_interned);
+	eprint("string gc: phase=%s cycles=%lu slices=%lu work=%lu barriers=%lu grey=%d\n",
+		Strgc_phase==STRGC_MARK ? "mark" : (Strgc_phase==STRGC_SWEEP ? "sweep" : "idle"),
+		Strgc_cycles,Strgc_slices,Strgc_totalwork,Strgc_barriers,Strgreyn);
+	eprint("string gc: last_pause=%ld max_pause=%ld total_pause=%ld max_atomic_pause=%ld (ms)\n",
+		Strgc_lastpause,Strgc_maxpause,Strgc_totalpause,Strgc_maxatomic);
+}
+
+static int
+strtranscheck(void)
+{
+	Strhdr *hdr;
+	int i, errors, seen;
+
+	errors = 0;
+	seen = 0;
+	for ( i=0; i<Strtranssize; i++ ) {
+		for ( hdr=Strtrans[i]; hdr!=NULL; hdr=hdr->tnext ) {
+			if ( ++seen > Strtranscount ) {
+				eprint("string table check: too many transient strings\n");
+				return errors+1;
+			}
+			if ( hdr->magic != STR_MAGIC || (hdr->flags & STRF_TRANSIENT) == 0 ) {
+				eprint("string table check: bad header for transient string\n");
+				errors++;
+			}
+			else if ( hdr->bytes[hdr->len] != '\0' ) {
+				eprint("string table check: unterminated transient string\n");
+				errors++;
+			}
+			else if ( strtrans_bucket(hdr->bytes,Strtranssize) != i ) {
+				eprint("string table check: transient string '%s' is in the wrong bucket\n",hdr->bytes);
+				errors++;
+			}
+		}
+	}
+	if ( seen != Strtranscount ) {
+		eprint("string table check: counted %d transient strings, table says %d\n",
+			seen,Strtranscount);
+		errors++;
+	}
+	return errors;
 }
 
 int
 strtabcheck(void)
 {
 	int i, errors, steps;
-	unsigned long seen;
+	unsigned long seen, len;
 	Strnodep h;
 
 	if ( Strtab == NULL )
 		return 1;
 
+	strtab_finishrehash();
 	errors = 0;
 	seen = 0;
 	for ( i=0; i<Strtab->size; i++ ) {
@@ -1852,8 +3056,17 @@ strtabcheck(void)
 				eprint("string table check: header/string mismatch for '%s'\n",h->str);
 				errors++;
 			}
-			if ( strlen(h->str) != h->hdr->len ) {
-				eprint("string table check: length mismatch for string '%s'\n",h->str);
+			else if ( strnode_for_ptr(h->str) != h ) {
+				eprint("string table check: string '%s' isn't in the address index\n",h->str);
+				errors++;
+			}
+			if ( strhash(h->str,&len) != h->hdr->hash
+					|| len != h->hdr->len ) {
+				eprint("string table check: hash/length mismatch for string '%s'\n",h->str);
+				errors++;
+			}
+			else if ( (int)(h->hdr->hash & (Strtab->size-1)) != i ) {
+				eprint("string table check: string '%s' is in the wrong bucket\n",h->str);
 				errors++;
 			}
 		}
@@ -1863,22 +3076,23 @@ strtabcheck(void)
 			seen,Strtab->count);
 		errors++;
 	}
+	errors += strtranscheck();
 	return errors == 0;
 }
 
+/* Find the node of an interned string by its address.  Strings that */
+/* aren't in the table (e.g. ones that have been freed) are never */
+/* looked at, only compared. */
 static Strnodep
 strnode_for_ptr(Symstr s)
 {
-	int i;
-	Strnodep h;
+	Strhdr *hdr;
 
-	if ( s == NULL || Strtab == NULL )
+	if ( s == NULL || Strptrs == NULL )
 		return NULL;
-	for ( i=0; i<Strtab->size; i++ ) {
-		for ( h=Strtab->buckets[i]; h!=NULL; h=h->next ) {
-			if ( h->str == s )
-				return h;
-		}
+	for ( hdr=Strptrs[strtrans_bucket(s,Strptrsize)]; hdr!=NULL; hdr=hdr->tnext ) {
+		if ( hdr->bytes == s )
+			return hdr->owner;
 	}
 	return NULL;
 }
@@ -1887,7 +3101,16 @@ void
 markstr(Symstr s)
 {
 	Strnodep h;
+	Strhdr *hdr;
 
+	Strgc_work++;
+	if ( (hdr=strtrans_find(s)) != NULL ) {
+		if ( hdr->mark != Str_mark_generation ) {
+			hdr->mark = Str_mark_generation;
+			hdr->flags &= ~STRF_QUARANTINED;
+		}
+		return;
+	}
 	h = strnode_for_ptr(s);
 	if ( h == NULL || h->hdr == NULL )
 		return;
@@ -1916,14 +3139,29 @@ strclear_code_marks(void)
 		sc->mark = 0;
 }
 
+static void
+strclear_object_marks(void)
+{
+	Kobjectp o;
+
+	for ( o=Topobj; o!=NULL; o=o->onext )
+		o->strmark = 0;
+}
+
 static void
 strclear_string_marks(void)
 {
 	int i;
 	Strnodep h;
+	Strhdr *hdr;
 
+	for ( i=0; i<Strtranssize; i++ ) {
+		for ( hdr=Strtrans[i]; hdr!=NULL; hdr=hdr->tnext )
+			hdr->mark = 0;
+	}
 	if ( Strtab == NULL )
 		return;
+	strtab_finishrehash();
 	for ( i=0; i<Strtab->size; i++ ) {
 		for ( h=Strtab->buckets[i]; h!=NULL; h=h->next ) {
 			if ( h->hdr != NULL )
@@ -1940,9 +3178,11 @@ strnext_generation(void)
 		Str_mark_generation = 1;
 		strclear_string_marks();
 		strclear_code_marks();
+		strclear_object_marks();
 	}
 	strclear_htable_marks(Topht);
 	strclear_htable_marks(Htobechecked);
+	strclear_htable_marks(Htdraining);
 	strclear_htable_marks(Freeht);
 }
 
@@ -2168,14 +3408,21 @@ strmark_inststream(Unchar *p,Unchar *end)
 static void
 strmark_codeblock(Strcode *sc)
 {
-	Unchar *p, *end;
-	Symbolp sym;
-
 	if ( sc == NULL || sc->cp == NULL || sc->mark == Str_mark_generation )
 		return;
 	sc->mark = Str_mark_generation;
+	strgrey_push(STRGREY_CODE,(void *)sc);
+}
+
+static void
+strscan_codeblock(Strcode *sc)
+{
+	Unchar *p, *end;
+	Symbolp sym;
+
 	p = sc->cp;
 	end = sc->cp + sc->len;
+	Strgc_work += sc->len / 8;
 	if ( sc->kind == STRCODE_FUNCTION ) {
 		if ( p >= end )
 			return;
@@ -2217,13 +3464,25 @@ strmark_note(Noteptr n)
 
 static void
 strmark_phrase(Phrasep ph)
+{
+#ifdef NTATTRIB
+	if ( ph != NULL && firstnote(ph) != NULL )
+		strgrey_push(STRGREY_PHRASE,(void *)ph);
+#else
+	/* Notes don't refer to any strings */
+	dummyusage(ph);
+#endif
+}
+
+static void
+strscan_phrase(Phrasep ph)
 {
 	Noteptr nt;
 
-	if ( ph == NULL )
-		return;
-	for ( nt=firstnote(ph); nt!=NULL; nt=nextnote(nt) )
+	for ( nt=firstnote(ph); nt!=NULL; nt=nextnote(nt) ) {
+		Strgc_work++;
 		strmark_note(nt);
+	}
 }
 
 static void
@@ -2240,21 +3499,48 @@ strmark_symbol(Symbolp s)
 static void
 strmark_htable(Htablep ht)
 {
-	Hnodepp pp;
-	Hnodep h;
-	int hsize;
-
 	if ( ht == NULL || (ht->h_state & HT_STRGC_MARKED) != 0 )
 		return;
 	ht->h_state |= HT_STRGC_MARKED;
-	pp = ht->nodetable;
-	hsize = ht->size;
-	while ( hsize-- > 0 ) {
-		for ( h=(*pp++); h!=NULL; h=h->next ) {
+	strgrey_push(STRGREY_HTABLE,(void *)ht);
+}
+
+/* Scan the buckets of a table, starting at *posp, until the budget */
+/* runs out.  Returns 1 when the whole table has been scanned. */
+static int
+strscan_htable(Htablep ht,int *posp,int *sizep,unsigned long budget)
+{
+	Hnodep h;
+	int pos;
+
+	/* If the table has grown since the scan started, the */
+	/* elements have moved around, so start over. */
+	if ( *posp == 0 || ht->oldtable != NULL || ht->size != *sizep ) {
+		htfinishrehash(ht);
+		*posp = 0;
+		*sizep = ht->size;
+	}
+	for ( pos=*posp; pos<ht->size; pos++ ) {
+		if ( budget > 0 && Strgc_work >= budget ) {
+			*posp = pos;
+			return 0;
+		}
+		Strgc_work++;
+		for ( h=ht->nodetable[pos]; h!=NULL; h=h->next ) {
 			strmark_datum(h->key);
 			strmark_datum(h->val);
 		}
 	}
+	/* and then the elements in the vector */
+	for ( ; pos<ht->size+ht->densen; pos++ ) {
+		if ( budget > 0 && Strgc_work >= budget ) {
+			*posp = pos;
+			return 0;
+		}
+		Strgc_work++;
+		strmark_symbol(ht->dense[pos-ht->size]);	/* may be a hole */
+	}
+	return 1;
 }
 
 static void
@@ -2267,24 +3553,46 @@ strmark_dnodes(Dnode *dn)
 static void
 strmark_fifo(Fifo *f)
 {
-	Fifodata *fd;
-	long guard;
+	int n;
 
-	if ( f == NULL )
+	if ( f == NULL || f->ring == NULL )
 		return;
-	guard = 0;
-	for ( fd=f->tail; fd!=NULL && guard++ <= f->size+1; fd=fd->next )
-		strmark_datum(fd->d);
+	for ( n=0; n<f->size && n<f->ringsize; n++ )
+		strmark_datum(f->ring[(f->first+n)%f->ringsize]);
 }
 
 static void
 strmark_object(Kobjectp o)
 {
-	if ( o == NULL )
+	if ( o == NULL || o->strmark == Str_mark_generation )
 		return;
+	o->strmark = Str_mark_generation;
+	strgrey_push(STRGREY_OBJECT,(void *)o);
+}
+
+static void
+strscan_object(Kobjectp o)
+{
+	int n;
+
+	for ( n=0; n<o->shape->nslots; n++ ) {
+		Strgc_work++;
+		strmark_symbol(objslot(o,n));
+	}
 	strmark_htable(o->symbols);
 }
 
+/* Slot names are compared by pointer (see objfindsym()), so */
+/* the names in shapes must stay around. */
+static void
+strmark_shapes(void)
+{
+	Kshapep sh;
+
+	for ( sh=Topshape; sh!=NULL; sh=sh->next )
+		markstr(sh->name);
+}
+
 static void
 strmark_menu(Kmenu *km)
 {
@@ -2349,7 +3657,9 @@ strmark_task(Ktaskp t)
 	markstr(t->ontaskerrormsg);
 	markstr(t->filename);
 	markstr(t->method);
-	strmark_fifo(t->fifo);
+	/* t->fifo is only meaningful while the task is blocked */
+	if ( t->state == T_BLOCKED )
+		strmark_fifo(t->fifo);
 	strmark_object(t->obj);
 	strmark_object(t->realobj);
 }
@@ -2381,6 +3691,7 @@ strmark_datum(Datum d)
 		for ( guard=0; dp!=NULL && !isnoval(*dp)
 		  && guard<STRGC_DATUM_SCAN_LIMIT; guard++,dp++ )
 			strmark_datum(*dp);
+		Strgc_work += guard;
 		break;
 	case D_NOTE:
 		strmark_note(d.u.note);
@@ -2483,6 +3794,23 @@ strmark_global_strings(void)
 		markstr(Midioutputs[n].name);
 }
 
+/* Tasks and fifos are in tables, but their stacks, file names and */
+/* contents change without going through strgcbarrier(), so they're */
+/* marked directly whenever the roots are (including the atomic phase). */
+static int
+strmark_taskhn(Hnodep h)
+{
+	strmark_task(h->val.u.task);
+	return 0;
+}
+
+static int
+strmark_fifohn(Hnodep h)
+{
+	strmark_fifo(h->val.u.fifo);
+	return 0;
+}
+
 static void
 strmark_roots(void)
 {
@@ -2493,17 +3821,25 @@ strmark_roots(void)
 	Kwind *w;
 	Sched *sch;
 	Lknode *lk;
+	Runq *rq;
 	int n;
 
 	for ( ht=Topht; ht!=NULL; ht=ht->h_next )
 		strmark_htable(ht);
 	for ( ph=Topph; ph!=NULL; ph=ph->p_next )
 		strmark_phrase(ph);
-	for ( tp=Running; tp!=NULL; tp=tp->nextrun )
-		strmark_task(tp);
+	for ( rq=Toprunq; rq!=NULL; rq=rq->next ) {
+		for ( tp=rq->head; tp!=NULL; tp=tp->nextrun )
+			strmark_task(tp);
+	}
 	strmark_task(T);
+	if ( Tasktable != NULL )
+		hashvisit(Tasktable,strmark_taskhn);
+	if ( Fifotable != NULL )
+		hashvisit(Fifotable,strmark_fifohn);
 	for ( o=Topobj; o!=NULL; o=o->onext )
 		strmark_object(o);
+	strmark_shapes();
 	for ( w=Topwind; w!=NULL; w=w->next )
 		strmark_window(w);
 	for ( sch=Topsched; sch!=NULL; sch=sch->next ) {
@@ -2511,9 +3847,11 @@ strmark_roots(void)
 		strmark_note(sch->note);
 		strmark_task(sch->task);
 	}
-	for ( lk=Toplk; lk!=NULL; lk=lk->next ) {
-		markstr(lk->name);
-		strmark_task(lk->owner);
+	for ( n=0; n<Lktablesize; n++ ) {
+		for ( lk=Lktable[n]; lk!=NULL; lk=lk->next ) {
+			markstr(lk->name);
+			strmark_task(lk->owner);
+		}
 	}
 	for ( n=0; n<NFKEYS; n++ )
 		strmark_codeptr(Fkeyfunc[n],STRCODE_FUNCTION);
@@ -2548,59 +3886,276 @@ strgc_sample(Symstr s)
 	eprint("\"\n");
 }
 
-int
-strgcdryrun(int verbose)
+static void
+strgrey_push(int kind,void *p)
 {
-	int i;
-	unsigned long marked, markedbytes;
-	unsigned long unmarked, unmarkedbytes;
-	unsigned long quarantined, newlyquarantined;
-	unsigned long samplecount;
-	Strnodep h;
-	int ok;
+	Strgrey *ng;
+
+	if ( Strgreyn >= Strgreysize ) {
+		int newsize = (Strgreysize == 0) ? 256 : Strgreysize * 2;
+		ng = (Strgrey *) kmalloc(newsize*sizeof(Strgrey),"strgrey_push");
+		if ( Strgreyn > 0 )
+			memcpy(ng,Strgreys,Strgreyn*sizeof(Strgrey));
+		if ( Strgreys != NULL )
+			kfree(Strgreys);
+		Strgreys = ng;
+		Strgreysize = newsize;
+	}
+	ng = &Strgreys[Strgreyn++];
+	ng->kind = kind;
+	ng->pos = 0;
+	ng->size = 0;
+	ng->p = p;
+}
 
-	marked = 0;
-	markedbytes = 0;
-	unmarked = 0;
-	unmarkedbytes = 0;
-	quarantined = 0;
-	newlyquarantined = 0;
-	samplecount = 0;
-	strnext_generation();
-	strmark_roots();
-	if ( Strtab != NULL ) {
-		for ( i=0; i<Strtab->size; i++ ) {
-			for ( h=Strtab->buckets[i]; h!=NULL; h=h->next ) {
-				if ( h->hdr == NULL )
-					continue;
-				if ( h->hdr->mark == Str_mark_generation ) {
-					marked++;
-					markedbytes += h->hdr->len + 1;
-					continue;
-				}
-				unmarked++;
-				unmarkedbytes += h->hdr->len + 1;
-				if ( (h->hdr->flags & STRF_QUARANTINED) != 0 )
-					quarantined++;
-				else {
-					h->hdr->flags |= STRF_QUARANTINED;
-					newlyquarantined++;
-				}
-				if ( verbose && samplecount < STRGC_SAMPLE_LIMIT ) {
-					if ( samplecount == 0 )
-						eprint("string gc shadow samples:\n");
-					strgc_sample(h->str);
-					samplecount++;
-				}
+/* Something on the grey stack is going away. */
+static void
+strgrey_forget(void *p)
+{
+	int n;
+
+	for ( n=0; n<Strgreyn; n++ ) {
+		if ( Strgreys[n].p == p )
+			Strgreys[n].kind = STRGREY_NONE;
+	}
+}
+
+/* Scan grey things until there are none left, or the budget */
+/* runs out.  Returns 1 when the grey stack is empty. */
+static int
+strgc_drain(unsigned long budget)
+{
+	Strgrey g;
+
+	while ( Strgreyn > 0 ) {
+		if ( budget > 0 && Strgc_work >= budget )
+			return 0;
+		/* Scanning may push more, so copy it off the stack first */
+		g = Strgreys[--Strgreyn];
+		switch ( g.kind ) {
+		case STRGREY_HTABLE:
+			if ( ! strscan_htable((Htablep)(g.p),&g.pos,&g.size,budget) ) {
+				strgrey_push(g.kind,g.p);
+				Strgreys[Strgreyn-1].pos = g.pos;
+				Strgreys[Strgreyn-1].size = g.size;
+				return 0;
 			}
+			break;
+		case STRGREY_CODE:
+			strscan_codeblock((Strcode *)(g.p));
+			break;
+		case STRGREY_PHRASE:
+			strscan_phrase((Phrasep)(g.p));
+			break;
+		case STRGREY_OBJECT:
+			strscan_object((Kobjectp)(g.p));
+			break;
+		default:
+			break;
+		}
+	}
+	return 1;
+}
+
+static void
+strgc_begin(void)
+{
+	strnext_generation();
+	Strgreyn = 0;
+	Strgc_sweeppos = 0;
+	Strgc_tsweeppos = 0;
+	Strgc_freed = 0;
+	Strgc_marked = Strgc_markedbytes = 0;
+	Strgc_unmarked = Strgc_unmarkedbytes = 0;
+	Strgc_quarantined = Strgc_newlyquarantined = 0;
+	Strgc_samplecount = 0;
+	Strgc_newsince = 0;
+	Strgc_phase = STRGC_MARK;
+	Strgcmarking = 1;
+	Strgcpending = 1;
+	strmark_roots();
+}
+
+/* Quarantine the unmarked strings in the buckets from */
+/* Strgc_sweeppos on, until the budget runs out. */
+static int
+strgc_sweep(unsigned long budget)
+{
+	Strnodep h;
+
+	if ( Strtab == NULL )
+		return 1;
+	for ( ; Strgc_sweeppos<Strtab->size; Strgc_sweeppos++ ) {
+		if ( budget > 0 && Strgc_work >= budget )
+			return 0;
+		Strgc_work++;
+		for ( h=Strtab->buckets[Strgc_sweeppos]; h!=NULL; h=h->next ) {
+			if ( h->hdr == NULL )
+				continue;
+			Strgc_work++;
+			if ( h->hdr->mark == Str_mark_generation ) {
+				Strgc_marked++;
+				Strgc_markedbytes += h->hdr->len + 1;
+				continue;
+			}
+			Strgc_unmarked++;
+			Strgc_unmarkedbytes += h->hdr->len + 1;
+			if ( (h->hdr->flags & STRF_QUARANTINED) != 0 )
+				Strgc_quarantined++;
+			else {
+				h->hdr->flags |= STRF_QUARANTINED;
+				Strgc_newlyquarantined++;
+			}
+			if ( Strgc_verbose && Strgc_samplecount < STRGC_SAMPLE_LIMIT ) {
+				if ( Strgc_samplecount == 0 )
+					eprint("string gc shadow samples:\n");
+				strgc_sample(h->str);
+				Strgc_samplecount++;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Free the transient strings that were unmarked in the last */
+/* cycle as well as this one, and quarantine the other unmarked ones. */
+static int
+strgc_tsweep(unsigned long budget)
+{
+	Strhdr *hdr, **pp;
+
+	for ( ; Strgc_tsweeppos<Strtranssize; Strgc_tsweeppos++ ) {
+		if ( budget > 0 && Strgc_work >= budget )
+			return 0;
+		Strgc_work++;
+		pp = &Strtrans[Strgc_tsweeppos];
+		while ( (hdr=(*pp)) != NULL ) {
+			Strgc_work++;
+			if ( hdr->mark == Str_mark_generation ) {
+				Strgc_marked++;
+				Strgc_markedbytes += hdr->len + 1;
+				pp = &(hdr->tnext);
+				continue;
+			}
+			Strgc_unmarked++;
+			Strgc_unmarkedbytes += hdr->len + 1;
+			if ( (hdr->flags & STRF_QUARANTINED) == 0 ) {
+				hdr->flags |= STRF_QUARANTINED;
+				Strgc_newlyquarantined++;
+				pp = &(hdr->tnext);
+				continue;
+			}
+			*pp = hdr->tnext;
+			Strtranscount--;
+			Strtrans_bytes -= sizeof(Strhdr) + hdr->len;
+			Strtrans_freed++;
+			Strtrans_freedbytes += hdr->len + 1;
+			Strgc_freed++;
+			hdr->magic = 0;
+			kfree(hdr);
+		}
+	}
+	return 1;
+}
+
+/* Do up to 'budget' units of work (0 means no limit) on */
+/* the current cycle. */
+static void
+strgc_step(unsigned long budget)
+{
+	long t0, pause;
+
+	Strgc_work = 0;
+	if ( Strgc_phase == STRGC_MARK ) {
+		if ( ! strgc_drain(budget) )
+			return;
+		/* Atomic phase - the roots may have changed since */
+		/* they were first scanned, so do them again. */
+		t0 = MILLICLOCK;
+		strmark_roots();
+		(void) strgc_drain(0);
+		pause = MILLICLOCK - t0;
+		if ( pause > Strgc_maxatomic )
+			Strgc_maxatomic = pause;
+		Strgc_phase = STRGC_SWEEP;
+		Strgcmarking = 0;
+		/* The sweep walks the buckets by position, so finish */
+		/* any growth now; none is started during the sweep. */
+		strtab_finishrehash();
+	}
+	if ( Strgc_phase == STRGC_SWEEP ) {
+		if ( ! strgc_sweep(budget) )
+			return;
+		if ( ! strgc_tsweep(budget) )
+			return;
+		Strgc_phase = STRGC_IDLE;
+		Strgcpending = 0;
+		Strgc_cycles++;
+	}
+}
+
+/* Called from exectasks() when Strgcpending is set. */
+void
+strgcslice(void)
+{
+	long start, pause;
+
+	start = MILLICLOCK;
+	if ( Strgc_phase == STRGC_IDLE ) {
+		if ( *Strgcslice <= 0 ) {
+			Strgcpending = 0;
+			return;
 		}
+		strgc_begin();
 	}
+	/* If Strgcslice has been set to 0, the cycle is just finished */
+	strgc_step((unsigned long)(*Strgcslice > 0 ? *Strgcslice : 0));
+	pause = MILLICLOCK - start;
+
+	Strgc_slices++;
+	Strgc_totalwork += Strgc_work;
+	Strgc_lastpause = pause;
+	Strgc_totalpause += pause;
+	if ( pause > Strgc_maxpause )
+		Strgc_maxpause = pause;
+}
+
+/* Write barrier, see strgcbarrier() in key.h */
+void
+strgcshade(Datum d)
+{
+	Strgc_barriers++;
+	strmark_datum(d);
+}
+
+/* New tables are shaded, since they may not be reachable */
+/* from the roots that have already been scanned. */
+void
+strgcnewht(Htablep ht)
+{
+	if ( Strgc_phase == STRGC_MARK )
+		strmark_htable(ht);
+}
+
+int
+strgcdryrun(int verbose)
+{
+	int ok;
+
+	/* Do a complete cycle right now.  Any cycle in */
+	/* progress is abandoned and started over. */
+	Strgc_verbose = verbose;
+	strgc_begin();
+	strgc_step(0);
+	Strgc_verbose = 0;
+	Strgc_totalwork += Strgc_work;
+
 	ok = strtabcheck();
 	if ( ! ok || verbose ) {
-		eprint("string gc shadow: marked=%lu marked_bytes=%lu unmarked=%lu unmarked_bytes=%lu actual_free=0 generation=%u\n",
-			marked,markedbytes,unmarked,unmarkedbytes,(unsigned int)Str_mark_generation);
+		eprint("string gc shadow: marked=%lu marked_bytes=%lu unmarked=%lu unmarked_bytes=%lu actual_free=%lu generation=%u\n",
+			Strgc_marked,Strgc_markedbytes,Strgc_unmarked,Strgc_unmarkedbytes,Strgc_freed,(unsigned int)Str_mark_generation);
 		eprint("string gc quarantine: already=%lu newly=%lu lookup_rescues=%lu mark_rescues=%lu\n",
-			quarantined,newlyquarantined,Str_quarantine_lookups,Str_quarantine_marks);
+			Strgc_quarantined,Strgc_newlyquarantined,Str_quarantine_lookups,Str_quarantine_marks);
 		if ( verbose )
 			strstatsprint();
 	}
@@ -2629,33 +4184,110 @@ isundefd(Symbolp s)
  *     H_DELETE ==> look for and delete
  */
 
-Hnodep
-hashtable(Htablep ht,Datum key,int action)
-{
-	Hnodepp table;
-	Hnodep h, toph, prev;
-	int v, nc;
-
-	table = ht->nodetable;
+/*
+ * Hash tables grow (doubling, and staying odd) when they average
+ * more than HT_LOAD elements per bucket.  The chains are moved over
+ * to the new buckets a few at a time, on each hashtable() call.
+ * Anything that walks all the buckets calls htfinishrehash() first.
+ */
+#define HT_LOAD 2
+#define HT_REHASHSTEP 4
 
+static unsigned int
+hthash(Datum key)
+{
 	/* base the hash value on the 'uniqstr'ed pointer */
 	switch ( key.type ) {
 	case D_NUM:
-		v = ((unsigned int)(key.u.val)) % (ht->size);
-		break;
+		return (unsigned int)(key.u.val);
 	case D_STR:
-		v = ((intptr_t)(key.u.str)>>2) % (ht->size);
-		break;
+		return (unsigned int)((intptr_t)(key.u.str)>>2);
 	case D_OBJ:
-		v = ((unsigned int)(key.u.obj->id)>>2) % (ht->size);
-		break;
+		return ((unsigned int)(key.u.obj->id)>>2);
 	default:
 		execerror("hashtable isn't prepared for that key.type");
 		break;
 	}
+	return 0;
+}
+
+/* Move up to n chains from the old buckets to the new ones */
+static void
+htrehash(Htablep ht,int n)
+{
+	Hnodep h, nxt;
+	Hnodepp bp;
+
+	while ( ht->oldtable != NULL && n-- > 0 ) {
+		for ( h=ht->oldtable[ht->rehashpos]; h!=NULL; h=nxt ) {
+			nxt = h->next;
+			bp = &(ht->nodetable[hthash(h->key) % ht->size]);
+			h->next = *bp;
+			*bp = h;
+		}
+		ht->oldtable[ht->rehashpos] = NULL;
+		if ( ++(ht->rehashpos) >= ht->oldsize ) {
+			kfree(ht->oldtable);
+			ht->oldtable = NULL;
+			ht->oldsize = 0;
+			ht->rehashpos = 0;
+		}
+	}
+}
+
+void
+htfinishrehash(Htablep ht)
+{
+	if ( ht->oldtable != NULL )
+		htrehash(ht,ht->oldsize);
+}
+
+static void
+htgrow(Htablep ht)
+{
+	int newsize = ht->size * 2 + 1;
+
+	ht->oldtable = ht->nodetable;
+	ht->oldsize = ht->size;
+	ht->rehashpos = 0;
+	ht->nodetable = (Hnodepp) kmalloc(newsize*sizeof(Hnodep),"newht");
+	memset(ht->nodetable,0,newsize*sizeof(Hnodep));
+	ht->size = newsize;
+}
+
+/* Find the bucket for a key.  Chains that haven't been */
+/* rehashed yet are still in the old buckets. */
+static Hnodepp
+htbucket(Htablep ht,Datum key)
+{
+	unsigned int hv = hthash(key);
+	int v;
+
+	if ( ht->oldtable != NULL ) {
+		v = hv % ht->oldsize;
+		if ( v >= ht->rehashpos )
+			return &(ht->oldtable[v]);
+	}
+	return &(ht->nodetable[hv % ht->size]);
+}
+
+Hnodep
+hashtable(Htablep ht,Datum key,int action)
+{
+	Hnodepp bp;
+	Hnodep h, toph, prev;
+
+	if ( ht->oldtable != NULL )
+		htrehash(ht,HT_REHASHSTEP);
+
+	/* String keys are hashed by address, so they have to be interned */
+	if ( key.type == D_STR )
+		key.u.str = strintern(key.u.str);
+
+	bp = htbucket(ht,key);
 
 	/* look in hash table of existing elements */
-	toph = table[v];
+	toph = *bp;
 	if ( toph != NULL ) {
 
 		/* collision */
@@ -2665,7 +4297,8 @@ hashtable(Htablep ht,Datum key,int action)
 			if ( action != H_DELETE )
 				return(toph);
 			/* delete from list and free */
-			table[v] = toph->next;
+			htchanged(ht);
+			*bp = toph->next;
 			freehn(toph);
 			ht->count--;
 			return(NULL);
@@ -2673,9 +4306,7 @@ hashtable(Htablep ht,Datum key,int action)
 
 		/* Look through entire list */
 		h = toph;
-		nc = 0;
 		for ( prev=h; ((h=h->next) != NULL); prev=h ) {
-			nc++;
 			if ( dcompare(key,h->key) == 0 ) {
 				break;
 			}
@@ -2687,13 +4318,14 @@ hashtable(Htablep ht,Datum key,int action)
 			prev->next = h->next;
 			if ( action == H_DELETE ) {
 				/* delete it */
+				htchanged(ht);
 				freehn(h);
 				ht->count--;
 				return(NULL);
 			}
 			/* move it to the top of the collision list */
 			h->next = toph;
-			table[v] = h;
+			*bp = h;
 			return(h);
 		}
 	}
@@ -2706,6 +4338,7 @@ hashtable(Htablep ht,Datum key,int action)
 	if ( action == H_LOOK )
 		return(NULL);
 
+	htchanged(ht);
 	h = newhn();
 	h->key = key;
 	h->val = Noval;
@@ -2713,11 +4346,126 @@ hashtable(Htablep ht,Datum key,int action)
 
 	/* Add to top of collision list */
 	h->next = toph;
-	table[v] = h;
+	*bp = h;
+
+	if ( HTHASHCOUNT(ht) > ht->size * HT_LOAD
+			&& ht->oldtable == NULL && ht->h_visiting == 0 )
+		htgrow(ht);
 
 	return(h);
 }
 
+/*
+ * Array elements 0..densen-1 are kept in a vector of Symbol pointers
+ * (Htable.dense) rather than in Hnodes, so the usual case of arrays
+ * indexed from 0 up doesn't need any hashing.  Other keys go in the
+ * hash buckets.  An element is appended to the vector when its index
+ * is densen, and any following elements that were put in the hash
+ * buckets earlier are moved over.  Deleting an element in the middle
+ * of the vector leaves a hole (a NULL entry) that re-inserting it
+ * fills in; the last entry is never a hole.  Only when holes make up
+ * more than half of the vector are the elements after the first hole
+ * moved into the hash buckets, so deleting and re-inserting costs O(1)
+ * (amortized) wherever the element is.
+ */
+
+#define HT_MINHOLES 8
+
+static void
+htappenddense(Htablep ht,Symbolp s)
+{
+	Symbolp *nd;
+
+	if ( ht->densen >= ht->densesize ) {
+		int newsize = (ht->densesize == 0) ? 8 : ht->densesize * 2;
+		nd = (Symbolp *) kmalloc(newsize*sizeof(Symbolp),"htappenddense");
+		if ( ht->densen > 0 )
+			memcpy(nd,ht->dense,ht->densen*sizeof(Symbolp));
+		if ( ht->dense != NULL )
+			kfree(ht->dense);
+		ht->dense = nd;
+		ht->densesize = newsize;
+	}
+	ht->dense[ht->densen++] = s;
+	htchanged(ht);
+}
+
+/* Remove an element from the hash buckets, without freeing */
+/* its Symbol, which is returned. */
+static Symbolp
+htunlinksym(Htablep ht,Datum key)
+{
+	Hnodepp bp;
+	Hnodep h;
+	Symbolp s;
+
+	for ( bp=htbucket(ht,key); (h=(*bp)) != NULL; bp=&(h->next) ) {
+		if ( dcompare(key,h->key) == 0 )
+			break;
+	}
+	if ( h == NULL )
+		return NULL;
+	*bp = h->next;
+	s = h->val.u.sym;
+	h->val = Noval;
+	h->next = Free_hn;
+	Free_hn = h;
+	ht->count--;
+	return s;
+}
+
+/* Drop any holes at the end of the vector */
+static void
+htdensetrim(Htablep ht)
+{
+	while ( ht->densen > 0 && ht->dense[ht->densen-1] == NULL ) {
+		ht->densen--;
+		ht->denseholes--;
+	}
+}
+
+/* Move the elements after the first hole in the */
+/* vector into the hash buckets, leaving no holes. */
+static void
+htspilldense(Htablep ht)
+{
+	Symbolp ns;
+	Hnodep h;
+	int first;
+
+	for ( first=0; first<ht->densen; first++ ) {
+		if ( ht->dense[first] == NULL )
+			break;
+	}
+	while ( ht->densen > first ) {
+		ns = ht->dense[--(ht->densen)];
+		if ( ns == NULL ) {
+			ht->denseholes--;
+			continue;
+		}
+		h = hashtable(ht,ns->name,H_INSERT);
+		h->val = symdatum(ns);
+		ht->count--;	/* it was already counted */
+	}
+}
+
+/* Free the last element of the vector, returns 0 if there wasn't one */
+int
+htpopdense(Htablep ht)
+{
+	Symbolp s;
+
+	if ( ht->densen <= 0 )
+		return 0;
+	s = ht->dense[--(ht->densen)];
+	htdensetrim(ht);
+	ht->count--;
+	htchanged(ht);
+	clearsym(s);
+	freesy(s);
+	return 1;
+}
+
 /*
  * Look for the symbol for a particular array element, given
  * a pointer to the main array symbol, and the subscript value.
@@ -2734,24 +4482,68 @@ arraysym(Htablep arr,Datum subs,int action)
 	Symbolp ns;
 	Hnodep h;
 	Datum key;
+	long v = -1;
 
 	if ( arr == NULL )
 		execerror("Internal error: arr==0 in arraysym!?");
 
 	key = dtoindex(subs);
+	if ( key.type == D_NUM && key.u.val >= 0 && key.u.val <= arr->densen )
+		v = key.u.val;
 
 	switch (action) {
 	case H_LOOK:
+		if ( v >= 0 && v < arr->densen )
+			return arr->dense[v];	/* NULL if it's a hole */
+		if ( HTHASHCOUNT(arr) == 0 )
+			return NULL;	/* nothing in the hash buckets */
 		h = hashtable(arr,key,action);
 		if ( h )
 			s = h->val.u.sym;
 		break;
 	case H_INSERT:
+		if ( v >= 0 && v < arr->densen ) {
+			if ( arr->dense[v] == NULL ) {
+				/* Fill in a hole */
+				s = newsy();
+				s->name = key;
+				s->stype = VAR;
+				*symdataptr(s) = strdatum(Nullstr);
+				arr->dense[v] = s;
+				arr->denseholes--;
+				arr->count++;
+				htchanged(arr);
+			}
+			return arr->dense[v];
+		}
+		if ( v == arr->densen ) {
+			/* It may have been put in the hash buckets earlier */
+			if ( HTHASHCOUNT(arr) > 0 )
+				s = htunlinksym(arr,key);
+			if ( s == NULL ) {
+				/* New element, initialized to null string */
+				s = newsy();
+				s->name = key;
+				s->stype = VAR;
+				*symdataptr(s) = strdatum(Nullstr);
+			}
+			htappenddense(arr,s);
+			arr->count++;
+			/* pick up any following elements */
+			while ( HTHASHCOUNT(arr) > 0 ) {
+				ns = htunlinksym(arr,numdatum((long)(arr->densen)));
+				if ( ns == NULL )
+					break;
+				htappenddense(arr,ns);
+				arr->count++;
+			}
+			break;
+		}
 		h = hashtable(arr,key,action);
 		if ( isnoval(h->val) ) {
 			/* New element, initialized to null string */
 			ns = newsy();
-			ns->name = key;
+			ns->name = h->key;
 			ns->stype = VAR;
 			*symdataptr(ns) = strdatum(Nullstr);
 			h->val = symdatum(ns);
@@ -2759,7 +4551,26 @@ arraysym(Htablep arr,Datum subs,int action)
 		s = h->val.u.sym;
 		break;
 	case H_DELETE:
-		(void) hashtable(arr,key,action);
+		if ( v >= 0 && v < arr->densen ) {
+			if ( v == arr->densen-1 ) {
+				(void) htpopdense(arr);
+				break;
+			}
+			if ( (ns=arr->dense[v]) == NULL )
+				break;
+			arr->dense[v] = NULL;
+			arr->denseholes++;
+			arr->count--;
+			htchanged(arr);
+			clearsym(ns);
+			freesy(ns);
+			if ( arr->denseholes > HT_MINHOLES
+					&& arr->denseholes > arr->densen/2 )
+				htspilldense(arr);
+			break;
+		}
+		if ( HTHASHCOUNT(arr) > 0 )
+			(void) hashtable(arr,key,action);
 		break;
 	default:
 		execerror("Internal error: bad action in arraysym!?");
@@ -2779,86 +4590,260 @@ dtcmp(Datum *d1,Datum *d2)
 	return dcompare(*d1,*d2);
 }
 
-static int elsize;	/* element size */
-static INTFUNC2P qscompare;
-
 /*
- * Quick Sort routine.
- * Code by Duane Morse (...!noao!terak!anasazi!duane)
- * Based on Knuth's ART OF COMPUTER PROGRAMMING, VOL III, pp 114-117.
+ * Sorting of array index lists.  Lists of all numbers are sorted
+ * with an introsort, and lists of all strings with a radix sort on
+ * the bytes (the same order as strcmp).  Anything else is merge
+ * sorted using dcompare().
  */
+#define SORT_SMALL 16
+
+static void
+numinsertsort(Datum *v,int n)
+{
+	int i, j;
+	Datum t;
+
+	for ( i=1; i<n; i++ ) {
+		t = v[i];
+		for ( j=i; j>0 && v[j-1].u.val > t.u.val; j-- )
+			v[j] = v[j-1];
+		v[j] = t;
+	}
+}
 
-/* Exchange the contents of two vectors.  n is the size of vectors in bytes. */
 static void
-memexch(register unsigned char *s1,register unsigned char *s2,register int n)
+numsiftdown(Datum *v,int root,int n)
 {
-	register unsigned char c;
-	while (n--) {
-		c = *s1;
-		*s1++ = *s2;
-		*s2++ = c;
+	int child;
+	Datum t;
+
+	t = v[root];
+	while ( (child=2*root+1) < n ) {
+		if ( child+1 < n && v[child+1].u.val > v[child].u.val )
+			child++;
+		if ( t.u.val >= v[child].u.val )
+			break;
+		v[root] = v[child];
+		root = child;
 	}
+	v[root] = t;
 }
 
 static void
-mysort(unsigned char *vec,int nel)
+numheapsort(Datum *v,int n)
 {
-	register short i, j;
-	register unsigned char *iptr, *jptr, *kptr;
+	int i;
+	Datum t;
 
-begin:
-	if (nel == 2) {	/* If 2 items, check them by hand. */
-		if ((*qscompare)(vec, vec + elsize) > 0)
-			memexch(vec, vec + elsize, elsize);
-		return;
+	for ( i=n/2-1; i>=0; i-- )
+		numsiftdown(v,i,n);
+	for ( i=n-1; i>0; i-- ) {
+		t = v[0]; v[0] = v[i]; v[i] = t;
+		numsiftdown(v,0,i);
 	}
-	j = (short) nel;
-	i = 0;
-	kptr = vec;
-	iptr = vec;
-	jptr = vec + elsize * nel;
-	while (--j > i) {
-
-		/* From the righthand side, find first value */
-		/* that should be to the left of k. */
-		jptr -= elsize;
-		if ((*qscompare)(jptr, kptr) > 0)
-			continue;
+}
 
-		/* Now from the lefthand side, find first value */
-		/* that should be to right of k. */
+static void
+numintrosort(Datum *v,int n,int depth)
+{
+	int i, j;
+	long a, b, c, pivot;
+	Datum t;
+
+	while ( n > SORT_SMALL ) {
+		if ( depth-- <= 0 ) {
+			/* quicksort is going badly, heapsort is never bad */
+			numheapsort(v,n);
+			return;
+		}
+		/* median of three */
+		a = v[0].u.val;
+		b = v[n/2].u.val;
+		c = v[n-1].u.val;
+		if ( a > b ) { long x = a; a = b; b = x; }
+		if ( b > c ) b = c;
+		pivot = (a > b) ? a : b;
+
+		i = -1;
+		j = n;
+		for ( ;; ) {
+			while ( v[++i].u.val < pivot )
+				;
+			while ( v[--j].u.val > pivot )
+				;
+			if ( i >= j )
+				break;
+			t = v[i]; v[i] = v[j]; v[j] = t;
+		}
+		/* recurse on the smaller part, loop on the larger */
+		j++;
+		if ( j < n - j ) {
+			numintrosort(v,j,depth);
+			v += j;
+			n -= j;
+		}
+		else {
+			numintrosort(v+j,n-j,depth);
+			n = j;
+		}
+	}
+	numinsertsort(v,n);
+}
 
-		iptr += elsize;
-		while(++i < j && (*qscompare)(iptr, kptr) <= 0)
-			iptr += elsize;
+static void
+strinsertsort(Datum *v,int n,int depth)
+{
+	int i, j;
+	Datum t;
+
+	for ( i=1; i<n; i++ ) {
+		t = v[i];
+		for ( j=i; j>0 && strcmp(v[j-1].u.str+depth,t.u.str+depth) > 0; j-- )
+			v[j] = v[j-1];
+		v[j] = t;
+	}
+}
 
-		if (i >= j)
-			break;
+/* Bucket counts for each level of strradixsort(), kept off the stack */
+#define SORT_MAXDEPTH 64
+static int Sortcounts[SORT_MAXDEPTH][257];
 
-		/* Exchange the two items; k will eventually end up between them. */
-		memexch(jptr, iptr, elsize);
+/* Bottom-up merge sort on the bytes from 'depth' on, for strings */
+/* with a common prefix too long for strradixsort() */
+static void
+strmergesort(Datum *v,Datum *tmp,int n,int depth)
+{
+	int width, lo, mid, hi, i, j, k;
+
+	for ( width=1; width<n; width*=2 ) {
+		for ( lo=0; lo<n; lo+=2*width ) {
+			mid = (lo+width < n) ? lo+width : n;
+			hi = (lo+2*width < n) ? lo+2*width : n;
+			i = lo; j = mid; k = lo;
+			while ( i < mid && j < hi ) {
+				if ( strcmp(v[j].u.str+depth,v[i].u.str+depth) < 0 )
+					tmp[k++] = v[j++];
+				else
+					tmp[k++] = v[i++];
+			}
+			while ( i < mid )
+				tmp[k++] = v[i++];
+			while ( j < hi )
+				tmp[k++] = v[j++];
+		}
+		memcpy(v,tmp,n*sizeof(Datum));
 	}
-	/* Move item 0 into position.  */
-	memexch(vec, iptr, elsize);
-	/* Now sort the two partitions. */
-	if ((nel -= (i + 1)) > 1)
-		mysort(iptr + elsize, nel);
+}
 
-	/* To save a little time, just start the routine over by hand. */
-	if (i > 1) {
-		nel = i;
-		goto begin;
+/* MSD radix sort, on the byte at 'depth' of each string. */
+/* All the strings are known to be the same before 'depth'. */
+/* It recurses on all but the largest bucket and loops on that one, */
+/* so 'level' (the recursion depth) stays below log2(n), and past */
+/* SORT_MAXDEPTH bytes it gives up and compares the rest. */
+static void
+strradixsort(Datum *v,Datum *tmp,int n,int depth,int level)
+{
+	int *count;
+	int i, c, start, bigc, bigstart, bign;
+
+	while ( n > SORT_SMALL ) {
+		if ( depth >= SORT_MAXDEPTH || level >= SORT_MAXDEPTH ) {
+			strmergesort(v,tmp,n,depth);
+			return;
+		}
+		count = Sortcounts[level];
+		/* bucket 0 is for strings that end here */
+		memset(count,0,257*sizeof(int));
+		for ( i=0; i<n; i++ )
+			count[(Unchar)(v[i].u.str[depth]) + (v[i].u.str[depth]?1:0)]++;
+		for ( start=0,c=0; c<257; c++ ) {
+			int k = count[c];
+			count[c] = start;
+			start += k;
+		}
+		for ( i=0; i<n; i++ ) {
+			c = (Unchar)(v[i].u.str[depth]) + (v[i].u.str[depth]?1:0);
+			tmp[count[c]++] = v[i];
+		}
+		memcpy(v,tmp,n*sizeof(Datum));
+		/* count[c] is now the end of bucket c */
+		bigc = 0;
+		bigstart = bign = 0;
+		for ( start=count[0],c=1; c<257; c++ ) {
+			if ( count[c] - start > bign ) {
+				bigc = c;
+				bigstart = start;
+				bign = count[c] - start;
+			}
+			start = count[c];
+		}
+		for ( start=count[0],c=1; c<257; c++ ) {
+			if ( c != bigc && count[c] - start > 1 )
+				strradixsort(v+start,tmp,count[c]-start,depth+1,level+1);
+			start = count[c];
+		}
+		v += bigstart;
+		n = bign;
+		depth++;
 	}
+	if ( n > 1 )
+		strinsertsort(v,n,depth);
 }
 
+/* Bottom-up merge sort, for lists of mixed types */
 static void
-pqsort(unsigned char *vec,int nel,int esize,INTFUNC2P compptr)
+gensort(Datum *v,Datum *tmp,int n)
 {
-	if (nel < 2)
+	int width, lo, mid, hi, i, j, k;
+
+	for ( width=1; width<n; width*=2 ) {
+		for ( lo=0; lo<n; lo+=2*width ) {
+			mid = (lo+width < n) ? lo+width : n;
+			hi = (lo+2*width < n) ? lo+2*width : n;
+			i = lo; j = mid; k = lo;
+			while ( i < mid && j < hi ) {
+				if ( dcompare(v[j],v[i]) < 0 )
+					tmp[k++] = v[j++];
+				else
+					tmp[k++] = v[i++];
+			}
+			while ( i < mid )
+				tmp[k++] = v[i++];
+			while ( j < hi )
+				tmp[k++] = v[j++];
+		}
+		memcpy(v,tmp,n*sizeof(Datum));
+	}
+}
+
+static void
+sortkeys(Datum *v,int n)
+{
+	int i, nnum, nstr, depth;
+	Datum *tmp;
+
+	if ( n < 2 )
+		return;
+	nnum = nstr = 0;
+	for ( i=0; i<n; i++ ) {
+		if ( v[i].type == D_NUM )
+			nnum++;
+		else if ( v[i].type == D_STR )
+			nstr++;
+	}
+	if ( nnum == n ) {
+		for ( depth=0,i=n; i>0; i>>=1 )
+			depth += 2;
+		numintrosort(v,n,depth);
 		return;
-	elsize = esize;
-	qscompare = compptr;
-	mysort(vec, nel);
+	}
+	tmp = (Datum *) kmalloc(n*sizeof(Datum),"sortkeys");
+	if ( nstr == n )
+		strradixsort(v,tmp,n,0,0);
+	else
+		gensort(v,tmp,n);
+	kfree(tmp);
 }
 
 /* Return a Noval-terminated list of the index values of an array.  */
@@ -2870,42 +4855,104 @@ arrlist(Htablep arr,int *asize,int sortit)
 	register Datum *lp;
 	register int hsize;
 	Datum *list;
+	int n;
 
-	pp = arr->nodetable;
-	hsize = arr->size;
 	*asize = arrsize(arr);
 	list = (Datum *) kmalloc((*asize+1)*sizeof(Datum),"arrlist");
+	if ( sortit && arr->sorted != NULL ) {
+		memcpy(list,arr->sorted,(*asize+1)*sizeof(Datum));
+		return(list);
+	}
+
+	htfinishrehash(arr);
+	pp = arr->nodetable;
+	hsize = arr->size;
 
 	lp = list;
+	for ( n=0; n<arr->densen; n++ ) {
+		if ( arr->dense[n] != NULL )
+			*lp++ = arr->dense[n]->name;
+	}
 	/* visit each slot in the hash table */
-	while ( hsize-- > 0 ) {
-		/* and traverse its list */
-		for ( h=(*pp++); h!=NULL; h=h->next ) {
-			*lp++ = h->val.u.sym->name;
+	if ( HTHASHCOUNT(arr) > 0 ) {
+		while ( hsize-- > 0 ) {
+			/* and traverse its list */
+			for ( h=(*pp++); h!=NULL; h=h->next ) {
+				*lp++ = h->val.u.sym->name;
+			}
 		}
 	}
 	*lp++ = Noval;
-	if ( sortit )
-		pqsort((unsigned char *)list,*asize,(int)sizeof(Datum),(INTFUNC2P)dtcmp);
+	/* The elements in the vector are already in order */
+	if ( sortit && HTHASHCOUNT(arr) > 0 ) {
+		sortkeys(list,*asize);
+		/* Keep a copy, until the array changes */
+		arr->sorted = (Datum *) kmalloc((*asize+1)*sizeof(Datum),"arrlist");
+		memcpy(arr->sorted,list,(*asize+1)*sizeof(Datum));
+	}
 	return(list);
 }
 
+/* Tables with a hashvisit() in progress, so that an error */
+/* (which longjmps out of the visit) can clear h_visiting. */
+static Htablep *Htvisits = NULL;
+static int Htvisitn = 0;
+static int Htvisitsize = 0;
+
 void
 hashvisit(Htablep arr,HNODEFUNC f)
 {
 	register Hnodepp pp;
 	register Hnodep h;
 	register int hsize;
+	int n;
 
+	htfinishrehash(arr);
 	pp = arr->nodetable;
 	hsize = arr->size;
+	/* The table mustn't grow under us, in case f adds to it */
+	arr->h_visiting++;
+	if ( Htvisitn >= Htvisitsize ) {
+		Htablep *nv;
+		int newsize = (Htvisitsize==0) ? 16 : Htvisitsize*2;
+		nv = (Htablep *) kmalloc(newsize*sizeof(Htablep),"hashvisit");
+		if ( Htvisitn > 0 )
+			memcpy(nv,Htvisits,Htvisitn*sizeof(Htablep));
+		if ( Htvisits != NULL )
+			kfree(Htvisits);
+		Htvisits = nv;
+		Htvisitsize = newsize;
+	}
+	Htvisits[Htvisitn++] = arr;
+	/* Elements in the vector are passed as temporary Hnodes */
+	for ( n=0; n<arr->densen; n++ ) {
+		Hnode tmp;
+		if ( arr->dense[n] == NULL )
+			continue;
+		tmp.next = NULL;
+		tmp.key = arr->dense[n]->name;
+		tmp.val = symdatum(arr->dense[n]);
+		if ( (*f)(&tmp) )
+			goto getout;
+	}
 	/* visit each slot in the hash table */
 	while ( hsize-- > 0 ) {
 		/* and traverse its list */
 		for ( h=(*pp++); h!=NULL; h=h->next ) {
 			if ( (*f)(h) )
-				return;	/* used to be break, apparent mistake */
+				goto getout;	/* used to be break, apparent mistake */
 		}
 	}
+    getout:
+	arr->h_visiting--;
+	Htvisitn--;
+}
+
+/* Called when an error abandons any visits in progress */
+void
+hashvisitreset(void)
+{
+	while ( Htvisitn > 0 )
+		Htvisits[--Htvisitn]->h_visiting = 0;
 }
 
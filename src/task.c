@@ -14,7 +14,13 @@
 Codep Ipop, Idosweep, Ireboot;
 
 Ktaskp T;		/* currently-active task */
-Ktaskp Running = NULL;	/* list of runnable tasks */
+Ktaskp Running = NULL;	/* first runnable task, of the highest priority */
+
+/* Runnable tasks are queued by priority.  The queues that have any */
+/* tasks are linked, highest priority first, starting at Toprunq, */
+/* so exectasks() only looks at the tasks it's going to run. */
+static Runq Runqs[MAXPRIORITY+1];
+Runq *Toprunq = NULL;
 
 int Currpriority = DEFPRIORITY; /* current priority level, tasks lower */
 				/* than this do not run. */
@@ -162,6 +168,7 @@ void
 restartexec(void)
 NO_RETURN_ATTRIBUTE
 {
+	hashvisitreset();
 	longjmp(Begin,1);
 	/*NOTREACHED*/
 }
@@ -239,11 +246,11 @@ checkports(void)
 			f0 = getafifo();
 			f0->flags = FIFO_OPEN | FIFO_ISPORT | FIFO_READ;
 			f0->fifoctl_type = Default_fifotype;
-			f0->port = *php++;
+			setfifoport(f0,*php++);
 			f1 = getafifo();
 			f1->flags = FIFO_OPEN | FIFO_ISPORT | FIFO_WRITE;
 			f1->fifoctl_type = Default_fifotype;
-			f1->port = *php;
+			setfifoport(f1,*php);
 			da = newarrdatum(0,3);
 			setarraydata(da.u.arr,Str_r,numdatum(fifonum(f0)));
 			setarraydata(da.u.arr,Str_w,numdatum(fifonum(f1)));
@@ -266,6 +273,9 @@ checkports(void)
 				}
 			}
 			break;
+		case FIFOTYPE_BLOCK:
+			putfifo(f,bytesdatum(buff,sz));
+			break;
 		case FIFOTYPE_ARRAY:
 			if ( isnoval(ddata) ) {
 				eprint("Noval in mdep_getportdata for ARRAY fifo=%d",fifonum(f));
@@ -610,6 +620,11 @@ exectasks(int nosetjmp)
 			goto runit;
 		}
 
+		/* The string collector does a slice of work along */
+		/* with each check of realtime stuff. */
+		if ( Strgcpending )
+			strgcslice();
+
 		// mdep_popup("TJT DEBUG exectasks loop AA");
 		if ( Running != NULL )
 			tmout = 0;
@@ -657,11 +672,13 @@ exectasks(int nosetjmp)
 	runit:
 
 		// mdep_popup("TJT DEBUG exectasks loop DD");
-		for ( T=Running; T!=NULL; T=T->nextrun ) {
+		for ( T=Running; T!=NULL; T=nextrunning(T) ) {
 
+			/* The queues are in priority order, so nothing */
+			/* after this one can run either. */
 			if ( T->priority < Currpriority )
-				continue;
-				
+				break;
+
 			b = SCAN_FUNCCODE(Pc);
 			if ( b >= nbytenames || b < 0 ) {
 				fatalerror("Invalid byte code!!\n");
@@ -677,10 +694,10 @@ exectasks(int nosetjmp)
 		}
 
 		if ( (Chkstuff!=0) && (ccnt-- <= 0) ) {
-			if ( Tobechecked != NULL ) phcheck();
-			if ( Htobechecked != NULL ) htcheck();
-			Chkstuff = 0;
-			ccnt = (int)*Checkcount;
+			/* Reclaim in slices; if there's more left, */
+			/* do another slice on the next pass. */
+			Chkstuff = reclaimslice();
+			ccnt = Chkstuff ? 0 : (int)*Checkcount;
 		}
 		// mdep_popup("TJT DEBUG exectasks loop EE");
 
@@ -746,7 +763,7 @@ i_objvareval(void)
 		execerror("object expression expects an object, but got %s!",atypestr(d2.type));
 	o = d2.u.obj;
 
-	s = findobjsym(p,o,&fo);
+	s = findobjsymcache(Pc,p,o,&fo);
 	if ( s == NULL ) {
 		execerror("No element '%s' in object $%ld !?",
 			p,o->id);
@@ -868,11 +885,9 @@ i_objvarpush(void)
 	obj = d2.u.obj;
 	if ( obj == NULL )
 		execerror("Internal error, obj==NULL in objvarpush!?");
-	if ( obj->symbols == NULL )
-		execerror("Internal error, symbols==NULL in objvarpush!?");
 	if ( obj->id != T->obj->id && obj->id != T->realobj->id )
 		execerror("Element .%s of object $%ld can only be set from within a method!",p,obj->id);
-	s = syminstall(p,obj->symbols,VAR);	/* NOT findobjsym */
+	s = objinstall(obj,p);	/* NOT findobjsym */
 	pushexp(symdatum(s));
 }
 
@@ -903,7 +918,7 @@ i_objcallfuncpush(void)
 		execerror("Attempt to call object method (%s) on a non-object value!?",p);
 	o = d2.u.obj;
 
-	s = findobjsym(p,o,&fo);
+	s = findobjsymcache(Pc,p,o,&fo);
 	if ( s == NULL ) {
 		execerror("Element '%s' of object $%ld doesn't exist!?",
 			p,o->id);
@@ -1005,7 +1020,9 @@ i_pushinfo(void)
 	popinto(d);
 	if ( d.type != D_STR )
 		execerror("Internal error, i_pushinfo expected a D_STR!?");
-	T->filename = d.u.str;
+	/* T->filename is marked with the task, but it mustn't */
+	/* be a transient string that could be freed from under it */
+	T->filename = strintern(d.u.str);
 
 	pushnum(currlinenum)
 	pushexp(strdatum(currfilename));
@@ -1020,7 +1037,7 @@ i_popinfo(void)
 	if ( d.type != D_STR )
 		execerror("Hey, i_popinfo didn't get D_STR? got %s\n",atypestr(d.type));
 	else
-		T->filename = d.u.str;
+		T->filename = strintern(d.u.str);
 	popinto(d);
 	if ( d.type != D_NUM )
 		execerror("Hey, i_popinfo didn't get D_NUM? got %s\n",atypestr(d.type));
@@ -1111,8 +1128,6 @@ i_classinit(void)
 		o = defaultobject(newobjectid(),COMPLAIN);
 	if ( o==NULL || o->id <= 0 )
 		execerror("Internal error, invalid object in i_classinit!?");
-	if ( o->symbols == NULL )
-		execerror("Internal error, o->symbols==NULL in i_classinit?");
 
 	/* There are pairs of values on the stack (method function and name),*/
 	/* terminated by the class name. */
@@ -1122,15 +1137,16 @@ i_classinit(void)
 			break;
 		popinto(d2);
 		/* d is the function, d2 is the method name */
-		sym = syminstall(uniqstr(d2.u.str),o->symbols,VAR);
+		sym = objinstall(o,uniqstr(d2.u.str));
 		*symdataptr(sym) = d;
+		strgcbarrier(d);
 	}
 
 	/* The name of the class is put into a data element */
 	/* (named "class") in the object. */
 	setdata(o,"class",d);
 
-	/* hashvisit(o->symbols,printmeth); */
+	/* objvisit(o,printmeth); */
 
 	/* This will be the return value of the class function. */
 	pushexp(objdatum(o));
@@ -1140,7 +1156,7 @@ i_classinit(void)
 	/* necessary stuff for this method invocation is done in the yacc */
 	/* grammar. */
 
-	sym = findsym(Str_init.u.str,o->symbols);
+	sym = objfindsym(o,Str_init.u.str);
 	if ( sym == NULL )
 		execerror("No init method found in i_classinit\n");
 
@@ -1234,6 +1250,7 @@ i_forin2(void)
 		clearsym(d3.u.sym);
 		d3.u.sym->stype = VAR;
 		*symdataptr(d3.u.sym) = subd;
+		strgcbarrier(subd);
 		(Stackp-3)->u.val = v1 + 1;
 	}
 	else
@@ -1786,7 +1803,7 @@ rmalltasksfifos(void)
 {
 	clearht(Tasktable);
 	T = NULL;
-	setrunning((Ktaskp)NULL);
+	clearrunning();
 	closeallfifos();
 }
 
@@ -1940,7 +1957,14 @@ newtask(Codep cp)
 		t->priority = T->priority;
 	}
 	else {
-		t->priority = (int)*Defpriority;
+		/* Defpriority is user-settable, and linktask() indexes */
+		/* Runqs with it, so keep it within 0..MAXPRIORITY. */
+		int prio = (int)*Defpriority;
+		if ( prio < 0 )
+			prio = 0;
+		else if ( prio > MAXPRIORITY )
+			prio = MAXPRIORITY;
+		t->priority = prio;
 	}
 
 	t->pc = cp;
@@ -1951,9 +1975,37 @@ newtask(Codep cp)
 }
 
 void
-setrunning(Ktaskp t)
+clearrunning(void)
 {
-	Running = t;
+	Runq *rq;
+	Ktaskp t;
+
+	for ( rq=Toprunq; rq!=NULL; rq=rq->next ) {
+		for ( t=rq->head; t!=NULL; t=t->nextrun )
+			t->prevrun = NULL;
+		rq->head = NULL;
+	}
+	Toprunq = NULL;
+	Running = NULL;
+}
+
+/* The task to run after t, or NULL if there are no more at */
+/* Currpriority or above. */
+Ktaskp
+nextrunning(Ktaskp t)
+{
+	Runq *rq;
+
+	if ( t->nextrun != NULL )
+		return t->nextrun;
+	/* t->runq rather than t->priority, which may have changed */
+	/* since t was queued. */
+	if ( t->runq == NULL )
+		return NULL;
+	rq = t->runq->next;
+	if ( rq == NULL || rq->priority < Currpriority )
+		return NULL;
+	return rq->head;
 }
 
 void
@@ -2180,11 +2232,14 @@ printrunning(char *s)
 {
 	char *sep = "";
 	Ktaskp t;
+	Runq *rq;
 
 	eprint("RUNNING Tasks (%s) = ",s);
-	for ( t=Running; t!=NULL; t=t->nextrun ) {
-		eprint("%s%ld",sep,t->tid);
-		sep = ",";
+	for ( rq=Toprunq; rq!=NULL; rq=rq->next ) {
+		for ( t=rq->head; t!=NULL; t=t->nextrun ) {
+			eprint("%s%ld",sep,t->tid);
+			sep = ",";
+		}
 	}
 	eprint("\n");
 }
@@ -2255,6 +2310,9 @@ newtp(int state)
 	t->anychild = 0;
 	t->anywait = 0;
 	t->priority = 0;
+	t->nextrun = NULL;
+	t->prevrun = NULL;
+	t->runq = NULL;
 	t->onexit = NULL;
 	t->onexitargs = NULL;
 	t->ontaskerror = NULL;
@@ -2263,6 +2321,10 @@ newtp(int state)
 	t->qmarkframe = NULL;
 	t->linenum = 0;
 	t->filename = "";
+	t->locks = NULL;
+	t->nlocks = 0;
+	t->lockwaits = 0;
+	t->lockwaitms = 0;
 	t->tid = Tid++;
 	/* Add it to Tasktable */
 	h = hashtable(Tasktable,numdatum(t->tid),H_INSERT);
@@ -2276,8 +2338,34 @@ newtp(int state)
 void
 linktask(Ktaskp p)
 {
-	p->nextrun = Running;
-	setrunning(p);
+	Runq *rq = &Runqs[p->priority];
+	Runq *prev = NULL;
+	Runq *nxt;
+
+	if ( rq->head == NULL ) {
+		/* This priority didn't have any tasks, so its queue */
+		/* goes into the list, which is kept in priority order. */
+		rq->priority = p->priority;
+		for ( nxt=Toprunq; nxt!=NULL; prev=nxt,nxt=nxt->next ) {
+			if ( nxt->priority < p->priority )
+				break;
+		}
+		rq->next = nxt;
+		rq->prev = prev;
+		if ( nxt != NULL )
+			nxt->prev = rq;
+		if ( prev == NULL )
+			Toprunq = rq;
+		else
+			prev->next = rq;
+	}
+	p->nextrun = rq->head;
+	p->prevrun = NULL;
+	if ( rq->head != NULL )
+		rq->head->prevrun = p;
+	rq->head = p;
+	p->runq = rq;
+	Running = Toprunq->head;
 }
 
 void
@@ -2309,23 +2397,65 @@ deletetask(Ktaskp t)
 	(void) hashtable(Tasktable,numdatum(t->tid),H_DELETE);
 }
 
+/* Returns 1 if p was runnable.  It's removed from the queue it */
+/* was put on (p->runq), not the one for its current priority. */
+static int
+unlinkrunq(Ktaskp p)
+{
+	Runq *rq = p->runq;
+
+/* eprint("UNLINKTASK, t=%ld tid=%ld\n",(long)p,p->tid); */
+	if ( rq == NULL || (p->prevrun == NULL && rq->head != p) )
+		return 0;
+	if ( p->prevrun == NULL )
+		rq->head = p->nextrun;
+	else
+		p->prevrun->nextrun = p->nextrun;
+	if ( p->nextrun != NULL )
+		p->nextrun->prevrun = p->prevrun;
+	p->prevrun = NULL;
+	if ( rq->head == NULL ) {
+		/* The queue is empty, take it out of the list.  Its */
+		/* next is left alone, like p->nextrun and p->runq, */
+		/* for exectasks(). */
+		if ( rq->prev == NULL )
+			Toprunq = rq->next;
+		else
+			rq->prev->next = rq->next;
+		if ( rq->next != NULL )
+			rq->next->prev = rq->prev;
+	}
+	Running = Toprunq ? Toprunq->head : NULL;
+	return 1;
+}
+
 void
 unlinktask(Ktaskp p)
 {
-	Ktaskp q;
-	Ktaskp r = NULL;
-
 	if ( p == NULL )
 		return;
-/* eprint("UNLINKTASK, t=%ld tid=%ld\n",(long)p,p->tid); */
-	for ( q=Running; q!=NULL && q!=p; r=q,q=q->nextrun )
-		;
-	if ( q == NULL )
+	(void) unlinkrunq(p);
+}
+
+/* Change a task's priority, moving it to the new queue if it's runnable */
+void
+settaskpriority(Ktaskp t,int prio)
+{
+	if ( t->priority == prio )
 		return;
-	if ( r == NULL )
-		setrunning(p->nextrun);
+	if ( unlinkrunq(t) ) {
+		t->priority = prio;
+		linktask(t);
+	}
 	else
-		r->nextrun = p->nextrun;
+		t->priority = prio;
+}
+
+/* Is anything at priority prio or above runnable? */
+int
+anyrunning(int prio)
+{
+	return ( Toprunq != NULL && Toprunq->priority >= prio );
 }
 
 void
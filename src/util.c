@@ -50,7 +50,7 @@ void
 httobechecked(register Htablep p)
 {
 	/* if it's already in the list... */
-	if ( p->h_state == HT_TOBECHECKED )
+	if ( (p->h_state & HT_TOBECHECKED) != 0 )
 		return;
 	/* remove it from original list */
 	if ( p == Topht )
@@ -63,7 +63,7 @@ httobechecked(register Htablep p)
 
 	p->h_next = Htobechecked;
 	p->h_prev = NULL;
-	p->h_state = HT_TOBECHECKED;
+	p->h_state |= HT_TOBECHECKED;
 	if ( Htobechecked != NULL )
 		Htobechecked->h_prev = p;
 	Htobechecked = p;
@@ -200,24 +200,56 @@ ph1dump(Phrasep p)
 		(KEY_PRIdTYPE)p,num,(int)(p->p_used),(int)(p->p_tobe));tprint(Msg1);
 }
 
-void
-phcheck(void)
+/*
+ * Dead phrases and arrays are reclaimed in slices, so that dropping
+ * a huge phrase or array doesn't stall realtime output.  A slice
+ * (see reclaimslice(), called from exectasks()) handles at most
+ * *Reclaimlimit items - phrases, arrays, or array elements - and
+ * stops early once *Reclaimtime milliseconds have gone by.
+ * Arrays with no users are moved to the Htdraining list, and their
+ * elements are freed a slice at a time before the table itself
+ * goes onto the Freeht list.  phcheck() and htcheck() do everything
+ * at once, as garbcollect() expects.  A phrase counts as one item
+ * however many notes it has, which relies on ntrelease() parking the
+ * notes without walking them.
+ */
+Htablep Htdraining = NULL;
+static int Htdrainpos = 0;	/* next bucket to clear in Htdraining */
+static long Rcdeadline = 0;
+
+static long Rcslices = 0;
+static long Rcitems = 0;
+static long Rclastpause = 0;
+static long Rcmaxpause = 0;
+static long Rctotalpause = 0;
+
+static int
+rcmore(long n,long budget)
+{
+	if ( budget > 0 && n >= budget )
+		return 0;
+	/* Checking the clock isn't free, so only do it now and then */
+	if ( Rcdeadline > 0 && n > 0 && (n & 63) == 0
+			&& MILLICLOCK >= Rcdeadline )
+		return 0;
+	return 1;
+}
+
+static long
+phslice(long budget)
 {
-	register Phrasep p, nxt;
+	register Phrasep p;
+	long n = 0;
 
-	dummyset(nxt);
-	for ( p=Tobechecked; p!=NULL; p=nxt ) {
+	while ( (p=Tobechecked) != NULL && rcmore(n,budget) ) {
 
 		p->p_used += p->p_tobe;
 		p->p_tobe = 0;
 
-		nxt = p->p_next;
-
 		/* remove it from Tobechecked list */
-		if ( p->p_prev != NULL )
-			p->p_prev->p_next = p->p_next;
-		if ( p->p_next != NULL )
-			p->p_next->p_prev = p->p_prev;
+		Tobechecked = p->p_next;
+		if ( Tobechecked != NULL )
+			Tobechecked->p_prev = NULL;
 
 		if ( p->p_used > 0 ) {
 			/* and add it back to Topph list */
@@ -232,7 +264,7 @@ phcheck(void)
 		else {
 			Noteptr fn = realfirstnote(p);
 			if ( fn )
-				freents(fn);
+				ntrelease(fn);
 			reinitph(p);
 			/* and add it to free list */
 			p->p_next = Freeph;
@@ -241,38 +273,88 @@ phcheck(void)
 				Freeph->p_prev = p;
 			Freeph = p;
 		}
+		n++;
+		chkrealoften();
 	}
-	Tobechecked = NULL;
+	return n;
 }
 
 void
-htcheck(void)
+phcheck(void)
 {
-	register Htablep h, nxt, savelist;
+	(void) phslice(0L);
+}
 
-#ifdef lint
-	nxt=0;
-#endif
-	/* This is important, because the call to freeht below may */
-	/* start adding things back onto the Htobechecked list! */
-if(*Debugmalloc>1)eprint("HTCHECK START\n");
-	savelist = Htobechecked;
-	Htobechecked = NULL;
+/* Free the elements of tables in the Htdraining list, */
+/* until the budget runs out. */
+static long
+htdrain(long budget)
+{
+	register Htablep h;
+	register Hnodep hn;
+	long n = 0;
 
-	for ( h=savelist; h!=NULL; h=nxt ) {
+	while ( (h=Htdraining) != NULL ) {
+		while ( Htdrainpos < h->size ) {
+			while ( (hn=h->nodetable[Htdrainpos]) != NULL ) {
+				if ( ! rcmore(n,budget) )
+					return n;
+				h->nodetable[Htdrainpos] = hn->next;
+				h->count--;
+				/* This may add things to the Tobechecked */
+				/* and Htobechecked lists. */
+				freehn(hn);
+				n++;
+				chkrealoften();
+			}
+			Htdrainpos++;
+		}
+		while ( h->densen > 0 ) {
+			if ( ! rcmore(n,budget) )
+				return n;
+			(void) htpopdense(h);
+			n++;
+			chkrealoften();
+		}
+		Htdraining = h->h_next;
+		if ( Htdraining != NULL )
+			Htdraining->h_prev = NULL;
+		Htdrainpos = 0;
+		h->h_next = NULL;
+		h->h_prev = NULL;
+		h->count = 0;
+		freeht(h);	/* the table is empty, this just saves it */
+		n++;
+	}
+	return n;
+}
 
-		nxt = h->h_next;
+static long
+htslice(long budget)
+{
+	register Htablep h;
+	long n = 0;
+
+if(*Debugmalloc>1)eprint("HTCHECK START\n");
+	while ( rcmore(n,budget) ) {
+
+		if ( Htdraining != NULL ) {
+			n += htdrain(budget > 0 ? budget-n : 0L);
+			continue;
+		}
+		if ( (h=Htobechecked) == NULL )
+			break;
 
 		h->h_used += h->h_tobe;
 if(*Debug>1)eprint("SUMMED h=%lld used=%d\n",(intptr_t)h,h->h_used);
 		h->h_tobe = 0;
 
-		/* remove it from Tobechecked list */
-		if ( h->h_prev != NULL )
-			h->h_prev->h_next = h->h_next;
-		if ( h->h_next != NULL )
-			h->h_next->h_prev = h->h_prev;
-		h->h_state = 0;
+		/* remove it from Htobechecked list */
+		Htobechecked = h->h_next;
+		if ( Htobechecked != NULL )
+			Htobechecked->h_prev = NULL;
+		h->h_state &= ~HT_TOBECHECKED;
+		n++;
 
 		if ( h->h_used > 0 ) {
 if(*Debug>1)eprint("htcheck, h=%lld still used\n",(intptr_t)h);
@@ -286,12 +368,97 @@ if(*Debug>1)eprint("htcheck, h=%lld still used\n",(intptr_t)h);
 			/* There's a but somewhere - occasionally, an h */
 			/* gets into the Htobechecked list that is bogus. */
 			tprint("h_used < 0, not freeing h\n");
-			break;
+			h->h_next = NULL;
+			h->h_prev = NULL;
 		} else {
-if(*Debug>1)eprint("htcheck calling freeht on %lld used=%d tobe=%d\n",(intptr_t)h,h->h_used,h->h_tobe);
-			freeht(h);
+if(*Debug>1)eprint("htcheck draining %lld used=%d tobe=%d\n",(intptr_t)h,h->h_used,h->h_tobe);
+			/* The table being drained stays at the */
+			/* front, so Htdrainpos remains valid. */
+			h->h_state |= HT_DRAINING;
+			htfinishrehash(h);
+			if ( Htdraining == NULL ) {
+				h->h_next = NULL;
+				h->h_prev = NULL;
+				Htdraining = h;
+			}
+			else {
+				h->h_next = Htdraining->h_next;
+				h->h_prev = Htdraining;
+				if ( h->h_next != NULL )
+					h->h_next->h_prev = h;
+				Htdraining->h_next = h;
+			}
 		}
 	}
+	return n;
+}
+
+void
+htcheck(void)
+{
+	(void) htslice(0L);
+}
+
+/* Do one slice of reclamation, and return non-zero if there's */
+/* still work left to be done. */
+int
+reclaimslice(void)
+{
+	long budget = *Reclaimlimit;
+	long start, pause, n;
+
+	start = MILLICLOCK;
+	Rcdeadline = (*Reclaimtime > 0) ? start + *Reclaimtime : 0;
+
+	n = phslice(budget);
+	if ( budget <= 0 || n < budget )
+		n += htslice(budget > 0 ? budget-n : 0L);
+	Rcdeadline = 0;
+
+	pause = MILLICLOCK - start;
+	Rcslices++;
+	Rcitems += n;
+	Rclastpause = pause;
+	Rctotalpause += pause;
+	if ( pause > Rcmaxpause )
+		Rcmaxpause = pause;
+
+	return ( Tobechecked != NULL || Htobechecked != NULL || Htdraining != NULL );
+}
+
+static long
+htdrainingcount(void)
+{
+	Htablep h;
+	long n = 0;
+
+	for ( h=Htdraining; h!=NULL; h=h->h_next )
+		n++;
+	return n;
+}
+
+Datum
+reclaimstatsarr(void)
+{
+	Datum da;
+	Htablep arr;
+
+	da = newarrdatum(0,11);
+	arr = da.u.arr;
+	setarraydata(arr,strdatum(uniqstr("slices")),numdatum(Rcslices));
+	setarraydata(arr,strdatum(uniqstr("items")),numdatum(Rcitems));
+	setarraydata(arr,strdatum(uniqstr("lastpause")),numdatum(Rclastpause));
+	setarraydata(arr,strdatum(uniqstr("maxpause")),numdatum(Rcmaxpause));
+	setarraydata(arr,strdatum(uniqstr("totalpause")),numdatum(Rctotalpause));
+	setarraydata(arr,strdatum(uniqstr("draining")),numdatum(htdrainingcount()));
+	return da;
+}
+
+void
+reclaimstatsprint(void)
+{
+	eprint("reclaim: slices=%ld items=%ld lastpause=%ld maxpause=%ld totalpause=%ld draining=%ld\n",
+		Rcslices,Rcitems,Rclastpause,Rcmaxpause,Rctotalpause,htdrainingcount());
 }
 
 /* This sequence number is used to represent a pseudo-modification-time */
@@ -1074,6 +1241,10 @@ getnopen(char *name,char *mode)
 		execerror("No pipes!");
 #endif
 	}
+	else if ( mode[1] == 'b' ) {
+		/* binary file, e.g. a binary phrase */
+		OPENBINFILE(f,name,mode);
+	}
 	else {
 		/* normal file */
 		OPENTEXTFILE(f,name,mode);
@@ -1164,9 +1335,22 @@ freeinode(Instnodep in)
 	Ifree = in;
 }
 
-Lknode *Toplk = NULL;
+/* Locks are kept in Lktable, hashed by their (interned) name.  Only */
+/* the head of each lock is in the table - tasks waiting for a lock */
+/* are queued on its notify list, in the order they asked for it. */
+/* The queue is doubly linked, and each queued node points to its */
+/* head, so a node can be taken out of it directly.  Each task also */
+/* has a list (Task.locks) of the nodes it owns, heads and queued */
+/* ones, so unlocktid() doesn't search the table. */
+Lknode **Lktable = NULL;
+int Lktablesize = 0;
+static int Lkcount = 0;
 Lknode *Freelk = NULL;
 
+#define LKINITSIZE 64
+
+#define lkbucket(nm,size) ((int)((((intptr_t)(nm))>>3) % (size)))
+
 Lknode *
 newlk(Symstr nm)
 {
@@ -1194,23 +1378,86 @@ newlk(Symstr nm)
 	lk->owner = NULL;
 	lk->next = NULL;
 	lk->notify = NULL;
+	lk->prevnotify = NULL;
+	lk->lkhead = NULL;
+	lk->lastnotify = NULL;
+	lk->nnotify = 0;
+	lk->tnext = NULL;
+	lk->tprev = NULL;
 /* eprintf("NEWLK lk=%ld\n",lk); */
 	return(lk);
 }
 
+/* Change the owner of a lock node (t can be NULL), */
+/* keeping the Task.locks lists up to date. */
+void
+lksetowner(Lknode *lk,Ktaskp t)
+{
+	Ktaskp old = lk->owner;
+
+	if ( old != NULL ) {
+		if ( lk->tprev != NULL )
+			lk->tprev->tnext = lk->tnext;
+		else
+			old->locks = lk->tnext;
+		if ( lk->tnext != NULL )
+			lk->tnext->tprev = lk->tprev;
+	}
+	lk->owner = t;
+	lk->tprev = NULL;
+	if ( t != NULL ) {
+		lk->tnext = t->locks;
+		if ( t->locks != NULL )
+			t->locks->tprev = lk;
+		t->locks = lk;
+	}
+	else
+		lk->tnext = NULL;
+}
+
+static void
+lkgrow(void)
+{
+	Lknode **oldtable = Lktable;
+	int oldsize = Lktablesize;
+	Lknode *lk, *nextlk;
+	int n, b;
+
+	Lktablesize = (oldsize == 0) ? LKINITSIZE : oldsize*2;
+	Lktable = (Lknode **) kmalloc(Lktablesize*sizeof(Lknode*),"lkgrow");
+	for ( n=0; n<Lktablesize; n++ )
+		Lktable[n] = NULL;
+	for ( n=0; n<oldsize; n++ ) {
+		for ( lk=oldtable[n]; lk!=NULL; lk=nextlk ) {
+			nextlk = lk->next;
+			b = lkbucket(lk->name,Lktablesize);
+			lk->next = Lktable[b];
+			Lktable[b] = lk;
+		}
+	}
+	if ( oldtable != NULL )
+		kfree(oldtable);
+}
+
 void
 unlinklk(Lknode *lk)
 {
 	Lknode *lk2, *prelk;
-	for ( lk2=Toplk,prelk=NULL; lk2!=NULL && lk2!=lk; prelk=lk2,lk2=lk2->next )
+	int b;
+
+	if ( Lktablesize == 0 )
+		execerror("Hey, unlinklk didn't find node!?");
+	b = lkbucket(lk->name,Lktablesize);
+	for ( lk2=Lktable[b],prelk=NULL; lk2!=NULL && lk2!=lk; prelk=lk2,lk2=lk2->next )
 		;
 	if ( lk2 == NULL )
 		execerror("Hey, unlinklk didn't find node!?");
-	/* Remove it from the Toplk list */
+	/* Remove it from its Lktable chain */
 	if ( prelk == NULL )
-		Toplk = lk->next;
+		Lktable[b] = lk->next;
 	else
 		prelk->next = lk->next;
+	Lkcount--;
 /* eprint("UNLINK lk=%ld\n",lk); */
 	freelk(lk);
 }
@@ -1224,52 +1471,78 @@ freelk(Lknode *lk)
 	Freelk = lk;
 }
 
-Lknode *
-findtoplk(Symstr nm)
+/* The head of the lock named nm, or NULL */
+static Lknode *
+looktoplk(Symstr nm)
 {
 	Lknode *lk;
 
-	for ( lk=Toplk; lk!=NULL; lk=lk->next ) {
+	if ( Lktablesize == 0 )
+		return NULL;
+	for ( lk=Lktable[lkbucket(nm,Lktablesize)]; lk!=NULL; lk=lk->next ) {
 		if ( nm == lk->name )
 			return lk;
 	}
-	/* create a new one and add it to list */
+	return NULL;
+}
+
+Lknode *
+findtoplk(Symstr nm)
+{
+	Lknode *lk;
+	int b;
+
+	if ( Lkcount >= 2*Lktablesize )
+		lkgrow();
+	if ( (lk=looktoplk(nm)) != NULL )
+		return lk;
+	b = lkbucket(nm,Lktablesize);
+	/* create a new one and add it to the table */
 	lk = newlk(nm);
-	lk->next = Toplk;
-	Toplk = lk;
+	lk->next = Lktable[b];
+	Lktable[b] = lk;
+	Lkcount++;
 	return(lk);
 }
 
-/* Unlock all locks held by a task */
+/* Take a queued node out of its lock's notify queue */
+static void
+unqueuelk(Lknode *lk)
+{
+	Lknode *head = lk->lkhead;
+
+	if ( lk->prevnotify == NULL )
+		head->notify = lk->notify;
+	else
+		lk->prevnotify->notify = lk->notify;
+	if ( lk->notify == NULL )
+		head->lastnotify = lk->prevnotify;
+	else
+		lk->notify->prevnotify = lk->prevnotify;
+	head->nnotify--;
+	lk->notify = lk->prevnotify = lk->lkhead = NULL;
+}
+
+/* Unlock all locks held by a task, and take it out of the queues */
+/* of the ones it's waiting for. */
 void
 unlocktid(Ktaskp t)
 {
-	Lknode *lk, *nextlk;
-	Lknode *lk2, *nextlk2, *prelk2;
-
-	for ( lk=Toplk; lk!=NULL; lk=nextlk ) {
-		/* scan queued up locks */
-		for ( prelk2=NULL,lk2=lk->notify; lk2!=NULL; lk2=nextlk2 ) {
-			nextlk2 = lk2->notify;
-			if ( lk2->owner == t ) {
-				/* The lock isn't currently owned by this */
-				/* task, but it's queued up to be owned. */
-				/* So, we just remove it (there's no other */
-				/* effect.) */
-				if ( prelk2 == NULL )
-					lk->notify = nextlk2;
-				else
-					prelk2->notify = nextlk2;
-				freelk(lk2);
-				/* don't change prelk2 */
-			}
-			else
-				prelk2 = lk2;
+	Lknode *lk;
+
+	while ( (lk=t->locks) != NULL ) {
+		/* off t->locks first, so this always makes progress */
+		lksetowner(lk,NULL);
+		t->nlocks--;
+		if ( lk->lkhead != NULL ) {
+			/* Queued up to be owned, so just remove it */
+			unqueuelk(lk);
+			freelk(lk);
 		}
-		/* now take a look at the current owner of the lock */
-		nextlk = lk->next;
-		if ( lk->owner == t )
+		else {
+			/* The head, so the lock goes to the next in line */
 			unlocklk(lk);
+		}
 	}
 }
 
@@ -1279,9 +1552,11 @@ unlocklk(Lknode *lk)
 {
 	Ktaskp t, rt;
 
+	if ( lk->owner != NULL )
+		lk->owner->nlocks--;
 	if ( lk->notify == NULL ) {
 		/* No tasks are pending to get the lock. */
-		lk->owner = NULL;
+		lksetowner(lk,NULL);
 		rt = NULL;
 		unlinklk(lk);
 	}
@@ -1293,9 +1568,11 @@ unlocklk(Lknode *lk)
 
 		/* Just shift the info from the notify lk into the head, */
 		/* and then free the notify lk. */
-		lk->notify = nextlk->notify;
-		lk->owner = nextlk->owner;
+		unqueuelk(nextlk);
+		lksetowner(nextlk,NULL);
+		lksetowner(lk,t);
 		t->lock = lk;
+		t->lockwaitms += mdep_milliclock() - t->lockwaitstart;
 
 		freelk(nextlk);
 
@@ -1308,23 +1585,92 @@ unlocklk(Lknode *lk)
 	return(rt);
 }
 
+/* Forget the owner of a lock node that's being thrown away */
+static void
+lkdisown(Lknode *lk)
+{
+	if ( lk->owner != NULL ) {
+		lk->owner->nlocks = 0;
+		lk->owner->lock = NULL;
+	}
+	lksetowner(lk,NULL);
+}
+
 void
 rmalllocks(void)
 {
-	Lknode *lk;
+	Lknode *lk, *nextlk, *lk2;
+	int n;
 
-	while ( Toplk ) {
-		lk = Toplk;
-		Toplk = Toplk->next;
-		freelk(lk);
+	for ( n=0; n<Lktablesize; n++ ) {
+		for ( lk=Lktable[n]; lk!=NULL; lk=nextlk ) {
+			nextlk = lk->next;
+			while ( lk->notify != NULL ) {
+				lk2 = lk->notify;
+				lk->notify = lk2->notify;
+				lkdisown(lk2);
+				freelk(lk2);
+			}
+			lkdisown(lk);
+			freelk(lk);
+		}
+		Lktable[n] = NULL;
 	}
-	Toplk = NULL;
+	Lkcount = 0;
 }
 
 Kobjectp Topobj = NULL;
 Kobjectp Freeobj = NULL;
 long Nextobjid = 1;
 
+/* Objtable indexes the objects in Topobj by id.  Ids are normally */
+/* unique, but newobj() can be told not to complain about a duplicate, */
+/* in which case the newest one wins, like the old search of Topobj. */
+Htablep Objtable = NULL;
+static long Objdups = 0;
+
+/* Bumped whenever the elements an object lookup might find can */
+/* change - see findobjsymcache(). */
+long Objversion = 1;
+static long Objgen = 0;	/* for Kobject.gen */
+
+static void
+objindex(Kobjectp obj)
+{
+	Hnodep h;
+
+	if ( Objtable == NULL ) {
+		char *p = getenv("OBJHASHSIZE");
+		Objtable = newht( p ? atoi(p) : 67 );
+	}
+	h = hashtable(Objtable,numdatum(obj->id),H_INSERT);
+	if ( ! isnoval(h->val) )
+		Objdups++;
+	h->val = objdatum(obj);
+}
+
+static void
+objunindex(Kobjectp obj)
+{
+	Hnodep h;
+	Kobjectp o;
+
+	h = hashtable(Objtable,numdatum(obj->id),H_LOOK);
+	if ( h == NULL || h->val.u.obj != obj )
+		return;
+	if ( Objdups > 0 ) {
+		/* Another object may have the same id */
+		for ( o=Topobj; o!=NULL; o=o->onext ) {
+			if ( o->id == obj->id && o != obj ) {
+				h->val = objdatum(o);
+				Objdups--;
+				return;
+			}
+		}
+	}
+	(void) hashtable(Objtable,numdatum(obj->id),H_DELETE);
+}
+
 Kobjectp
 newobj(long id,int complain)
 {
@@ -1337,12 +1683,9 @@ newobj(long id,int complain)
 		;	/* object $0 is like NULL */
 	}
 	else if ( complain ) {
-		Kobjectp to;
 		/* Make sure the requested id # isn't already in use. */
-		for ( to=Topobj; to!=NULL; to=to->onext ) {
-			if ( to->id == id )
-				execerror("Hey, object id %ld is already in use!?",id);
-		}
+		if ( findobjnum(id) != NULL )
+			execerror("Hey, object id %ld is already in use!?",id);
 	}
 	/* First check the free list and use those nodes, before using */
 	/* the newly allocated stuff. */
@@ -1357,8 +1700,10 @@ newobj(long id,int complain)
 	}
 	used++;
 	obj = lastobj++;
-	obj->symbols = newht(13);	/* only when first allocated */
+	obj->symbols = NULL;	/* allocated when needed, see objinstall() */
     getout:
+	obj->gen = ++Objgen;
+	objslotsinit(obj);
 	obj->inheritfrom = NULL;
 	obj->nextinherit = NULL;
 	obj->children = NULL;
@@ -1367,7 +1712,11 @@ newobj(long id,int complain)
 	if ( id >= Nextobjid )
 		Nextobjid = id+1;
 	obj->onext = Topobj;
+	obj->oprev = NULL;
+	if ( Topobj != NULL )
+		Topobj->oprev = obj;
 	Topobj = obj;
+	objindex(obj);
 
 /* sprintf(buff,"newobject end, id=%d",obj->id); mdep_popup(buff); */
 
@@ -1377,33 +1726,30 @@ newobj(long id,int complain)
 Kobjectp
 findobjnum(long n)
 {
-	Kobjectp o;
-/* sprintf(Msg1,"findobjnum start, n=%d",n); mdep_popup(Msg1); */
-	for ( o=Topobj; o!=NULL; o=o->onext ) {
-		if ( o->id == n ) {
-/* sprintf(Msg1,"findobjnum found! n=%d",n); mdep_popup(Msg1); */
-			return o;
-		}
-	}
-/* sprintf(Msg1,"findobjnum didn't find ! n=%d",n); mdep_popup(Msg1); */
-	return NULL;
+	Hnodep h;
+
+	if ( Objtable == NULL )
+		return NULL;
+	h = hashtable(Objtable,numdatum(n),H_LOOK);
+	if ( h == NULL )
+		return NULL;
+	return h->val.u.obj;
 }
 
 void
 unlinkobj(Kobjectp o)
 {
-	Kobjectp o2;
-	Kobjectp preo;
-
-	for ( o2=Topobj,preo=NULL; o2!=NULL && o2!=o; preo=o2,o2=o2->onext )
-		;
-	if ( o2 == NULL )
+	if ( o->oprev == NULL && Topobj != o )
 		execerror("Hey, unlinkobj didn't find object!?");
 	/* Remove it from the Topobj list */
-	if ( preo == NULL )
+	if ( o->oprev == NULL )
 		Topobj = o->onext;
 	else
-		preo->onext = o->onext;
+		o->oprev->onext = o->onext;
+	if ( o->onext != NULL )
+		o->onext->oprev = o->oprev;
+	o->oprev = NULL;
+	objunindex(o);
 }
 
 void
@@ -1414,7 +1760,13 @@ freeobj(Kobjectp o)
 	unlinkobj(o);
 	o->id = -1;
 
-	clearht(o->symbols);	/* but don't free table itself, it's reused */
+	/* Cache entries for o itself no longer match, since its gen */
+	/* changes, but lookups through inheritance may have found */
+	/* elements of o on behalf of other objects. */
+	o->gen = ++Objgen;
+	if ( o->oflags & KOBJ_INHERIT )
+		Objversion++;
+	objclear(o);
 
 /* sprintf(Msg1,"freeobj o->id=%d",o->id);popup(Msg1); */
 
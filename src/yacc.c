@@ -3087,7 +3087,7 @@ yyreduce:
 case 1:
 #line 68 "gram.y"
 {
-				code2(funcinst(I_STRINGPUSH), strinst(Infile));
+				code2(funcinst(I_STRINGPUSH), strinst(Infile?uniqstr(Infile):Nullstr));
 				code2(funcinst(I_CONSTANT),numinst(Lineno));
 				code(funcinst(I_PUSHINFO));
 				}
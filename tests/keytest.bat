@@ -5,3 +5,12 @@ if "%KEYTEST_EXE%"=="" set KEYTEST_EXE=..\src\key.exe
 echo Running stringstress test ...
 "%KEYTEST_EXE%" stringstress.k > stringstress.out
 diff -b stringstress.out stringstress.sav
+
+echo Running limitsloop test ...
+"%KEYTEST_EXE%" limitsloop.k > limitsloop.out
+diff -b limitsloop.out limitsloop.sav
+
+echo Running binphrase test ...
+"%KEYTEST_EXE%" binphrase.k > binphrase.out
+del binphrase.tmp
+diff -b binphrase.out binphrase.sav
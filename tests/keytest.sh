@@ -3,3 +3,12 @@ KEYTEST_EXE=${KEYTEST_EXE:-../src/key.exe}
 echo Running stringstress test ...
 "$KEYTEST_EXE" stringstress.k > stringstress.out
 diff stringstress.out stringstress.sav
+
+echo Running limitsloop test ...
+"$KEYTEST_EXE" limitsloop.k > limitsloop.out
+diff limitsloop.out limitsloop.sav
+
+echo Running binphrase test ...
+"$KEYTEST_EXE" binphrase.k > binphrase.out
+rm -f binphrase.tmp
+diff binphrase.out binphrase.sav